@@ -0,0 +1,609 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Benchmarks of the paths that do not involve the kernel: compiling
+ * scripts, draining events from a perf ring and dumping maps. Nothing
+ * is loaded or attached, so the numbers can be compared between
+ * commits on any machine, without root. Generated programs are also
+ * checked for encodings that the verifier would reject. */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+
+#include <ply/ast.h>
+#include <ply/compile.h>
+#include <ply/evpipe.h>
+#include <ply/map.h>
+#include <ply/ply.h>
+#include <ply/pvdr.h>
+#include <ply/symtable.h>
+
+struct globals G;
+FILE *scriptfp;
+
+/* maps and events are only ever handed to the dumpers, the fd of the
+ * event map is never used. */
+static evpipe_t bench_evp = { .mapfd = -1 };
+
+static int reps = 100;
+static int max_entries = 1000000;
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static node_t *bench_parse(const char *src)
+{
+	node_t *script;
+	FILE *fp;
+
+	fp = fmemopen((void *)src, strlen(src), "r");
+	if (!fp)
+		return NULL;
+
+	script = node_script_parse(fp);
+	fclose(fp);
+	return script;
+}
+
+static int bench_annotate(node_t *script)
+{
+	int err;
+
+	err = pvdr_resolve(script);
+	if (err)
+		return err;
+
+	err = annotate_script(script);
+	if (err)
+		return err;
+
+	script->dyn->script.evp = &bench_evp;
+	return 0;
+}
+
+static node_t *bench_load(const char *src)
+{
+	node_t *script;
+
+	script = bench_parse(src);
+	if (!script)
+		return NULL;
+
+	if (bench_annotate(script)) {
+		node_free(script);
+		return NULL;
+	}
+
+	return script;
+}
+
+static sym_t *bench_map(node_t *script, const char *name)
+{
+	sym_t *s;
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type == TYPE_MAP && !strcmp(s->name, name))
+			return s;
+	}
+
+	return NULL;
+}
+
+static char *bench_slurp(const char *path)
+{
+	char *src = NULL;
+	size_t len = 0;
+	FILE *fp, *out;
+	int c;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return NULL;
+
+	out = open_memstream(&src, &len);
+	while ((c = fgetc(fp)) != EOF)
+		fputc(c, out);
+
+	fclose(out);
+	fclose(fp);
+	return src;
+}
+
+
+/* compiler: parse -> annotate -> compile, on each script */
+
+/* fields that the verifier requires to be zero */
+static int bench_insn_reserved(const struct bpf_insn *insn)
+{
+	if (insn->code == (BPF_JMP | BPF_JA))
+		return insn->dst_reg || insn->src_reg || insn->imm;
+
+	if (insn->code == (BPF_JMP | BPF_EXIT))
+		return insn->dst_reg || insn->src_reg || insn->off || insn->imm;
+
+	return 0;
+}
+
+static int bench_prog_check(const char *name, prog_t *prog)
+{
+	struct bpf_insn *insn;
+
+	for (insn = prog->insns; insn < prog->ip; insn++) {
+		if (!bench_insn_reserved(insn))
+			continue;
+
+		printf("    %-38s reserved fields set at insn %d\n", name,
+		       (int)(insn - prog->insns));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int bench_compile_script(const char *path)
+{
+	double t[4], parse = 0, annotate = 0, compile = 0;
+	node_t *script = NULL, *probe;
+	prog_t *prog;
+	char *src;
+	int i, err = 0;
+
+	src = bench_slurp(path);
+	if (!src) {
+		_eno("%s", path);
+		return -errno;
+	}
+
+	for (i = 0; i < reps; i++) {
+		t[0] = bench_now();
+		script = bench_parse(src);
+		t[1] = bench_now();
+		if (!script || bench_annotate(script)) {
+			err = -EINVAL;
+			break;
+		}
+		t[2] = bench_now();
+
+		node_foreach(probe, script->script.probes) {
+			prog = compile_probe(probe);
+			if (!prog) {
+				err = -EINVAL;
+				break;
+			}
+
+			prog_free(prog);
+		}
+		t[3] = bench_now();
+
+		parse    += t[1] - t[0];
+		annotate += t[2] - t[1];
+		compile  += t[3] - t[2];
+
+		/* the last pass is kept for the instruction counts */
+		if (err || i < reps - 1)
+			node_free(script);
+
+		if (err)
+			break;
+	}
+
+	if (err) {
+		printf("  %-40s (skipped, does not compile here)\n", path);
+		free(src);
+		return 0;
+	}
+
+	printf("  %-40s %10.1f %10.1f %10.1f\n", path,
+	       parse * 1e6 / reps, annotate * 1e6 / reps, compile * 1e6 / reps);
+
+	node_foreach(probe, script->script.probes) {
+		prog = compile_probe(probe);
+		printf("    %-38s %6d insns\n", probe->string,
+		       prog ? (int)(prog->ip - prog->insns) : -1);
+		if (!prog)
+			continue;
+
+		if (bench_prog_check(probe->string, prog))
+			err = -EINVAL;
+		prog_free(prog);
+	}
+
+	node_free(script);
+	free(src);
+	return err;
+}
+
+static int bench_compile(char **paths, int n)
+{
+	int i, err = 0;
+
+	printf("compile, %d passes, us/pass:\n  %-40s %10s %10s %10s\n",
+	       reps, "script", "parse", "annotate", "compile");
+
+	for (i = 0; i < n; i++)
+		err |= bench_compile_script(paths[i]);
+
+	return err;
+}
+
+
+/* optimizer: sequences that it has gotten wrong in the past */
+
+static const struct bench_opt_case {
+	const char *name;
+	struct bpf_insn insns[8];
+	int n_insns;
+} bench_opt_cases[] = {
+	{
+		/* the copy in r0 must not be substituted into the ja */
+		.name = "ja after a register copy",
+		.insns = {
+			JMP_IMM(BPF_JEQ, BPF_REG_1, 0, 2),
+			MOV(BPF_REG_0, BPF_REG_6),
+			JMP_IMM(BPF_JA, 0, 0, 1),
+			MOV_IMM(BPF_REG_0, 1),
+			EXIT,
+		},
+		.n_insns = 5,
+	},
+};
+
+static int bench_optimize(void)
+{
+	const struct bench_opt_case *c;
+	prog_t *prog;
+	int i, err = 0;
+
+	printf("optimizer cases:\n");
+
+	for (c = bench_opt_cases; c < &bench_opt_cases[
+		     sizeof(bench_opt_cases) / sizeof(bench_opt_cases[0])]; c++) {
+		prog = prog_new();
+		for (i = 0; i < c->n_insns; i++)
+			emit(prog, c->insns[i]);
+
+		if (prog_optimize(prog) || bench_prog_check(c->name, prog))
+			err = -EINVAL;
+		else
+			printf("    %-38s ok\n", c->name);
+
+		prog_free(prog);
+	}
+
+	return err;
+}
+
+
+/* event pipe: a perf ring in memory, filled with printf() events */
+
+#define RING_SIZE (1 << 20)
+
+static int bench_nop_event(event_t *ev, void *priv)
+{
+	return 0;
+}
+
+static evhandler_t bench_nop_evh = {
+	.handle = bench_nop_event,
+};
+
+static void ring_write(struct perf_event_mmap_page *mem, uint64_t at,
+		       const void *ev, size_t size)
+{
+	uint8_t *base = (uint8_t *)mem + mem->data_offset;
+	size_t offs = at % mem->data_size, left = mem->data_size - offs;
+
+	if (size <= left) {
+		memcpy(base + offs, ev, size);
+		return;
+	}
+
+	memcpy(base + offs, ev, left);
+	memcpy(base, ev + left, size - left);
+}
+
+static void bench_evpipe_run(FILE *fp, const char *name,
+			     event_t *ev, int events)
+{
+	struct evpipe_stats st = { 0 };
+	struct perf_event_mmap_page *mem;
+	struct evqueue q = { .fd = -1 };
+	uint64_t head = 0;
+	double start, elapsed;
+	int done, batch, i;
+
+	mem = calloc(1, sysconf(_SC_PAGESIZE) + RING_SIZE);
+	assert(mem);
+
+	mem->data_offset = sysconf(_SC_PAGESIZE);
+	mem->data_size   = RING_SIZE;
+
+	q.mem = mem;
+	q.buf = malloc(0x10000);
+	assert(q.buf);
+
+	/* the ring size is not a multiple of the event size, so just
+	 * like in the real thing, some events will wrap around. */
+	batch = RING_SIZE / ev->hdr.size - 1;
+
+	start = bench_now();
+	for (done = 0; done < events; done += batch) {
+		if (batch > events - done)
+			batch = events - done;
+
+		for (i = 0; i < batch; i++, head += ev->hdr.size)
+			ring_write(mem, head, ev, ev->hdr.size);
+
+		mem->data_head = head;
+		if (evqueue_drain(&q, 0, &st))
+			break;
+	}
+	elapsed = bench_now() - start;
+
+	fprintf(fp, "  %-40s %10" PRIu64 " %10.1f %10.1f\n", name,
+		st.events, st.events / elapsed / 1e6,
+		elapsed * 1e9 / (st.events ? : 1));
+
+	free(q.buf);
+	free(mem);
+}
+
+static void bench_evpipe(void)
+{
+	node_t *script, *call, *rec;
+	int events = 1000000;
+	int64_t type;
+	event_t *ev;
+	size_t size;
+	FILE *fp;
+	int out;
+
+	script = bench_load("kprobe:SyS_read { "
+			    "printf(\"%-16s %6d %#x %v\\n\", "
+			    "comm(), pid(), arg(0), arg(1)); }");
+	if (!script) {
+		_e("unable to compile event script");
+		return;
+	}
+
+	/* the printf() is rewritten to carry its event type first */
+	call = script->script.probes->probe.stmts;
+	rec  = call->call.vargs->next;
+	type = rec->rec.vargs->integer;
+
+	size = sizeof(*ev) + rec->dyn->size - sizeof(ev->type);
+	ev = calloc(1, (size + 7) & ~7);
+	assert(ev);
+
+	ev->hdr.type = PERF_RECORD_SAMPLE;
+	ev->hdr.size = (size + 7) & ~7;
+	ev->size     = rec->dyn->size;
+	ev->type     = type;
+
+	/* comm, pid, arg(0), arg(1) */
+	strcpy((char *)ev->data, "ply-bench");
+	memcpy(ev->data + 16, &(int64_t){ 4711 }, sizeof(int64_t));
+	memcpy(ev->data + 24, &(int64_t){ 0xc0ffee }, sizeof(int64_t));
+	memcpy(ev->data + 32, &(int64_t){ -1 }, sizeof(int64_t));
+
+	printf("\nevpipe, %d-byte events:\n  %-40s %10s %10s %10s\n",
+	       ev->hdr.size, "handler", "events", "Mevents/s", "ns/event");
+
+	/* the formatted output is not interesting, but writing it is
+	 * part of the cost. the results are written to the original
+	 * stdout meanwhile. */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	fp = fdopen(dup(STDOUT_FILENO), "w");
+	assert(out >= 0 && fp);
+	freopen("/dev/null", "w", stdout);
+
+	evhandler_register(&bench_nop_evh);
+	ev->type = bench_nop_evh.type;
+	bench_evpipe_run(fp, "drain only", ev, events);
+
+	ev->type = type;
+	bench_evpipe_run(fp, "printf", ev, events);
+
+	fflush(stdout);
+	fclose(fp);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+
+	free(ev);
+	node_free(script);
+}
+
+
+/* map dumps: generated entries, written to /dev/null */
+
+#define HIST_BUCKETS 8
+
+static void bench_map_fill(sym_t *s, char *data, int n)
+{
+	struct sym_map_data *md = s->map;
+	size_t rsize = md->ksize + md->vsize;
+	int hist = !!md->map->dyn->map.dump;
+	int64_t key, bucket;
+	uint64_t val;
+	char *rec;
+
+	srandom(n);
+	for (rec = data; n > 0; n--, rec += rsize) {
+		memset(rec, 0, rsize);
+
+		/* unique keys, the first member is always an int. */
+		key = hist ? n / HIST_BUCKETS : n;
+		memcpy(rec, &key, sizeof(key));
+
+		if (hist) {
+			/* histograms have one entry per bucket, the
+			 * bucket is the last member of the key. a few
+			 * buckets are left as gaps. */
+			bucket = (n % HIST_BUCKETS) * 4 + random() % 4;
+			memcpy(rec + md->ksize - sizeof(bucket), &bucket,
+			       sizeof(bucket));
+		} else if (md->ksize > sizeof(key)) {
+			snprintf(rec + sizeof(key), md->ksize - sizeof(key),
+				 "task-%ld", random() % 100);
+		}
+
+		val = random() % 100000;
+		memcpy(rec + md->ksize, &val, sizeof(val));
+	}
+}
+
+static void bench_map_run(FILE *fp, sym_t *s, int n, int top)
+{
+	size_t rsize = s->map->ksize + s->map->vsize;
+	char *tmpl, *data;
+	double start, elapsed = 0;
+	int i, runs;
+
+	tmpl = malloc(rsize * n);
+	data = malloc(rsize * n);
+	if (!tmpl || !data) {
+		printf("  %-10s %10d (out of memory)\n", s->name, n);
+		goto out;
+	}
+
+	bench_map_fill(s, tmpl, n);
+
+	/* the dump sorts the data in place, so start over from the
+	 * same generated entries every time. */
+	runs = n < 100000 ? 10 : 1;
+	for (i = 0; i < runs; i++) {
+		memcpy(data, tmpl, rsize * n);
+
+		G.top = top;
+		start = bench_now();
+		dump_map_data(fp, s->map->map, data, n);
+		elapsed += bench_now() - start;
+		G.top = 0;
+	}
+
+	printf("  %-10s %10d %6d %10.2f %10.1f\n", s->name, n, top,
+	       elapsed * 1e3 / runs, elapsed * 1e9 / runs / n);
+out:
+	free(data);
+	free(tmpl);
+}
+
+static void bench_maps(void)
+{
+	node_t *script;
+	sym_t *count, *hist;
+	FILE *fp;
+	int n;
+
+	script = bench_load("kprobe:SyS_read { "
+			    "@count[pid(), comm()].count(); "
+			    "@hist[pid()].quantize(arg(2)); }");
+	if (!script) {
+		_e("unable to compile map script");
+		return;
+	}
+
+	count = bench_map(script, "@count");
+	hist  = bench_map(script, "@hist");
+	assert(count && hist);
+
+	fp = fopen("/dev/null", "w");
+	assert(fp);
+
+	printf("\nmap dumps:\n  %-10s %10s %6s %10s %10s\n",
+	       "map", "entries", "top", "ms", "ns/entry");
+
+	for (n = 1000; n <= max_entries; n *= 10) {
+		bench_map_run(fp, count, n, 0);
+		bench_map_run(fp, count, n, 10);
+	}
+
+	/* top only applies to plain maps, histograms are always
+	 * dumped in full. */
+	for (n = 1000; n <= max_entries; n *= 10)
+		bench_map_run(fp, hist, n, 0);
+
+	fclose(fp);
+	node_free(script);
+}
+
+
+static void usage(void)
+{
+	puts("ply-bench - Benchmark ply's compiler, event pipe and map dumps\n"
+	     "\n"
+	     "Usage:\n"
+	     "  ply-bench [options] [<script_file> ...]\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n <passes>         Compile each script <passes> times (default 100).\n"
+	     "  -N <entries>        Dump maps of up to <entries> entries (default 1000000).\n"
+	     "  -h                  Print usage message and exit.\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt, err;
+
+	/* ply's defaults */
+	G.map_nelem = 0x400;
+	G.stack_depth = 0x10;
+
+	while ((opt = getopt(argc, argv, "hn:N:")) > 0) {
+		switch (opt) {
+		case 'n':
+			reps = strtol(optarg, NULL, 0);
+			break;
+		case 'N':
+			max_entries = strtol(optarg, NULL, 0);
+			break;
+		case 'h':
+			usage(); return 0;
+		default:
+			usage(); return 1;
+		}
+	}
+
+	if (reps <= 0 || max_entries <= 0) {
+		usage(); return 1;
+	}
+
+	err  = bench_optimize();
+	err |= bench_compile(&argv[optind], argc - optind);
+	bench_evpipe();
+	bench_maps();
+	return err ? 1 : 0;
+}
@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include <ply/ast.h>
+#include <ply/bpf-syscall.h>
 #include <ply/ply.h>
 #include <ply/pvdr.h>
 #include <ply/symtable.h>
@@ -52,7 +53,7 @@ static int loc_assign_binop(node_t *n, node_t *probe)
 	if (n->dyn->loc == LOC_STACK)
 		l->dyn->addr = n->dyn->addr;
 	else
-		l->dyn->addr = node_probe_stack_get(probe, l->dyn->size);
+		l->dyn->addr = node_probe_stack_get(probe, l, l->dyn->size);
 
 ldone:
 	if (r->dyn->loc == LOC_REG)
@@ -63,11 +64,24 @@ ldone:
 	    r->integer <= INT32_MAX)
 		goto rdone;
 
+	/* the right operand is computed last and consumed right away,
+	 * no helper can be called in between. so any caller-saved
+	 * register will do, as long as it does not clash with the
+	 * result. */
+	if (r->type == TYPE_BINOP || r->type == TYPE_NOT) {
+		r->dyn->loc = LOC_REG;
+		if (n->dyn->loc == LOC_REG && n->dyn->reg == BPF_REG_1)
+			r->dyn->reg = BPF_REG_2;
+		else
+			r->dyn->reg = BPF_REG_1;
+		goto rdone;
+	}
+
 	r->dyn->loc = LOC_REG;
 	r->dyn->reg = node_probe_reg_get(probe, 1);
 	if (r->dyn->reg < 0) {
 		r->dyn->loc  = LOC_STACK;
-		r->dyn->addr = node_probe_stack_get(probe, r->dyn->size);
+		r->dyn->addr = node_probe_stack_get(probe, r, r->dyn->size);
 	}
 
 rdone:
@@ -80,7 +94,7 @@ static int loc_assign_map(node_t *n, node_t *probe)
 		return 0;
 
 	n->dyn->loc  = LOC_STACK;
-	n->dyn->addr = node_probe_stack_get(probe, n->dyn->size);
+	n->dyn->addr = node_probe_stack_get(probe, n, n->dyn->size);
 	return 0;
 }
 
@@ -135,6 +149,10 @@ static int loc_assign_pre(node_t *n, void *_probe)
 	node_t *c, *probe = _probe;
 	ssize_t addr;
 
+	if (n->parent->type == TYPE_UNROLL ||
+	    n->parent->type == TYPE_PROBE)
+		node_probe_stack_enter(probe);
+
 	switch (n->type) {
 	case TYPE_PROBE:
 		c = n->probe.pred;
@@ -162,7 +180,7 @@ static int loc_assign_pre(node_t *n, void *_probe)
 	case TYPE_METHOD:
 		c = n->method.map;
 		c->dyn->loc  = LOC_STACK;
-		c->dyn->addr = node_probe_stack_get(probe, c->dyn->size);
+		c->dyn->addr = node_probe_stack_get(probe, c, c->dyn->size);
 		return 0;
 
 	case TYPE_IF:
@@ -189,14 +207,17 @@ static int loc_assign_pre(node_t *n, void *_probe)
 		return loc_assign_var(n, probe);
 
 	case TYPE_MAP:
+		if (n->parent->type != TYPE_METHOD)
+			sym_from_node(n)->map->shared = 1;
+
 		/* upper node wants result in a register, but we still
 		 * need stack space to bounce the data in */
 		if (n->dyn->loc == LOC_REG && !n->dyn->addr)
-			n->dyn->addr = node_probe_stack_get(probe, n->dyn->size);
+			n->dyn->addr = node_probe_stack_get(probe, n, n->dyn->size);
 
 		c = n->map.rec;
 		c->dyn->loc  = LOC_STACK;
-		c->dyn->addr = node_probe_stack_get(probe, c->dyn->size);
+		c->dyn->addr = node_probe_stack_get(probe, c, c->dyn->size);
 		return 0;
 
 	case TYPE_REC:
@@ -211,8 +232,19 @@ static int loc_assign_pre(node_t *n, void *_probe)
 		}
 		return 0;
 
-	case TYPE_SCRIPT:
 	case TYPE_UNROLL:
+#ifdef LINUX_HAS_BOUNDED_LOOPS
+		/* compiled as a loop, the counter lives on the stack
+		 * for as long as the unroll does. */
+		if (n->unroll.count > 1 && n->unroll.count <= INT32_MAX) {
+			n->dyn->loc  = LOC_STACK;
+			n->dyn->addr = node_probe_stack_get(probe, n,
+							    sizeof(int64_t));
+		}
+#endif
+		return 0;
+
+	case TYPE_SCRIPT:
 	case TYPE_BREAK:
 	case TYPE_CONTINUE:
 	case TYPE_RETURN:
@@ -235,8 +267,13 @@ static int loc_assign_post(node_t *n, void *_probe)
 	sym_t *s;
 
 	switch (n->type) {
-	case TYPE_UNROLL:		
 	case TYPE_VAR:
+		s = sym_from_node(n);
+		if (s->var.last == n && s->dyn.loc == LOC_REG)
+			/* this was the last reference to this var */
+			probe->dyn->probe.stat_regs |= (1 << s->dyn.reg);
+		break;
+	case TYPE_UNROLL:
 		sym_foreach(s, script->dyn->script.st->syms) {
 			if (s->type == TYPE_VAR &&
 			    s->var.last == n &&
@@ -251,16 +288,175 @@ static int loc_assign_post(node_t *n, void *_probe)
 		break;
 	}
 
-	/* for now, reset the dynamic registers after each statement,
-	 * we can do something more fine grained in the future. */
+	/* temporaries only live for the duration of a statement, so
+	 * their registers and stack space can be reused by the next
+	 * one. */
 	if (n->parent->type == TYPE_UNROLL ||
 	    n->parent->type == TYPE_PROBE) {
 		probe->dyn->probe.dyn_regs = DYN_REGS;
+		node_probe_stack_leave(probe);
+	}
+
+	return 0;
+}
+
+static int loc_assign_map_types(node_t *script)
+{
+	symtable_t *st = script->dyn->script.st;
+	int err, n_maps = 0;
+	sym_t *s;
+
+	sym_foreach(s, st->syms) {
+		if (s->type != TYPE_MAP || s->name[0] != '@')
+			continue;
+
+		/* maps referenced from multiple probes share data,
+		 * count each one once. */
+		if (!s->map->drop_slot)
+			s->map->drop_slot = ++n_maps;
+
+		if (G.scale && s->map->sample < 0)
+			_w("%s: updated by probes with different sampling "
+			   "rates, it will not be scaled", s->name);
+
+		if (!s->map->aggregated || s->map->shared) {
+			if (map_is_percpu(s->map)) {
+				_e("%s: per-CPU maps can only be updated by "
+				   "aggregations", s->name);
+				return -EINVAL;
+			}
+			continue;
+		}
+
+#ifdef LINUX_HAS_PERCPU_MAPS
+		/* maps that are only ever updated by aggregations get
+		 * one value per CPU, the values are summed up when
+		 * dumping. */
+		if (s->map->type == BPF_MAP_TYPE_HASH)
+			s->map->type = BPF_MAP_TYPE_PERCPU_HASH;
+#endif
+#ifdef LINUX_HAS_LRU_MAPS
+		if (s->map->type == BPF_MAP_TYPE_LRU_HASH)
+			s->map->type = BPF_MAP_TYPE_LRU_PERCPU_HASH;
+#endif
+		if (!G.interval || s->map->dbuf)
+			continue;
+
+		/* ...and in interval mode, they are also swapped out
+		 * every time they are dumped. */
+		err = symtable_ref_ctrl(st);
+		if (err) {
+			_e("interval mode is not supported by this kernel");
+			return err;
+		}
+
+		s->map->dbuf = 1;
 	}
 
+	/* without support for direct map value access, drops are
+	 * simply not counted. */
+	if (n_maps)
+		symtable_ref_drops(st, n_maps);
+
 	return 0;
 }
 
+/* aggregations in sampled probes only see some of the hits, keep
+ * track of how many so that they can be scaled back up. */
+static int loc_assign_sample(node_t *n, void *_probe)
+{
+	node_t *probe = _probe;
+	struct sym_map_data *md;
+	int64_t sample;
+
+	if (n->type != TYPE_METHOD)
+		return 0;
+
+	md = sym_from_node(n->method.map)->map;
+	sample = probe->dyn->probe.sample ? : 1;
+
+	if (!md->sample)
+		md->sample = sample;
+	else if (md->sample != sample)
+		md->sample = -1;
+
+	return 0;
+}
+
+struct probe_ent {
+	node_t *probe;
+	size_t  i;
+};
+
+static int probe_ent_cmp(const void *_a, const void *_b)
+{
+	const struct probe_ent *a = _a, *b = _b;
+	int diff;
+
+	diff = strcmp(a->probe->string, b->probe->string);
+	if (diff)
+		return diff;
+
+	/* keep the script order within each attach point */
+	return (a->i > b->i) - (a->i < b->i);
+}
+
+/* the kernel allows a program to use 64 maps, some of which are
+ * our own (events, stacks, drops etc.). in interval mode, a user map
+ * may also be double-buffered. */
+#define LEADER_MAX_MAPS 56
+
+static int probe_n_maps(node_t *probe)
+{
+	return probe->dyn->probe.n_maps * (G.interval ? 2 : 1);
+}
+
+/* a site that is probed more than once would trap once per probe,
+ * so probes on the same attach point share one program. the first
+ * one leads, see compile_probe(). */
+static void loc_assign_leaders(node_t *script)
+{
+	struct probe_ent *ents, *e;
+	node_t *probe, *leader;
+	size_t n = 0;
+	int n_maps = 0;
+
+	node_foreach(probe, script->script.probes)
+		n++;
+
+	ents = calloc(n, sizeof(*ents));
+	assert(ents);
+
+	n = 0;
+	node_foreach(probe, script->script.probes) {
+		ents[n].probe = probe;
+		ents[n].i = n;
+		n++;
+	}
+
+	qsort(ents, n, sizeof(*ents), probe_ent_cmp);
+
+	for (e = &ents[0]; e < &ents[n]; e++) {
+		if (e == ents ||
+		    strcmp(e[-1].probe->string, e->probe->string) ||
+		    n_maps + probe_n_maps(e->probe) > LEADER_MAX_MAPS) {
+			/* leads a program of its own */
+			n_maps = probe_n_maps(e->probe);
+			continue;
+		}
+
+		n_maps += probe_n_maps(e->probe);
+		leader = e[-1].probe->dyn->probe.leader ? : e[-1].probe;
+
+		_d("%s: sharing program with earlier probe",
+		   e->probe->string);
+		e->probe->dyn->probe.leader = leader;
+		e[-1].probe->dyn->probe.follower = e->probe;
+	}
+
+	free(ents);
+}
+
 static int loc_assign(node_t *script)
 {
 	node_t *probe;
@@ -273,9 +469,18 @@ static int loc_assign(node_t *script)
 		err = node_walk(probe, loc_assign_pre, loc_assign_post, probe);
 		if (err)
 			return err;
+
+		err = cse_probe(probe);
+		if (err)
+			return err;
+
+		err = node_walk(probe, loc_assign_sample, NULL, probe);
+		if (err)
+			return err;
 	}
 
-	return 0;
+	loc_assign_leaders(script);
+	return loc_assign_map_types(script);
 }
 
 static int type_sync(node_t *a, node_t *b)
@@ -442,9 +647,9 @@ static int static_post(node_t *n, void *_null)
 		n->dyn->type = TYPE_STR;
 		n->dyn->size = _ALIGNED(strlen(escaped) + 1);
 
-		n->string = calloc(1, n->dyn->size);
-		memcpy(n->string, escaped, n->dyn->size);
-		free(escaped);
+		/* zero padded up to the aligned size */
+		n->string = node_alloc(n->dyn->size);
+		strcpy(n->string, escaped);
 		break;
 	case TYPE_REC:
 		n->dyn->type = TYPE_REC;
@@ -17,6 +17,7 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -107,6 +108,126 @@ int bpf_map_next(int fd, void *key, void *next_key)
 	return bpf_map_op(BPF_MAP_GET_NEXT_KEY, fd, key, next_key, 0);
 }
 
+#ifdef LINUX_HAS_MAP_BATCH
+int bpf_map_batch(int fd, void *in_batch, void *out_batch,
+		  void *keys, void *vals, uint32_t *count, int delete)
+{
+	union bpf_attr attr;
+	int err;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.batch.map_fd    = fd;
+	attr.batch.in_batch  = ptr_to_u64(in_batch);
+	attr.batch.out_batch = ptr_to_u64(out_batch);
+	attr.batch.keys      = ptr_to_u64(keys);
+	attr.batch.values    = ptr_to_u64(vals);
+	attr.batch.count     = *count;
+
+	err = syscall(__NR_bpf, delete ? BPF_MAP_LOOKUP_AND_DELETE_BATCH :
+		      BPF_MAP_LOOKUP_BATCH, &attr, sizeof(attr));
+
+	/* the kernel reports the number of copied elements even when
+	 * the end of the map (ENOENT) is reached. */
+	*count = attr.batch.count;
+	return err;
+}
+#else
+int bpf_map_batch(int fd, void *in_batch, void *out_batch,
+		  void *keys, void *vals, uint32_t *count, int delete)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+#ifdef LINUX_HAS_OBJ_PIN
+int bpf_obj_pin(int fd, const char *path)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.bpf_fd   = fd;
+	attr.pathname = ptr_to_u64(path);
+
+	return syscall(__NR_bpf, BPF_OBJ_PIN, &attr, sizeof(attr));
+}
+
+int bpf_obj_get(const char *path)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.pathname = ptr_to_u64(path);
+
+	return syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+}
+#else
+int bpf_obj_pin(int fd, const char *path)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int bpf_obj_get(const char *path)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+#ifdef LINUX_HAS_PROG_STATS
+int bpf_prog_stats(int fd, uint64_t *run_cnt, uint64_t *run_time_ns)
+{
+	struct bpf_prog_info info;
+	union bpf_attr attr;
+	int err;
+
+	memset(&info, 0, sizeof(info));
+	memset(&attr, 0, sizeof(attr));
+
+	attr.info.bpf_fd   = fd;
+	attr.info.info_len = sizeof(info);
+	attr.info.info     = ptr_to_u64(&info);
+
+	err = syscall(__NR_bpf, BPF_OBJ_GET_INFO_BY_FD, &attr, sizeof(attr));
+	if (err)
+		return err;
+
+	*run_cnt     = info.run_cnt;
+	*run_time_ns = info.run_time_ns;
+	return 0;
+}
+#else
+int bpf_prog_stats(int fd, uint64_t *run_cnt, uint64_t *run_time_ns)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
+#ifdef LINUX_HAS_ENABLE_STATS
+/* statistics are collected for as long as the returned fd is open */
+int bpf_enable_stats(void)
+{
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+
+	attr.enable_stats.type = BPF_STATS_RUN_TIME;
+
+	return syscall(__NR_bpf, BPF_ENABLE_STATS, &attr, sizeof(attr));
+}
+#else
+int bpf_enable_stats(void)
+{
+	errno = ENOSYS;
+	return -1;
+}
+#endif
+
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 		     int cpu, int group_fd, unsigned long flags)
 {
@@ -0,0 +1,409 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/version.h>
+
+#include <sys/stat.h>
+#include <sys/utsname.h>
+
+#include <ply/ply.h>
+#include <ply/bpf-syscall.h>
+#include <ply/cache.h>
+#include <ply/evpipe.h>
+#include <ply/symtable.h>
+
+#include "config.h"
+
+struct cache_prog {
+	uint32_t n_insns;
+	struct bpf_insn *insns;
+};
+
+static struct {
+	char path[PATH_MAX];
+	uint64_t key;
+
+	int n_probes;
+	struct cache_prog *progs;
+
+	/* every map fd that a program might reference, the index in
+	 * this table is what is stored in the cache. */
+	int *fds;
+	int n_fds;
+
+	int hit;
+	int bad;
+} cache;
+
+/* FNV-1a */
+static uint64_t cache_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	for (; len; len--, p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static uint64_t cache_key(node_t *script, const char *src, size_t len)
+{
+	struct utsname u;
+	char env[0x400];
+
+	if (uname(&u))
+		memset(&u, 0, sizeof(u));
+
+	snprintf(env, sizeof(env), "%s %s %u %s %s %s %zu %d %d %d %d %d %d %llu",
+		 VERSION, GIT_VERSION, LINUX_VERSION_CODE,
+		 u.release, u.version, u.machine,
+		 G.map_nelem, G.stack_depth, G.interval, !!G.pin,
+		 !!script->dyn->script.evp->ring, !!G.wakeup,
+		 G.pid, (unsigned long long)G.cgroup_id);
+
+	return cache_hash(cache_hash(0xcbf29ce484222325ULL,
+				     env, strlen(env) + 1), src, len);
+}
+
+static int cache_probe_index(node_t *probe)
+{
+	node_t *n;
+	int i = 0;
+
+	node_foreach(n, node_get_script(probe)->script.probes) {
+		if (n == probe)
+			return i;
+		i++;
+	}
+
+	return -1;
+}
+
+static void cache_fds(node_t *script)
+{
+	evpipe_t *evp = script->dyn->script.evp;
+	sym_t *s;
+	int n = 2;
+
+	sym_foreach(s, script->dyn->script.st->syms)
+		if (s->type == TYPE_MAP)
+			n += 2;
+
+	cache.fds = calloc(n, sizeof(*cache.fds));
+	assert(cache.fds);
+
+	cache.fds[cache.n_fds++] = evp->mapfd;
+	cache.fds[cache.n_fds++] = evp->ring ? evp->ring->dropfd : -1;
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type != TYPE_MAP)
+			continue;
+
+		cache.fds[cache.n_fds++] = s->map->fd;
+		cache.fds[cache.n_fds++] = s->map->fd_alt;
+	}
+}
+
+static int cache_insn_is_map(const struct bpf_insn *insn)
+{
+	return insn->code == (BPF_LD | BPF_DW | BPF_IMM) &&
+		(insn->src_reg == BPF_PSEUDO_MAP_FD ||
+		 insn->src_reg == BPF_PSEUDO_MAP_VALUE);
+}
+
+/* fd -> index when storing, index -> fd when loading */
+static int cache_reloc(struct bpf_insn *insns, uint32_t n_insns, int store)
+{
+	struct bpf_insn *insn;
+	int i;
+
+	for (insn = insns; insn < &insns[n_insns]; insn++) {
+		if (!cache_insn_is_map(insn))
+			continue;
+
+		if (!store) {
+			if (insn->imm < 0 || insn->imm >= cache.n_fds)
+				return -EINVAL;
+
+			insn->imm = cache.fds[insn->imm];
+			insn++;
+			continue;
+		}
+
+		for (i = 0; i < cache.n_fds; i++)
+			if (cache.fds[i] >= 0 && cache.fds[i] == insn->imm)
+				break;
+
+		if (i == cache.n_fds)
+			return -ENOENT;
+
+		insn->imm = i;
+
+		/* the second half of the 64-bit load */
+		insn++;
+	}
+
+	return 0;
+}
+
+static int cache_read(FILE *fp)
+{
+	struct cache_prog *cp;
+	struct cache_hdr hdr;
+	int i;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    strcmp(hdr.magic, CACHE_MAGIC) ||
+	    hdr.version != CACHE_VERSION ||
+	    hdr.key != cache.key ||
+	    hdr.n_probes != cache.n_probes)
+		return -EINVAL;
+
+	for (i = 0; i < cache.n_probes; i++) {
+		cp = &cache.progs[i];
+
+		if (fread(&cp->n_insns, sizeof(cp->n_insns), 1, fp) != 1 ||
+		    cp->n_insns > CACHE_MAX_INSNS)
+			return -EINVAL;
+
+		/* compiled into an earlier probe's program */
+		if (!cp->n_insns)
+			continue;
+
+		cp->insns = calloc(cp->n_insns, sizeof(*cp->insns));
+		assert(cp->insns);
+
+		if (fread(cp->insns, sizeof(*cp->insns), cp->n_insns, fp)
+		    != cp->n_insns)
+			return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void cache_drop(void)
+{
+	int i;
+
+	for (i = 0; i < cache.n_probes; i++) {
+		free(cache.progs[i].insns);
+		cache.progs[i].insns = NULL;
+		cache.progs[i].n_insns = 0;
+	}
+}
+
+int cache_open(node_t *script, const char *src, size_t len)
+{
+	int dirfd, fd, err;
+	node_t *probe;
+	FILE *fp;
+
+	if (mkdir(G.cache, 0700) && errno != EEXIST) {
+		_eno("unable to create cache directory %s", G.cache);
+		return -errno;
+	}
+
+	/* cached programs are loaded as is, a directory that someone
+	 * else can write to would let them run their own. */
+	dirfd = open(G.cache, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		_eno("unable to open cache directory %s", G.cache);
+		return -errno;
+	}
+
+	err = fd_trusted(dirfd);
+	close(dirfd);
+	if (err) {
+		_e("refusing to use cache directory %s, it must be owned "
+		   "and only be writable by the current user", G.cache);
+		return err;
+	}
+
+	cache.key = cache_key(script, src, len);
+	snprintf(cache.path, sizeof(cache.path), "%s/%016" PRIx64 ".prog",
+		 G.cache, cache.key);
+
+	node_foreach(probe, script->script.probes)
+		cache.n_probes++;
+
+	cache.progs = calloc(cache.n_probes, sizeof(*cache.progs));
+	assert(cache.progs);
+
+	cache_fds(script);
+
+	fd = open(cache.path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		_d("miss: %s", cache.path);
+		return 0;
+	}
+
+	/* it will be replaced by one of our own */
+	if (fd_trusted(fd)) {
+		_w("ignoring untrusted entry: %s", cache.path);
+		close(fd);
+		return 0;
+	}
+
+	fp = fdopen(fd, "r");
+	assert(fp);
+
+	err = cache_read(fp);
+	fclose(fp);
+	if (err) {
+		/* stale or truncated, it will be replaced */
+		_d("ignoring invalid entry: %s", cache.path);
+		cache_drop();
+		return 0;
+	}
+
+	_d("hit: %s", cache.path);
+	cache.hit = 1;
+	return 0;
+}
+
+prog_t *cache_get(node_t *probe)
+{
+	struct cache_prog *cp;
+	prog_t *prog;
+	uint32_t n;
+	int i;
+
+	i = cache_probe_index(probe);
+	if (!cache.hit || i < 0)
+		return NULL;
+
+	cp = &cache.progs[i];
+	if (!cp->n_insns)
+		return NULL;
+
+	prog = prog_new();
+	for (n = 0; n < cp->n_insns; n++)
+		emit(prog, cp->insns[n]);
+
+	if (cache_reloc(prog->insns, cp->n_insns, 0)) {
+		_w("%s: invalid cached program, recompiling", probe->string);
+		prog_free(prog);
+		return NULL;
+	}
+
+	return prog;
+}
+
+void cache_put(node_t *probe, prog_t *prog)
+{
+	struct cache_prog *cp;
+	int i;
+
+	i = cache_probe_index(probe);
+	if (cache.hit || cache.bad || i < 0)
+		return;
+
+	cp = &cache.progs[i];
+	cp->n_insns = prog->ip - prog->insns;
+	cp->insns = malloc(cp->n_insns * sizeof(*cp->insns));
+	assert(cp->insns);
+
+	memcpy(cp->insns, prog->insns, cp->n_insns * sizeof(*cp->insns));
+
+	/* references something other than our maps, don't cache
+	 * what we can't relocate. */
+	if (cache_reloc(cp->insns, cp->n_insns, 1)) {
+		_d("%s: not cacheable", probe->string);
+		cache.bad = 1;
+	}
+}
+
+static int cache_write(node_t *script)
+{
+	struct cache_hdr hdr = {
+		.magic    = CACHE_MAGIC,
+		.version  = CACHE_VERSION,
+		.n_probes = cache.n_probes,
+		.key      = cache.key,
+	};
+	char tmp[PATH_MAX + 8];
+	struct cache_prog *cp;
+	node_t *probe;
+	int fd, i = 0;
+	FILE *fp;
+
+	node_foreach(probe, script->script.probes) {
+		if (!probe->dyn->probe.leader && !cache.progs[i].insns)
+			return 0;
+
+		i++;
+	}
+
+	/* concurrent runs of the same script must never see a
+	 * half-written entry. */
+	snprintf(tmp, sizeof(tmp), "%s.%d", cache.path, G.self);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd < 0)
+		goto err;
+
+	fp = fdopen(fd, "w");
+	assert(fp);
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	for (i = 0; i < cache.n_probes; i++) {
+		cp = &cache.progs[i];
+
+		fwrite(&cp->n_insns, sizeof(cp->n_insns), 1, fp);
+		fwrite(cp->insns, sizeof(*cp->insns), cp->n_insns, fp);
+	}
+
+	if (fclose(fp) || rename(tmp, cache.path)) {
+		unlink(tmp);
+		goto err;
+	}
+
+	_d("stored: %s", cache.path);
+	return 0;
+err:
+	_eno("unable to store compiled programs in %s", G.cache);
+	return -errno;
+}
+
+int cache_close(node_t *script)
+{
+	int err = 0;
+
+	if (!cache.hit && !cache.bad)
+		err = cache_write(script);
+
+	cache_drop();
+	free(cache.progs);
+	free(cache.fds);
+	memset(&cache, 0, sizeof(cache));
+	return err;
+}
@@ -68,10 +68,16 @@ static const char *bpf_func_name(enum bpf_func_id id)
 	switch (id) {
 	case BPF_FUNC_get_current_comm:
 		return "get_current_comm";
+#ifdef LINUX_HAS_CGROUP_ID
+	case BPF_FUNC_get_current_cgroup_id:
+		return "get_current_cgroup_id";
+#endif
 	case BPF_FUNC_get_current_pid_tgid:
 		return "get_current_pid_tgid";
 	case BPF_FUNC_get_current_uid_gid:
 		return "get_current_uid_gid";
+	case BPF_FUNC_get_prandom_u32:
+		return "get_prandom_u32";
 #ifdef LINUX_HAS_STACKMAP
 	case BPF_FUNC_get_stackid:
 		return "get_stackid";
@@ -88,6 +94,14 @@ static const char *bpf_func_name(enum bpf_func_id id)
 		return "perf_event_output";
 	case BPF_FUNC_probe_read:
 		return "probe_read";
+#ifdef LINUX_HAS_RINGBUF
+	case BPF_FUNC_ringbuf_output:
+		return "ringbuf_output";
+#endif
+#ifdef LINUX_HAS_PROBE_READ_STR
+	case BPF_FUNC_probe_read_str:
+		return "probe_read_str";
+#endif
 	case BPF_FUNC_trace_printk:
 		return "trace_printk";
 	default:
@@ -162,7 +176,10 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 	case BPF_ST:
 	case BPF_STX:
 		off = OFF_DST;
-		fputs("st", stderr);
+		if (BPF_MODE(insn.code) == BPF_XADD)
+			fputs("xadd", stderr);
+		else
+			fputs("st", stderr);
 		dump_size(insn.code);
 		break;
 
@@ -180,6 +197,7 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 		case BPF_NEG: fputs("neg\t", stderr); break;
 		case BPF_MOD: fputs("mod\t", stderr); break;
 		case BPF_XOR: fputs("xor\t", stderr); break;
+		case BPF_ARSH: fputs("arsh\t", stderr); break;
 		}
 		break;
 
@@ -217,6 +235,13 @@ void dump_insn(struct bpf_insn insn, size_t ip)
 		case BPF_JGE:  fputs("jge\t", stderr); break;
 		case BPF_JSGE: fputs("jsge\t", stderr); break;
 		case BPF_JSGT: fputs("jsgt\t", stderr); break;
+		case BPF_JSET: fputs("jset\t", stderr); break;
+#ifdef BPF_JLT
+		case BPF_JLT:  fputs("jlt\t", stderr); break;
+		case BPF_JLE:  fputs("jle\t", stderr); break;
+		case BPF_JSLT: fputs("jslt\t", stderr); break;
+		case BPF_JSLE: fputs("jsle\t", stderr); break;
+#endif
 		default:
 			goto unknown;
 		}
@@ -263,12 +288,51 @@ static void emit_at(prog_t *prog, struct bpf_insn *at, struct bpf_insn insn)
 	*at = insn;
 }
 
+#define PROG_MIN_SIZE 256
+
+prog_t *prog_new(void)
+{
+	prog_t *prog = calloc(1, sizeof(*prog));
+
+	assert(prog);
+	return prog;
+}
+
+void prog_free(prog_t *prog)
+{
+	free(prog->insns);
+	free(prog);
+}
+
+static ptrdiff_t prog_pos(prog_t *prog)
+{
+	return prog->ip - prog->insns;
+}
+
 void emit(prog_t *prog, struct bpf_insn insn)
 {
+	ptrdiff_t n = prog_pos(prog);
+
+	if (n == (ptrdiff_t)prog->size) {
+		prog->size = prog->size ? prog->size * 2 : PROG_MIN_SIZE;
+		prog->insns = realloc(prog->insns,
+				      prog->size * sizeof(*prog->insns));
+		assert(prog->insns);
+		prog->ip = &prog->insns[n];
+	}
+
 	emit_at(prog, prog->ip, insn);
 	prog->ip++;
 }
 
+/* patch the placeholder at `at` with `jmp`, jumping to the current
+ * position. */
+static void emit_land(prog_t *prog, ptrdiff_t at, struct bpf_insn jmp)
+{
+	jmp.off = prog_pos(prog) - at - 1;
+	emit_at(prog, &prog->insns[at], jmp);
+}
+
 int emit_stack_zero(prog_t *prog, const node_t *n)
 {
 	size_t i;
@@ -477,6 +541,69 @@ int emit_log2_raw(prog_t *prog, int dst, int src)
 	return 0;
 }
 
+int emit_lin_raw(prog_t *prog, int dst, int src,
+		 int32_t min, int32_t max, int32_t step)
+{
+	int32_t n = (max - min + step - 1) / step;
+
+	/* below range? */
+	emit(prog, JMP_IMM(BPF_JSGE, src, min, 2));
+	emit(prog, MOV_IMM(dst, 0));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 7));
+
+	/* above range? */
+	emit(prog, JMP_IMM(BPF_JSGE, src, max, 5));
+
+	emit(prog, MOV(dst, src));
+	emit(prog, ALU_IMM(BPF_SUB, dst, min));
+	emit(prog, ALU_IMM(BPF_DIV, dst, step));
+	emit(prog, ALU_IMM(BPF_ADD, dst, 1));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 1));
+
+	emit(prog, MOV_IMM(dst, n + 1));
+	return 0;
+}
+
+int emit_loglin_raw(prog_t *prog, int dst, int src, int bits)
+{
+	int val = BPF_REG_4, shift = BPF_REG_3;
+
+	emit(prog, MOV(val, src));
+	emit_log2_raw(prog, dst, src);
+
+	/* values below 2^bits get a bucket each, negative values
+	 * keep the -1 from log2. */
+	emit(prog, JMP_IMM(BPF_JSGE, val, 1 << bits, 4));
+	emit(prog, JMP_IMM(BPF_JSGE, val, 0, 1));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 9));
+	emit(prog, MOV(dst, val));
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 7));
+
+	/* dst is msb + 1, split each power of two into 2^bits
+	 * linear sub-buckets using the bits below the msb. */
+	emit(prog, MOV(shift, dst));
+	emit(prog, ALU_IMM(BPF_SUB, shift, bits + 1));
+	emit(prog, ALU(BPF_RSH, val, shift));
+	emit(prog, ALU_IMM(BPF_AND, val, (1 << bits) - 1));
+	emit(prog, ALU_IMM(BPF_SUB, dst, bits));
+	emit(prog, ALU_IMM(BPF_LSH, dst, bits));
+	emit(prog, ALU(BPF_ADD, dst, val));
+	return 0;
+}
+
+/* r0 is zero for one in `rate` calls. */
+int emit_sample_raw(prog_t *prog, int64_t rate)
+{
+	emit(prog, CALL(BPF_FUNC_get_prandom_u32));
+
+	if (!(rate & (rate - 1)))
+		emit(prog, ALU_IMM(BPF_AND, BPF_REG_0, rate - 1));
+	else
+		emit(prog, ALU_IMM(BPF_MOD, BPF_REG_0, rate));
+
+	return 0;
+}
+
 int emit_read_raw(prog_t *prog, ssize_t to, int from, size_t size)
 {
 	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
@@ -487,36 +614,157 @@ int emit_read_raw(prog_t *prog, ssize_t to, int from, size_t size)
 	return 0;
 }
 
-int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val)
+void emit_ld_map(prog_t *prog, int reg, node_t *map)
+{
+	sym_t *s = sym_from_node(map), *ctrl;
+
+	if (!s->map->dbuf) {
+		emit_ld_mapfd(prog, reg, s->map->fd);
+		return;
+	}
+
+	ctrl = symtable_get_ctrl(node_get_script(map)->dyn->script.st);
+	assert(ctrl);
+
+	/* double-buffered map, the control map holds the active half */
+	emit_ld_mapval(prog, reg, ctrl->map->fd, 0);
+	emit(prog, LDXW(reg, 0, reg));
+	emit(prog, JMP_IMM(BPF_JNE, reg, 0, 3));
+	emit_ld_mapfd(prog, reg, s->map->fd);
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 2));
+	emit_ld_mapfd(prog, reg, s->map->fd_alt);
+}
+
+/* bump the drop counter of `map` if r0 is non-zero (op), or zero
+ * (!op), i.e. the update failed. */
+static void emit_map_drop(prog_t *prog, node_t *map, int op)
+{
+	sym_t *s = sym_from_node(map), *drops;
+	ptrdiff_t ok;
+
+	drops = symtable_get_drops(node_get_script(map)->dyn->script.st);
+	if (!drops || !s->map->drop_slot)
+		return;
+
+	ok = prog_pos(prog);
+	emit(prog, JMP_IMM(op, BPF_REG_0, 0, 0));
+	emit_ld_mapval(prog, BPF_REG_1, drops->map->fd,
+		       (s->map->drop_slot - 1) * sizeof(uint64_t));
+	emit(prog, MOV_IMM(BPF_REG_2, 1));
+	emit(prog, XADDDW(BPF_REG_1, 0, BPF_REG_2));
+	emit_land(prog, ok, JMP_IMM(op, BPF_REG_0, 0, 0));
+}
+
+static int emit_map_update_flags(prog_t *prog, node_t *map,
+				 ssize_t key, ssize_t val, int flags)
 {
-	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit_ld_map(prog, BPF_REG_1, map);
 	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, key));
 	emit(prog, MOV(BPF_REG_3, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_3, val));
-	emit(prog, MOV_IMM(BPF_REG_4, 0));
+	emit(prog, MOV_IMM(BPF_REG_4, flags));
 	emit(prog, CALL(BPF_FUNC_map_update_elem));
 	return 0;
 }
 
-int emit_map_delete_raw(prog_t *prog, int fd, ssize_t key)
+int emit_map_update_raw(prog_t *prog, node_t *map, ssize_t key, ssize_t val)
 {
-	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit_map_update_flags(prog, map, key, val, BPF_ANY);
+	emit_map_drop(prog, map, BPF_JEQ);
+	return 0;
+}
+
+int emit_map_insert_raw(prog_t *prog, node_t *map, ssize_t key, ssize_t val)
+{
+	return emit_map_update_flags(prog, map, key, val, BPF_NOEXIST);
+}
+
+int emit_map_delete_raw(prog_t *prog, node_t *map, ssize_t key)
+{
+	emit_ld_map(prog, BPF_REG_1, map);
 	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, key));
 	emit(prog, CALL(BPF_FUNC_map_delete_elem));
 	return 0;
 }
 
-int emit_map_lookup_raw(prog_t *prog, int fd, ssize_t addr)
+int emit_map_lookup_raw(prog_t *prog, node_t *map, ssize_t addr)
 {
-	emit_ld_mapfd(prog, BPF_REG_1, fd);
+	emit_ld_map(prog, BPF_REG_1, map);
 	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, addr));
 	emit(prog, CALL(BPF_FUNC_map_lookup_elem));
 	return 0;
 }
 
+/* add `n` to the value stored under `map`'s key. the value is
+ * updated in place if the key exists, so there is no copy to and
+ * from the stack and concurrent updates are not lost. */
+int emit_map_add(prog_t *prog, node_t *map, int32_t n)
+{
+	ssize_t key = map->map.rec->dyn->addr, val = map->dyn->addr;
+	ptrdiff_t miss, hit, raced, racemiss;
+
+	emit_map_lookup_raw(prog, map, key);
+
+	miss = prog_pos(prog);
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+	emit(prog, MOV_IMM(BPF_REG_1, n));
+	emit(prog, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+	hit = prog_pos(prog);
+	emit(prog, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	/* first update of this key, insert it unless someone beat us
+	 * to it... */
+	emit_land(prog, miss, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+	emit(prog, MOV_IMM(BPF_REG_0, n));
+	emit(prog, STXDW(BPF_REG_10, val, BPF_REG_0));
+	emit_map_insert_raw(prog, map, key, val);
+
+	raced = prog_pos(prog);
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+
+	/* ...in which case we add to their value. if it is gone by
+	 * now, the map is full. */
+	emit_map_lookup_raw(prog, map, key);
+	emit_map_drop(prog, map, BPF_JNE);
+	racemiss = prog_pos(prog);
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+	emit(prog, MOV_IMM(BPF_REG_1, n));
+	emit(prog, XADDDW(BPF_REG_0, 0, BPF_REG_1));
+	emit_land(prog, racemiss, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+
+	emit_land(prog, raced, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
+	emit_land(prog, hit, JMP_IMM(BPF_JA, 0, 0, 0));
+	return 0;
+}
+
+/* copy `size` bytes from the map value pointed to by `from`. small
+ * values are loaded directly, larger ones go through probe_read. */
+#define MAP_READ_DIRECT_MAX 32
+
+static int emit_map_read_raw(prog_t *prog, ssize_t to, int from, size_t size)
+{
+	static const int sizes[] = { BPF_DW, BPF_W, BPF_H, BPF_B };
+	size_t off = 0, width;
+	int i;
+
+	if (size > MAP_READ_DIRECT_MAX)
+		return emit_read_raw(prog, to, from, size);
+
+	for (i = 0, width = 8; width; i++, width >>= 1) {
+		for (; size - off >= width; off += width) {
+			emit(prog, INSN(BPF_LDX | BPF_SIZE(sizes[i]) | BPF_MEM,
+					BPF_REG_1, from, off, 0));
+			emit(prog, INSN(BPF_STX | BPF_SIZE(sizes[i]) | BPF_MEM,
+					BPF_REG_10, BPF_REG_1, to + off, 0));
+		}
+	}
+
+	return 0;
+}
+
 int emit_rec_load(prog_t *prog, node_t *n)
 {
 	node_t *c;
@@ -537,23 +785,34 @@ int emit_rec_load(prog_t *prog, node_t *n)
 
 int emit_map_load(prog_t *prog, node_t *n)
 {
-	sym_t *s = sym_from_node(n);
+	ptrdiff_t miss;
 
 	/* when overriding the current value, there is no need to load
-	 * any previous value */
-	if (n->parent->type == TYPE_ASSIGN &&
-	    n->parent->assign.lval == n)
+	 * any previous value. methods update the value in place. */
+	if ((n->parent->type == TYPE_ASSIGN &&
+	     n->parent->assign.lval == n) ||
+	    n->parent->type == TYPE_METHOD)
 		return 0;
 
 	emit_stack_zero(prog, n);
 
-	emit_map_lookup_raw(prog, s->map->fd, n->map.rec->dyn->addr);
+	/* the same key was looked up earlier, reuse that pointer */
+	if (n->cse) {
+		emit(prog, LDXDW(BPF_REG_0, n->cse->cse_addr, BPF_REG_10));
+	} else {
+		emit_map_lookup_raw(prog, n, n->map.rec->dyn->addr);
+
+		if (n->cse_addr)
+			emit(prog, STXDW(BPF_REG_10, n->cse_addr, BPF_REG_0));
+	}
 
 	/* if we get a null pointer, skip copy */
-	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 5));
+	miss = prog_pos(prog);
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
 
 	/* if key existed, copy it to the value area */
-	emit_read_raw(prog, n->dyn->addr, BPF_REG_0, n->dyn->size);
+	emit_map_read_raw(prog, n->dyn->addr, BPF_REG_0, n->dyn->size);
+	emit_land(prog, miss, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 0));
 
 	if (n->dyn->loc == LOC_REG)
 		emit_xfer_stack(prog, n->dyn, n->dyn->addr);
@@ -561,6 +820,28 @@ int emit_map_load(prog_t *prog, node_t *n)
 	return 0;
 }
 
+int emit_call(prog_t *prog, node_t *call)
+{
+	dyn_t saved;
+	int err;
+
+	if (call->cse) {
+		saved = *call->cse->dyn;
+		saved.loc  = LOC_STACK;
+		saved.addr = call->cse->cse_addr;
+		return emit_xfer_dyns(prog, call->dyn, &saved);
+	}
+
+	err = call->dyn->call.func->compile(call, prog);
+	if (err || !call->cse_addr)
+		return err;
+
+	saved = *call->dyn;
+	saved.loc  = LOC_STACK;
+	saved.addr = call->cse_addr;
+	return emit_xfer_dyns(prog, &saved, call->dyn);
+}
+
 int emit_not(prog_t *prog, node_t *not)
 {
 	node_t *expr = not->not;
@@ -584,10 +865,23 @@ int emit_not(prog_t *prog, node_t *not)
 	return emit_xfer_dyns(prog, not->dyn, dst);
 }
 
-int emit_return(prog_t *prog, node_t *not)
+/* placeholder offset of jumps to the end of the current block */
+#define BLOCK_EXIT INT16_MAX
+
+/* always two instructions, the callers jump over them. */
+static void emit_exit(prog_t *prog)
 {
 	emit(prog, MOV_IMM(BPF_REG_0, 0));
-	emit(prog, EXIT);
+
+	if (prog->chained)
+		emit(prog, JMP_IMM(BPF_JA, 0, 0, BLOCK_EXIT));
+	else
+		emit(prog, EXIT);
+}
+
+int emit_return(prog_t *prog, node_t *not)
+{
+	emit_exit(prog);
 	return 0;
 }
 
@@ -604,6 +898,8 @@ int emit_binop(prog_t *prog, node_t *binop)
 
 	if (r->dyn->loc == LOC_REG)
 		operand = &dyn_reg[r->dyn->reg];
+	else if (dst->reg == BPF_REG_1)
+		operand = &dyn_reg[BPF_REG_2];
 	else
 		operand = &dyn_reg[BPF_REG_1];
 
@@ -640,12 +936,10 @@ int emit_binop(prog_t *prog, node_t *binop)
 int emit_assign(prog_t *prog, node_t *assign)
 {
 	node_t *lval = assign->assign.lval, *expr = assign->assign.expr;
-	sym_t *s = sym_from_node(lval);
 	int err;
 
 	if (lval->type == TYPE_MAP && !expr) {
-		emit_map_delete_raw(prog, s->map->fd,
-				    lval->map.rec->dyn->addr);
+		emit_map_delete_raw(prog, lval, lval->map.rec->dyn->addr);
 		return 0;
 	}
 	
@@ -654,20 +948,11 @@ int emit_assign(prog_t *prog, node_t *assign)
 		return err;
 
 	if (lval->type == TYPE_MAP)
-		emit_map_update_raw(prog, s->map->fd, lval->map.rec->dyn->addr,
+		emit_map_update_raw(prog, lval, lval->map.rec->dyn->addr,
 				    lval->dyn->addr);
 	return 0;
 }
 
-int emit_method(prog_t *prog, node_t *method)
-{
-	node_t *map = method->method.map;
-	sym_t *s = sym_from_node(map);
-
-	emit_map_update_raw(prog, s->map->fd, map->map.rec->dyn->addr,
-			    map->dyn->addr);
-	return 0;
-}
 
 
 int emit_if_then(prog_t *prog, node_t *n)
@@ -687,7 +972,7 @@ int emit_if_then(prog_t *prog, node_t *n)
 	if (err)
 		return err;
 
-	iff->dyn->iff.jmp = prog->ip;
+	iff->dyn->iff.jmp = prog_pos(prog);
 	emit(prog, if_then_insn);
 
 	_d("<");
@@ -697,15 +982,14 @@ int emit_if_then(prog_t *prog, node_t *n)
 int emit_if_else(prog_t *prog, node_t *n)
 {
 	node_t *iff = n->parent;
-	struct bpf_insn *at = iff->dyn->iff.jmp;
+	ptrdiff_t at = iff->dyn->iff.jmp;
 
 	_d(">");
 
-	iff->dyn->iff.jmp = prog->ip;
+	iff->dyn->iff.jmp = prog_pos(prog);
 	emit(prog, if_else_insn);
 
-	emit_at(prog, at,
-		JMP_IMM(BPF_JEQ, iff->dyn->reg, 0, prog->ip - at - 1));
+	emit_land(prog, at, JMP_IMM(BPF_JEQ, iff->dyn->reg, 0, 0));
 
 	_d("<");
 	return 0;
@@ -713,15 +997,11 @@ int emit_if_else(prog_t *prog, node_t *n)
 
 int emit_if(prog_t *prog, node_t *iff)
 {
-	struct bpf_insn *at, jmp;
-
-	at = iff->dyn->iff.jmp;
 	if (iff->iff.els)
-		jmp = JMP_IMM(BPF_JA, 0, 0, prog->ip - at - 1);
+		emit_land(prog, iff->dyn->iff.jmp, JMP_IMM(BPF_JA, 0, 0, 0));
 	else
-		jmp = JMP_IMM(BPF_JEQ, iff->dyn->reg, 0, prog->ip - at - 1);
-
-	emit_at(prog, at, jmp);
+		emit_land(prog, iff->dyn->iff.jmp,
+			  JMP_IMM(BPF_JEQ, iff->dyn->reg, 0, 0));
 	return 0;
 }
 
@@ -737,50 +1017,95 @@ int emit_continue(prog_t *prog, node_t *n)
 	return 0;
 }
 
-static int resolve_jmp(prog_t *prog, struct bpf_insn *at,
-		       struct bpf_insn search)
+static int resolve_jmp(prog_t *prog, ptrdiff_t at, struct bpf_insn search)
 {
 	_d(">");
-	for (; at < prog->ip; at++) {
-		if (bpf_insn_cmp(at, &search))
+	for (; at < prog_pos(prog); at++) {
+		if (bpf_insn_cmp(&prog->insns[at], &search))
 			continue;
 
 		/* replace placeholder instruction with real jump */
-		emit_at(prog, at, JMP_IMM(BPF_JA, 0, 0, prog->ip - at - 1));
+		emit_land(prog, at, JMP_IMM(BPF_JA, 0, 0, 0));
 	}
 	_d("<");
 	return 0;
 }
 
+#ifdef LINUX_HAS_BOUNDED_LOOPS
+/* the body of an unroll with a counter on the stack is compiled
+ * once, and looped over. */
+static void emit_unroll_init(prog_t *prog, node_t *n)
+{
+	if (n->dyn->loc != LOC_STACK)
+		return;
+
+	emit(prog, MOV_IMM(BPF_REG_0, 0));
+	emit(prog, STXDW(BPF_REG_10, n->dyn->addr, BPF_REG_0));
+}
+
+static int emit_unroll_loop(prog_t *prog, node_t *n)
+{
+	ptrdiff_t start = n->dyn->unroll.start;
+
+	if (n->dyn->loc != LOC_STACK)
+		return 0;
+
+	emit(prog, LDXDW(BPF_REG_0, n->dyn->addr, BPF_REG_10));
+	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_0, 1));
+	emit(prog, STXDW(BPF_REG_10, n->dyn->addr, BPF_REG_0));
+	emit(prog, JMP_IMM(BPF_JLT, BPF_REG_0, n->unroll.count,
+			   start - prog_pos(prog) - 1));
+	return 1;
+}
+#else
+static void emit_unroll_init(prog_t *prog, node_t *n) { }
+static int  emit_unroll_loop(prog_t *prog, node_t *n) { return 0; }
+#endif
+
 int emit_unroll(prog_t *prog, node_t *n)
 {
-	struct bpf_insn *at, *start;
-	ptrdiff_t insns;
+	ptrdiff_t insns, start;
 	int i, j;
 
 	start = n->dyn->unroll.start;
-	insns = prog->ip - start;
+	insns = prog_pos(prog) - start;
 
 	resolve_jmp(prog, start, continue_insn);
 
-	for (at = start, i = 1; i < n->unroll.count; i++) {
+	if (emit_unroll_loop(prog, n))
+		goto out;
+
+	for (i = 1; i < n->unroll.count; i++) {
 		_D("%d/%"PRId64, i, n->unroll.count - 1);
 
 		for (j = 0; j < insns; j++)
-			emit(prog, *at++);
+			emit(prog, prog->insns[start + j]);
 	}
 
+out:
 	resolve_jmp(prog, start, break_insn);
 	return 0;
 }
 
+/* the value of a node that has been eliminated is copied from the
+ * earlier one, so nothing below it is ever evaluated. */
+static int compile_cse_skip(node_t *n)
+{
+	for (n = n->parent; n && n->type != TYPE_PROBE; n = n->parent)
+		if (n->cse)
+			return 1;
+
+	return 0;
+}
+
 static int compile_pre(node_t *n, void *_prog)
 {
 	prog_t *prog = _prog;
 
 	switch (n->type) {
 	case TYPE_UNROLL:
-		n->dyn->unroll.start = prog->ip;
+		emit_unroll_init(prog, n);
+		n->dyn->unroll.start = prog_pos(prog);
 		break;
 	default:
 		break;
@@ -795,7 +1120,7 @@ static int compile_post(node_t *n, void *_prog)
 
 	(void)(prog);
 
-	if (n->dyn->loc == LOC_VIRTUAL)
+	if (n->dyn->loc == LOC_VIRTUAL || compile_cse_skip(n))
 		return 0;
 
 	_D("> %s%s%s (%s/%s/%#zx)", n->string ? "" : "<",
@@ -839,11 +1164,11 @@ static int compile_post(node_t *n, void *_prog)
 		break;
 
 	case TYPE_METHOD:
-		err = emit_method(prog, n);
+		/* the method's call does the update */
 		break;
 
 	case TYPE_CALL:
-		err = n->dyn->call.func->compile(n, prog);
+		err = emit_call(prog, n);
 		break;
 
 	case TYPE_IF:
@@ -892,11 +1217,21 @@ static int compile_walk(node_t *n, prog_t *prog)
 	return node_walk(n, compile_pre, compile_post, prog);
 }
 
-static int compile_pred(node_t *pred, prog_t *prog)
+static int compile_pred(node_t *probe, prog_t *prog)
 {
+	node_t *pred = probe->probe.pred;
+	int64_t sample = probe->dyn->probe.sample;
 	const dyn_t *dst;
 	int err;
 
+	/* throw away the hits that are not sampled before doing
+	 * anything else, that is the whole point. */
+	if (sample > 1) {
+		emit_sample_raw(prog, sample);
+		emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2));
+		emit_exit(prog);
+	}
+
 	if (!pred)
 		return 0;
 
@@ -914,51 +1249,135 @@ static int compile_pred(node_t *pred, prog_t *prog)
 	emit_xfer_dyn(prog, dst, pred);
 
 	emit(prog, JMP_IMM(BPF_JNE, dst->reg, 0, 2));
-	emit(prog, MOV_IMM(BPF_REG_0, 0));
-	emit(prog, EXIT);
+	emit_exit(prog);
 
 	_D("<");
 	return 0;
 }
 
-prog_t *compile_probe(node_t *probe)
+/* events that the provider could not limit to the traced process or
+ * cgroup fire for everyone, so the program drops the others before
+ * doing anything else. */
+static int compile_scope(node_t *probe, prog_t *prog)
 {
-	prog_t *prog;
+	pvdr_t *pvdr = probe->dyn->probe.pvdr;
+
+	if (G.pid && !(pvdr->scope & PVDR_SCOPE_PID)) {
+		emit(prog, CALL(BPF_FUNC_get_current_pid_tgid));
+		emit(prog, ALU_IMM(BPF_RSH, BPF_REG_0, 32));
+		emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, G.pid, 2));
+		emit_exit(prog);
+	}
+
+	if (!G.cgroup || (pvdr->scope & PVDR_SCOPE_CGROUP))
+		return 0;
+
+#ifdef LINUX_HAS_CGROUP_ID
+	emit(prog, CALL(BPF_FUNC_get_current_cgroup_id));
+	emit_ld_imm64(prog, BPF_REG_1, G.cgroup_id);
+	emit(prog, JMP(BPF_JEQ, BPF_REG_0, BPF_REG_1, 2));
+	emit_exit(prog);
+	return 0;
+#else
+	_e("%s: cgroup filtering is not supported by this kernel",
+	   probe->string);
+	return -ENOSYS;
+#endif
+}
+
+static int compile_optimize(node_t *probe, prog_t *prog)
+{
+	struct bpf_insn *insn;
+	size_t before = prog_pos(prog);
+	int err;
+
+	err = prog_optimize(prog);
+	if (err)
+		return err;
+
+	if (!G.dump)
+		return 0;
+
+	fprintf(stderr, "\n%s: %zu insns, %zu after optimization\n",
+		probe->string, before, (size_t)(prog->ip - prog->insns));
+
+	for (insn = prog->insns; insn < prog->ip; insn++)
+		dump_insn(*insn, insn - prog->insns);
+
+	fputc('\n', stderr);
+	return 0;
+}
+
+static int compile_block(node_t *probe, prog_t *prog)
+{
+	ptrdiff_t start = prog_pos(prog), at;
 	node_t *stmt;
 	int err;
 
-	prog = calloc(1, sizeof(*prog));
-	if (!prog)
-		return NULL;
+	err = compile_pred(probe, prog);
+	if (err)
+		return err;
+
+	node_foreach(stmt, probe->probe.stmts) {
+		err = compile_walk(stmt, prog);
+		if (err)
+			return err;
+
+		if (!stmt->next)
+			break;
+	}
+
+	if (!prog->chained) {
+		if (stmt->type != TYPE_RETURN)
+			emit_exit(prog);
+
+		return 0;
+	}
+
+	/* the next block starts here */
+	for (at = start; at < prog_pos(prog); at++)
+		if (prog->insns[at].code == (BPF_JMP | BPF_JA) &&
+		    prog->insns[at].off == BLOCK_EXIT)
+			emit_land(prog, at, JMP_IMM(BPF_JA, 0, 0, 0));
+
+	return 0;
+}
 
-	prog->ip = prog->insns;
+prog_t *compile_probe(node_t *probe)
+{
+	prog_t *prog;
+	node_t *block, *next;
+	int err;
+
+	prog = prog_new();
 
 	_d("%s", probe->string);
 
 	/* context (pt_regs) pointer is supplied in r1 */
 	emit(prog, MOV(BPF_REG_9, BPF_REG_1));
 
-	err = compile_pred(probe->probe.pred, prog);
+	err = compile_scope(probe, prog);
 	if (err)
 		goto err_free;
 
-	node_foreach(stmt, probe->probe.stmts) {
-		err = compile_walk(stmt, prog);
+	/* each block uses its own registers and stack, which are all
+	 * dead once it is done, so they can simply follow each other. */
+	for (block = probe; block; block = next) {
+		next = block->dyn->probe.follower;
+		prog->chained = !!next;
+
+		err = compile_block(block, prog);
 		if (err)
 			goto err_free;
-
-		if (!stmt->next)
-			break;
 	}
-	
-	if (stmt->type == TYPE_RETURN)
-		return prog;
 
-	emit(prog, MOV_IMM(BPF_REG_0, 0));
-	emit(prog, EXIT);
+	err = compile_optimize(probe, prog);
+	if (err)
+		goto err_free;
+
 	return prog;
 
 err_free:
-	free(prog);
+	prog_free(prog);
 	return NULL;
 }
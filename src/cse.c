@@ -0,0 +1,371 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ply/ast.h>
+#include <ply/module.h>
+#include <ply/ply.h>
+
+/* common subexpression elimination. the probe is walked in the same
+ * order as it is compiled, keeping track of the values that are
+ * known to have been computed on every path to the current node. a
+ * later node computing the same value is linked to the earlier one
+ * through `cse`, and the earlier one is given a stack slot in
+ * `cse_addr` to keep the value around:
+ *
+ * - pure calls store their result in it.
+ *
+ * - map loads store the pointer returned by map_lookup_elem,
+ *   later loads of the same key just copy the value again. any
+ *   other reference to the map invalidates it.
+ */
+
+struct cse_entry {
+	node_t *n;
+	int     dead;
+};
+
+struct cse {
+	node_t *probe;
+
+	struct cse_entry *avail;
+	size_t n_avail;
+
+	int unroll;
+};
+
+static int cse_pure(node_t *n)
+{
+	node_t *c;
+
+	switch (n->type) {
+	case TYPE_INT:
+	case TYPE_STR:
+	case TYPE_VAR:
+		return 1;
+
+	case TYPE_CALL:
+		if (!n->dyn->call.func->pure)
+			return 0;
+
+		node_foreach(c, n->call.vargs)
+			if (!cse_pure(c))
+				return 0;
+		return 1;
+
+	case TYPE_REC:
+		node_foreach(c, n->rec.vargs)
+			if (!cse_pure(c))
+				return 0;
+		return 1;
+
+	case TYPE_BINOP:
+		return cse_pure(n->binop.left) && cse_pure(n->binop.right);
+
+	case TYPE_NOT:
+		return cse_pure(n->not);
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int cse_equal(node_t *a, node_t *b);
+
+static int cse_func_equal(const func_t *a, const func_t *b)
+{
+	/* tracepoint fields get a func_t of their own for every
+	 * reference, so fall back to comparing the names. */
+	return a == b ||
+		(a->compile == b->compile && !strcmp(a->name, b->name));
+}
+
+static int cse_list_equal(node_t *a, node_t *b)
+{
+	for (; a && b; a = a->next, b = b->next)
+		if (!cse_equal(a, b))
+			return 0;
+
+	return !a && !b;
+}
+
+static int cse_equal(node_t *a, node_t *b)
+{
+	if (a->type != b->type)
+		return 0;
+
+	switch (a->type) {
+	case TYPE_INT:
+		return a->integer == b->integer;
+
+	case TYPE_STR:
+		return !strcmp(a->string, b->string);
+
+	case TYPE_VAR:
+		/* variables share the dyn of their symbol */
+		return a->dyn == b->dyn;
+
+	case TYPE_CALL:
+		return cse_func_equal(a->dyn->call.func, b->dyn->call.func) &&
+			cse_list_equal(a->call.vargs, b->call.vargs);
+
+	case TYPE_MAP:
+		return a->dyn == b->dyn && cse_equal(a->map.rec, b->map.rec);
+
+	case TYPE_REC:
+		return cse_list_equal(a->rec.vargs, b->rec.vargs);
+
+	case TYPE_BINOP:
+		return a->binop.op == b->binop.op &&
+			cse_equal(a->binop.left,  b->binop.left) &&
+			cse_equal(a->binop.right, b->binop.right);
+
+	case TYPE_NOT:
+		return cse_equal(a->not, b->not);
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+static int cse_uses(node_t *n, dyn_t *sym)
+{
+	node_t *c;
+
+	switch (n->type) {
+	case TYPE_VAR:
+	case TYPE_MAP:
+		if (n->dyn == sym)
+			return 1;
+
+		return n->type == TYPE_MAP && cse_uses(n->map.rec, sym);
+
+	case TYPE_CALL:
+		node_foreach(c, n->call.vargs)
+			if (cse_uses(c, sym))
+				return 1;
+		return 0;
+
+	case TYPE_REC:
+		node_foreach(c, n->rec.vargs)
+			if (cse_uses(c, sym))
+				return 1;
+		return 0;
+
+	case TYPE_BINOP:
+		return cse_uses(n->binop.left, sym) ||
+			cse_uses(n->binop.right, sym);
+
+	case TYPE_NOT:
+		return cse_uses(n->not, sym);
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/* the map or variable behind `sym` is about to be written, nothing
+ * computed from it can be reused after this point. */
+static void cse_kill(struct cse *c, dyn_t *sym)
+{
+	struct cse_entry *e;
+
+	for (e = c->avail; e < &c->avail[c->n_avail]; e++)
+		if (!e->dead && cse_uses(e->n, sym))
+			e->dead = 1;
+}
+
+static struct cse_entry *cse_find(struct cse *c, node_t *n)
+{
+	struct cse_entry *e;
+
+	for (e = c->avail; e < &c->avail[c->n_avail]; e++)
+		if (!e->dead && cse_equal(e->n, n))
+			return e;
+
+	return NULL;
+}
+
+static void cse_add(struct cse *c, node_t *n)
+{
+	c->avail = realloc(c->avail, (c->n_avail + 1) * sizeof(*c->avail));
+	assert(c->avail);
+
+	c->avail[c->n_avail].n = n;
+	c->avail[c->n_avail].dead = 0;
+	c->n_avail++;
+}
+
+static int cse_candidate(struct cse *c, node_t *n)
+{
+	if (c->unroll || !cse_pure(n))
+		return 0;
+
+	switch (n->dyn->loc) {
+	case LOC_REG:
+	case LOC_STACK:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* `n` computes a value that might be known already. returns
+ * non-zero if it was, in which case its children will never be
+ * evaluated. */
+static int cse_reuse(struct cse *c, node_t *n)
+{
+	struct cse_entry *e;
+	node_t *first;
+
+	e = cse_find(c, n);
+	if (!e)
+		return 0;
+
+	first = e->n;
+	if (!first->cse_addr)
+		first->cse_addr = node_probe_stack_get(c->probe, first,
+			n->type == TYPE_MAP ? sizeof(void *) : first->dyn->size);
+
+	_d("%s reuses %p", node_str(n), first);
+	n->cse = first;
+	return 1;
+}
+
+static void cse_walk(struct cse *c, node_t *n);
+
+static void cse_walk_list(struct cse *c, node_t *head)
+{
+	node_t *n;
+
+	node_foreach(n, head)
+		cse_walk(c, n);
+}
+
+static void cse_walk_scoped(struct cse *c, node_t *head)
+{
+	size_t mark = c->n_avail;
+
+	/* values computed in a branch are not known after it, but
+	 * anything that is invalidated stays invalid. */
+	cse_walk_list(c, head);
+	c->n_avail = mark;
+}
+
+static void cse_walk_map(struct cse *c, node_t *n)
+{
+	int rvalue = n->parent->type != TYPE_METHOD &&
+		!(n->parent->type == TYPE_ASSIGN && n->parent->assign.lval == n);
+
+	if (rvalue && cse_candidate(c, n->map.rec) && cse_reuse(c, n))
+		return;
+
+	cse_walk(c, n->map.rec);
+
+	/* writes are accounted for by the parent, once the new value
+	 * has been computed. */
+	if (rvalue && cse_candidate(c, n->map.rec))
+		cse_add(c, n);
+}
+
+static void cse_walk(struct cse *c, node_t *n)
+{
+	switch (n->type) {
+	case TYPE_IF:
+		cse_walk(c, n->iff.cond);
+		cse_walk_scoped(c, n->iff.then);
+		if (n->iff.els)
+			cse_walk_scoped(c, n->iff.els);
+		break;
+
+	case TYPE_UNROLL:
+		/* the body is repeated, only look for writes */
+		c->unroll++;
+		cse_walk_list(c, n->unroll.stmts);
+		c->unroll--;
+		break;
+
+	case TYPE_CALL:
+		if (cse_candidate(c, n) && cse_reuse(c, n))
+			break;
+
+		cse_walk_list(c, n->call.vargs);
+
+		if (cse_candidate(c, n))
+			cse_add(c, n);
+		break;
+
+	case TYPE_ASSIGN:
+		cse_walk(c, n->assign.lval);
+		if (n->assign.expr)
+			cse_walk(c, n->assign.expr);
+
+		cse_kill(c, n->assign.lval->dyn);
+		break;
+
+	case TYPE_METHOD:
+		cse_walk(c, n->method.map);
+		cse_walk(c, n->method.call);
+
+		cse_kill(c, n->method.map->dyn);
+		break;
+
+	case TYPE_MAP:
+		cse_walk_map(c, n);
+		break;
+
+	case TYPE_BINOP:
+		cse_walk(c, n->binop.left);
+		cse_walk(c, n->binop.right);
+		break;
+
+	case TYPE_NOT:
+		cse_walk(c, n->not);
+		break;
+
+	case TYPE_REC:
+		cse_walk_list(c, n->rec.vargs);
+		break;
+
+	default:
+		break;
+	}
+}
+
+int cse_probe(node_t *probe)
+{
+	struct cse c = { .probe = probe };
+
+	if (probe->probe.pred)
+		cse_walk(&c, probe->probe.pred);
+
+	cse_walk_list(&c, probe->probe.stmts);
+
+	free(c.avail);
+	return 0;
+}
@@ -0,0 +1,579 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ply/ply.h>
+#include <ply/elfsyms.h>
+
+#define ELFSYMS_CACHE "/tmp/ply.elfsyms"
+
+#if __SIZEOF_POINTER__ == 8
+#define ELF_NATIVE_CLASS ELFCLASS64
+#else
+#define ELF_NATIVE_CLASS ELFCLASS32
+#endif
+
+struct elf_file {
+	const uint8_t *base;
+	size_t size;
+
+	const ElfW(Ehdr) *ehdr;
+	const ElfW(Phdr) *phdr;
+	const ElfW(Shdr) *shdr;
+
+	char key[sizeof(((struct elfsym_cache_hdr *)0)->key)];
+};
+
+/* names point into the mapped binary until the index is written */
+struct elfsym_ent {
+	const char *name;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct elfsym_build {
+	struct elfsym_ent *ents;
+	size_t n_ents, max_ents;
+};
+
+static int elf_in_file(struct elf_file *ef, uint64_t off, uint64_t len)
+{
+	return off <= ef->size && len <= ef->size - off;
+}
+
+static int elf_map(struct elf_file *ef, int fd)
+{
+	const ElfW(Ehdr) *ehdr;
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if ((size_t)st.st_size < sizeof(*ehdr))
+		return -ENOEXEC;
+
+	ef->size = st.st_size;
+	ef->base = mmap(NULL, ef->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (ef->base == MAP_FAILED) {
+		ef->base = NULL;
+		return -errno;
+	}
+
+	ehdr = ef->ehdr = (const void *)ef->base;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+	    ehdr->e_ident[EI_CLASS] != ELF_NATIVE_CLASS)
+		return -ENOEXEC;
+
+	if (ehdr->e_phnum) {
+		if (ehdr->e_phentsize != sizeof(*ef->phdr) ||
+		    !elf_in_file(ef, ehdr->e_phoff,
+				 (uint64_t)ehdr->e_phnum * sizeof(*ef->phdr)))
+			return -ENOEXEC;
+
+		ef->phdr = (const void *)(ef->base + ehdr->e_phoff);
+	}
+
+	if (ehdr->e_shnum) {
+		if (ehdr->e_shentsize != sizeof(*ef->shdr) ||
+		    !elf_in_file(ef, ehdr->e_shoff,
+				 (uint64_t)ehdr->e_shnum * sizeof(*ef->shdr)))
+			return -ENOEXEC;
+
+		ef->shdr = (const void *)(ef->base + ehdr->e_shoff);
+	}
+
+	return 0;
+}
+
+static void elf_unmap(struct elf_file *ef)
+{
+	if (ef->base)
+		munmap((void *)ef->base, ef->size);
+}
+
+#define NOTE_ALIGN(_n) (((_n) + 3) & ~3UL)
+
+static int elf_build_id(struct elf_file *ef, char *key, size_t size)
+{
+	const ElfW(Phdr) *ph;
+	const ElfW(Nhdr) *nh;
+	const uint8_t *p, *end, *desc;
+	size_t i, len;
+
+	for (ph = ef->phdr; ph < &ef->phdr[ef->ehdr->e_phnum]; ph++) {
+		if (ph->p_type != PT_NOTE ||
+		    !elf_in_file(ef, ph->p_offset, ph->p_filesz))
+			continue;
+
+		p = ef->base + ph->p_offset;
+		end = p + ph->p_filesz;
+		while (p + sizeof(*nh) <= end) {
+			nh = (const void *)p;
+			desc = p + sizeof(*nh) + NOTE_ALIGN(nh->n_namesz);
+			p = desc + NOTE_ALIGN(nh->n_descsz);
+			if (p > end)
+				break;
+
+			if (nh->n_type != NT_GNU_BUILD_ID ||
+			    nh->n_namesz != sizeof("GNU") ||
+			    memcmp(nh + 1, "GNU", sizeof("GNU")))
+				continue;
+
+			len = nh->n_descsz;
+			if (!len || len * 2 >= size)
+				return -EINVAL;
+
+			for (i = 0; i < len; i++)
+				sprintf(&key[i * 2], "%02x", desc[i]);
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+/* without a build-id, all we can do is to assume that a binary that
+ * is still in the same place and looks the same has not changed. */
+static void elfsyms_key(struct elf_file *ef, int fd)
+{
+	struct stat st;
+
+	if (!elf_build_id(ef, ef->key, sizeof(ef->key)))
+		return;
+
+	fstat(fd, &st);
+	snprintf(ef->key, sizeof(ef->key), "i%" PRIx64 "-%" PRIx64 "-%" PRIx64 "-%" PRIx64,
+		 (uint64_t)st.st_dev, (uint64_t)st.st_ino,
+		 (uint64_t)st.st_size, (uint64_t)st.st_mtime);
+}
+
+/* uprobes are placed by file offset, so translate the symbol's
+ * virtual address using the segment that it is loaded from. */
+static int elf_vaddr_to_offset(struct elf_file *ef, uint64_t vaddr,
+			       uint64_t *offset)
+{
+	const ElfW(Phdr) *ph;
+
+	for (ph = ef->phdr; ph < &ef->phdr[ef->ehdr->e_phnum]; ph++) {
+		if (ph->p_type != PT_LOAD ||
+		    vaddr < ph->p_vaddr || vaddr >= ph->p_vaddr + ph->p_filesz)
+			continue;
+
+		*offset = vaddr - ph->p_vaddr + ph->p_offset;
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+static int elfsym_add(struct elfsym_build *b, const char *name,
+		      uint64_t offset, uint64_t size)
+{
+	struct elfsym_ent *e;
+
+	if (b->n_ents == b->max_ents) {
+		b->max_ents = b->max_ents ? b->max_ents << 1 : 0x400;
+		b->ents = realloc(b->ents, b->max_ents * sizeof(*b->ents));
+		if (!b->ents)
+			return -ENOMEM;
+	}
+
+	e = &b->ents[b->n_ents++];
+	e->name = name;
+	e->offset = offset;
+	e->size = size;
+	return 0;
+}
+
+static int elfsyms_read_section(struct elfsym_build *b, struct elf_file *ef,
+				const ElfW(Shdr) *sh)
+{
+	const ElfW(Shdr) *strsh;
+	const ElfW(Sym) *sym, *end;
+	const char *strtab;
+	uint64_t offset;
+	int err;
+
+	if (sh->sh_entsize != sizeof(*sym) ||
+	    sh->sh_link >= ef->ehdr->e_shnum ||
+	    !elf_in_file(ef, sh->sh_offset, sh->sh_size))
+		return 0;
+
+	strsh = &ef->shdr[sh->sh_link];
+	if (!strsh->sh_size ||
+	    !elf_in_file(ef, strsh->sh_offset, strsh->sh_size))
+		return 0;
+
+	strtab = (const char *)ef->base + strsh->sh_offset;
+	if (strtab[strsh->sh_size - 1])
+		return 0;
+
+	sym = (const void *)(ef->base + sh->sh_offset);
+	end = sym + sh->sh_size / sizeof(*sym);
+	for (; sym < end; sym++) {
+		if (ELF64_ST_TYPE(sym->st_info) != STT_FUNC ||
+		    sym->st_shndx == SHN_UNDEF || !sym->st_value ||
+		    !sym->st_name || sym->st_name >= strsh->sh_size)
+			continue;
+
+		if (elf_vaddr_to_offset(ef, sym->st_value, &offset))
+			continue;
+
+		err = elfsym_add(b, strtab + sym->st_name, offset, sym->st_size);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int elfsym_ent_cmp(const void *_a, const void *_b)
+{
+	const struct elfsym_ent *a = _a, *b = _b;
+	int diff;
+
+	diff = strcmp(a->name, b->name);
+	if (diff)
+		return diff;
+
+	if (a->offset < b->offset)
+		return -1;
+	if (a->offset > b->offset)
+		return 1;
+	return 0;
+}
+
+/* dynamic symbols are usually also in .symtab, and a name may be
+ * used by several local functions. the index holds each function
+ * once, names are shared. */
+static struct elfsym_cache *elfsyms_pack(struct elfsym_build *b,
+					 const char *key, size_t *sizep)
+{
+	struct elfsym_ent *e, *end = &b->ents[b->n_ents];
+	struct elfsym_cache *cache;
+	size_t n_syms = 0, strtab_size = 0, size;
+	elfsym_t *s;
+	char *strtab;
+
+	qsort(b->ents, b->n_ents, sizeof(*b->ents), elfsym_ent_cmp);
+
+	for (e = b->ents; e < end; e++) {
+		if (e > b->ents && !strcmp(e[-1].name, e->name)) {
+			if (e[-1].offset != e->offset)
+				n_syms++;
+			continue;
+		}
+
+		n_syms++;
+		strtab_size += strlen(e->name) + 1;
+	}
+
+	size = sizeof(*cache) + n_syms * sizeof(*s) + strtab_size;
+	cache = calloc(1, size);
+	if (!cache)
+		return NULL;
+
+	cache->hdr.version = ELFSYMS_CACHE_VERSION;
+	cache->hdr.n_syms = n_syms;
+	cache->hdr.strtab_size = strtab_size;
+	snprintf(cache->hdr.key, sizeof(cache->hdr.key), "%s", key);
+
+	s = cache->sym;
+	strtab = (char *)&cache->sym[n_syms];
+	strtab_size = 0;
+	for (e = b->ents; e < end; e++) {
+		if (e > b->ents && !strcmp(e[-1].name, e->name)) {
+			if (e[-1].offset == e->offset)
+				continue;
+
+			*s = s[-1];
+		} else {
+			s->name = strtab_size;
+			strcpy(strtab + strtab_size, e->name);
+			strtab_size += strlen(e->name) + 1;
+		}
+
+		s->offset = e->offset;
+		s->size = e->size;
+		s++;
+	}
+
+	*sizep = size;
+	return cache;
+}
+
+static struct elfsym_cache *elfsyms_build(struct elf_file *ef, size_t *sizep)
+{
+	struct elfsym_build b = { 0 };
+	struct elfsym_cache *cache = NULL;
+	const ElfW(Shdr) *sh;
+	int err = 0;
+
+	for (sh = ef->shdr; !err && sh < &ef->shdr[ef->ehdr->e_shnum]; sh++) {
+		if (sh->sh_type == SHT_SYMTAB || sh->sh_type == SHT_DYNSYM)
+			err = elfsyms_read_section(&b, ef, sh);
+	}
+
+	if (!err)
+		cache = elfsyms_pack(&b, ef->key, sizep);
+
+	free(b.ents);
+	return cache;
+}
+
+/* /tmp is shared, so the directory must be ours and closed to
+ * everyone else, otherwise they decide what ends up in it. everything
+ * is then accessed relative to it. */
+static int elfsyms_cache_dir(int create)
+{
+	int dirfd, err;
+
+	if (create && mkdir(ELFSYMS_CACHE, 0700) && errno != EEXIST)
+		return -errno;
+
+	dirfd = open(ELFSYMS_CACHE, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dirfd < 0)
+		return -errno;
+
+	err = fd_trusted(dirfd);
+	if (err) {
+		close(dirfd);
+		return err;
+	}
+
+	return dirfd;
+}
+
+static void elfsyms_cache_write(const struct elfsym_cache *cache, size_t size)
+{
+	const char *key = cache->hdr.key;
+	char tmp[sizeof(cache->hdr.key) + 16];
+	int dirfd, fd, err = 0;
+
+	dirfd = elfsyms_cache_dir(1);
+	if (dirfd < 0) {
+		errno = -dirfd;
+		goto err;
+	}
+
+	/* build it on the side, so that no one ever maps a half
+	 * written index. */
+	snprintf(tmp, sizeof(tmp), "%s.%d", key, getpid());
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		err = errno;
+		goto out;
+	}
+
+	if (write(fd, cache, size) != (ssize_t)size)
+		err = errno ? : EIO;
+
+	if (close(fd) && !err)
+		err = errno;
+
+	if (!err && renameat(dirfd, tmp, dirfd, key))
+		err = errno;
+
+	if (err)
+		unlinkat(dirfd, tmp, 0);
+out:
+	close(dirfd);
+	if (!err)
+		return;
+
+	errno = err;
+err:
+	/* the index is still used, it just has to be rebuilt next
+	 * time around. */
+	_d("unable to store index: %s", strerror(errno));
+}
+
+static int elfsyms_cache_valid(elfsyms_t *es, const char *key)
+{
+	const struct elfsym_cache_hdr *hdr = &es->cache->hdr;
+	const char *strtab;
+	size_t size;
+	uint32_t i;
+
+	if (es->cache_size < sizeof(*hdr) ||
+	    hdr->version != ELFSYMS_CACHE_VERSION ||
+	    strncmp(hdr->key, key, sizeof(hdr->key)))
+		return 0;
+
+	size = es->cache_size - sizeof(*hdr);
+	if (hdr->n_syms > size / sizeof(elfsym_t) ||
+	    size - hdr->n_syms * sizeof(elfsym_t) != hdr->strtab_size)
+		return 0;
+
+	for (i = 0; i < hdr->n_syms; i++)
+		if (es->cache->sym[i].name >= hdr->strtab_size)
+			return 0;
+
+	strtab = (const char *)&es->cache->sym[hdr->n_syms];
+	return !hdr->strtab_size || !strtab[hdr->strtab_size - 1];
+}
+
+static int elfsyms_cache_map(elfsyms_t *es, const char *key)
+{
+	struct stat st;
+	int dirfd, err;
+
+	dirfd = elfsyms_cache_dir(0);
+	if (dirfd < 0)
+		return dirfd;
+
+	es->cache_fd = openat(dirfd, key, O_RDONLY | O_NOFOLLOW);
+	err = (es->cache_fd < 0) ? -errno : 0;
+	close(dirfd);
+	if (err)
+		return err;
+
+	/* only trust an index that we wrote */
+	err = fd_trusted(es->cache_fd);
+	if (err)
+		return err;
+
+	if (fstat(es->cache_fd, &st))
+		return -errno;
+
+	es->cache_size = st.st_size;
+	es->cache = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			 es->cache_fd, 0);
+	if (es->cache == MAP_FAILED) {
+		es->cache = NULL;
+		return -errno;
+	}
+
+	return elfsyms_cache_valid(es, key) ? 0 : -EINVAL;
+}
+
+void elfsyms_close(elfsyms_t *es)
+{
+	if (es->cache_fd >= 0) {
+		if (es->cache)
+			munmap(es->cache, es->cache_size);
+		close(es->cache_fd);
+	} else {
+		free(es->cache);
+	}
+
+	free(es);
+}
+
+/* the symbols are sorted by name, so every match of a pattern is
+ * among the ones that start with its literal prefix. */
+const elfsym_t *elfsym_match(elfsyms_t *es, const char *pattern,
+			     const elfsym_t *prev)
+{
+	const elfsym_t *s = es->cache->sym, *end = &s[es->cache->hdr.n_syms];
+	size_t prefix = strcspn(pattern, "*?[\\");
+	size_t lo = 0, hi = es->cache->hdr.n_syms, mid;
+
+	if (prev) {
+		s = prev + 1;
+	} else {
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (strncmp(elfsym_name(es, &s[mid]), pattern, prefix) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		s += lo;
+	}
+
+	for (; s < end; s++) {
+		if (strncmp(elfsym_name(es, s), pattern, prefix))
+			break;
+
+		if (!fnmatch(pattern, elfsym_name(es, s), 0))
+			return s;
+	}
+
+	return NULL;
+}
+
+elfsyms_t *elfsyms_open(const char *path)
+{
+	struct elf_file ef = { 0 };
+	elfsyms_t *es;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	es = calloc(1, sizeof(*es));
+	assert(es);
+	es->cache_fd = -1;
+
+	err = elf_map(&ef, fd);
+	if (err)
+		goto err;
+
+	elfsyms_key(&ef, fd);
+
+	err = elfsyms_cache_map(es, ef.key);
+	if (!err)
+		goto out;
+
+	if (es->cache)
+		munmap(es->cache, es->cache_size);
+	if (es->cache_fd >= 0)
+		close(es->cache_fd);
+	es->cache = NULL;
+	es->cache_fd = -1;
+
+	_d("%s: building index %s", path, ef.key);
+	es->cache = elfsyms_build(&ef, &es->cache_size);
+	if (!es->cache) {
+		err = -ENOMEM;
+		goto err;
+	}
+
+	elfsyms_cache_write(es->cache, es->cache_size);
+out:
+	es->strtab = (const char *)&es->cache->sym[es->cache->hdr.n_syms];
+	elf_unmap(&ef);
+	close(fd);
+	return es;
+err:
+	elf_unmap(&ef);
+	close(fd);
+	free(es);
+	errno = -err;
+	return NULL;
+}
@@ -17,8 +17,15 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <ply/bpf-syscall.h>
@@ -26,7 +33,6 @@
 #include <ply/ply.h>
 
 #include <sys/mman.h>
-#include <sys/queue.h>
 
 struct lost_event {
 	struct perf_event_header hdr;
@@ -34,39 +40,60 @@ struct lost_event {
 	uint64_t lost;
 };
 
-struct evqueue {
-	int fd;
-	struct perf_event_mmap_page *mem;
+/* a reader owns a contiguous range of CPUs' queues. with a single
+ * reader it runs in the main thread, otherwise each one gets a thread
+ * pinned to the CPUs it serves. */
+struct evreader {
+	evpipe_t *evp;
+	pthread_t tid;
+
+	uint32_t cpu, ncpus;
+	struct pollfd *poll;
 
-	void *buf;
+	struct evpipe_stats stats;
 };
 
-TAILQ_HEAD(evhandlers, evhandler);
-static struct evhandlers evh_list = TAILQ_HEAD_INITIALIZER(evh_list);
+/* how often reader threads check if they should exit */
+#define EVREADER_TICK_MS 100
+
+static pthread_mutex_t evpipe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int evpipe_threaded;
+
+/* handlers are indexed by their type, which is handed out
+ * sequentially at registration, so dispatching is a single load. */
+static evhandler_t **evh_table;
 static uint64_t next_type = 0;
 
 static evhandler_t *evhandler_find(uint64_t type)
 {
-	evhandler_t *evh;
+	if (type >= next_type)
+		return NULL;
 
-	TAILQ_FOREACH(evh, &evh_list, node) {
-		if (evh->type == type)
-			return evh;
-	}
-
-	return NULL;
+	return evh_table[type];
 }
 
 void evhandler_register(evhandler_t *evh)
 {
+	evh_table = realloc(evh_table, (next_type + 1) * sizeof(*evh_table));
+	assert(evh_table);
+
 	evh->type = next_type++;
-	TAILQ_INSERT_TAIL(&evh_list, evh, node);
+	evh_table[evh->type] = evh;
 }
 
 
-static int event_handle(event_t *ev, size_t size)
+static uint64_t evpipe_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int __event_handle(event_t *ev, size_t size)
 {
 	evhandler_t *evh;
+	int err;
 
 	evh = evhandler_find(ev->type);
 	if (!evh) {
@@ -75,7 +102,43 @@ static int event_handle(event_t *ev, size_t size)
 		return -ENOSYS;
 	}
 
-	return evh->handle(ev, evh->priv);
+	if (!evpipe_threaded)
+		return evh->handle(ev, evh->priv);
+
+	/* handlers write to stdout, keep their output in one piece */
+	pthread_mutex_lock(&evpipe_mutex);
+	err = evh->handle(ev, evh->priv);
+	pthread_mutex_unlock(&evpipe_mutex);
+	return err;
+}
+
+/* keep the handlers in reader threads out while the main thread
+ * dumps something of its own, e.g. at an interval checkpoint. */
+void evpipe_lock(void)
+{
+	if (evpipe_threaded)
+		pthread_mutex_lock(&evpipe_mutex);
+}
+
+void evpipe_unlock(void)
+{
+	if (evpipe_threaded)
+		pthread_mutex_unlock(&evpipe_mutex);
+}
+
+static int event_handle(event_t *ev, size_t size, struct evpipe_stats *st)
+{
+	uint64_t start;
+	int err;
+
+	st->events++;
+	if (!G.stats)
+		return __event_handle(ev, size);
+
+	start = evpipe_ns();
+	err = __event_handle(ev, size);
+	st->handle_ns += evpipe_ns() - start;
+	return err;
 }
 
 static inline uint64_t __get_head(struct perf_event_mmap_page *mem)
@@ -93,10 +156,10 @@ static inline void __set_tail(struct perf_event_mmap_page *mem, uint64_t tail)
 	mem->data_tail = tail;
 }
 
-int evqueue_drain(struct evqueue *q, int strict)
+int evqueue_drain(struct evqueue *q, int strict, struct evpipe_stats *st)
 {
 	struct lost_event *lost;
-	uint64_t size, offs, head, tail;
+	uint64_t size, offs, head, tail, events = st->events;
 	uint8_t *base, *this, *next;
 	event_t *ev;
 	int err = 0;
@@ -105,10 +168,10 @@ int evqueue_drain(struct evqueue *q, int strict)
 	offs = q->mem->data_offset;
 	base = (uint8_t *)q->mem + offs;
 
-	for (head = __get_head(q->mem); q->mem->data_tail != head;
-	     __set_tail(q->mem, q->mem->data_tail + ev->hdr.size)) {
-		tail = q->mem->data_tail;
-
+	/* consume everything up to the current head, but only hand
+	 * the space back to the kernel once the whole batch is done. */
+	head = __get_head(q->mem);
+	for (tail = q->mem->data_tail; tail != head; tail += ev->hdr.size) {
 		this = base + (tail % size);
 		ev   = (void *)this;
 		next = base + ((tail + ev->hdr.size) % size);
@@ -116,7 +179,6 @@ int evqueue_drain(struct evqueue *q, int strict)
 		if (next < this) {
 			size_t left = (base + size) - this;
 
-			q->buf = realloc(q->buf, ev->hdr.size);
 			memcpy(q->buf, this, left);
 			memcpy(q->buf + left, base, ev->hdr.size - left);
 			ev = q->buf;
@@ -124,11 +186,12 @@ int evqueue_drain(struct evqueue *q, int strict)
 
 		switch (ev->hdr.type) {
 		case PERF_RECORD_SAMPLE:
-			err = event_handle(ev, ev->hdr.size);
+			err = event_handle(ev, ev->hdr.size, st);
 			break;
 
 		case PERF_RECORD_LOST:
 			lost = (void *)ev;
+			st->lost += lost->lost;
 
 			if (strict) {
 				_e("lost %"PRId64" events", lost->lost);
@@ -148,9 +211,186 @@ int evqueue_drain(struct evqueue *q, int strict)
 			break;
 	}
 
+	__set_tail(q->mem, tail);
+
+	events = st->events - events;
+	if (events) {
+		st->drains++;
+		if (events > st->max_batch)
+			st->max_batch = events;
+	}
 	return err;
 }
 
+#ifdef LINUX_HAS_RINGBUF
+/* the ring replaces one perf ring per CPU, size it like all of them
+ * together, within reason. */
+#define EVRING_MIN (64 << 10)
+#define EVRING_MAX (16 << 20)
+
+/* largest record we are prepared to copy */
+#define EVRING_REC_MAX 0x10000
+
+static int evring_lost(struct evring *ring, int strict, struct evpipe_stats *st)
+{
+	uint32_t key = 0;
+	uint64_t drops, lost;
+
+	if (bpf_map_lookup(ring->dropfd, &key, &drops) || drops == ring->drops)
+		return 0;
+
+	lost = drops - ring->drops;
+	ring->drops = drops;
+	st->lost += lost;
+
+	if (strict) {
+		_e("lost %"PRId64" events", lost);
+		return -EOVERFLOW;
+	}
+
+	_w("lost %"PRId64" events", lost);
+	return 0;
+}
+
+int evring_drain(struct evring *ring, int strict, struct evpipe_stats *st)
+{
+	uint64_t events = st->events;
+	unsigned long cons, prod;
+	const uint8_t *rec;
+	uint32_t len;
+	event_t *ev = ring->ev;
+	int err = 0;
+
+	cons = __atomic_load_n(ring->consumer, __ATOMIC_ACQUIRE);
+	prod = __atomic_load_n(ring->producer, __ATOMIC_ACQUIRE);
+
+	/* the data area is mapped twice in a row, so records that
+	 * wrap around the end can be read in one piece. */
+	while (cons < prod) {
+		rec = &ring->data[cons & ring->mask];
+		len = __atomic_load_n((const uint32_t *)rec, __ATOMIC_ACQUIRE);
+
+		/* reserved, but not yet committed */
+		if (len & BPF_RINGBUF_BUSY_BIT)
+			break;
+
+		if (len & BPF_RINGBUF_DISCARD_BIT)
+			goto next;
+
+		if (len > EVRING_REC_MAX) {
+			_e("oversized event: size:%#"PRIx32, len);
+			err = -EINVAL;
+			break;
+		}
+
+		ev->hdr.type = PERF_RECORD_SAMPLE;
+		ev->hdr.size = sizeof(*ev) + len - sizeof(ev->type);
+		ev->size = len;
+		memcpy(&ev->type, rec + BPF_RINGBUF_HDR_SZ, len);
+
+		err = event_handle(ev, len, st);
+		if (err)
+			break;
+	next:
+		len &= ~BPF_RINGBUF_DISCARD_BIT;
+		cons += (len + BPF_RINGBUF_HDR_SZ + 7) & ~7;
+	}
+
+	__atomic_store_n(ring->consumer, cons, __ATOMIC_RELEASE);
+
+	err = err ? : evring_lost(ring, strict, st);
+
+	events = st->events - events;
+	if (events) {
+		st->drains++;
+		if (events > st->max_batch)
+			st->max_batch = events;
+	}
+	return err;
+}
+
+static void evring_free(evpipe_t *evp, size_t size)
+{
+	struct evring *ring = evp->ring;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (ring->consumer && ring->consumer != MAP_FAILED)
+		munmap(ring->consumer, page);
+	if (ring->producer && ring->producer != MAP_FAILED)
+		munmap((void *)ring->producer, page + 2 * size);
+	if (ring->dropfd >= 0)
+		close(ring->dropfd);
+	if (evp->mapfd >= 0)
+		close(evp->mapfd);
+
+	free(ring->ev);
+	free(ring);
+	evp->ring = NULL;
+	evp->mapfd = -1;
+}
+
+static int evring_init(evpipe_t *evp, size_t qsize)
+{
+	struct evring *ring;
+	long page = sysconf(_SC_PAGESIZE);
+	size_t size;
+
+	for (size = EVRING_MIN; size < qsize * evp->ncpus && size < EVRING_MAX;)
+		size <<= 1;
+
+	ring = calloc(1, sizeof(*ring));
+	assert(ring);
+	evp->ring = ring;
+	ring->dropfd = -1;
+
+	/* fails on kernels without ring buffers, which is not an
+	 * error, the perf rings are used instead. */
+	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, 0, 0, size);
+	if (evp->mapfd < 0) {
+		_d("no ring buffer support, using perf rings");
+		goto err;
+	}
+
+	ring->dropfd = bpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t),
+				      sizeof(uint64_t), 1);
+	if (ring->dropfd < 0) {
+		_eno("could not create drop counter");
+		goto err;
+	}
+
+	ring->consumer = mmap(NULL, page, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, evp->mapfd, 0);
+	ring->producer = mmap(NULL, page + 2 * size, PROT_READ,
+			      MAP_SHARED, evp->mapfd, page);
+	if (ring->consumer == MAP_FAILED || ring->producer == MAP_FAILED) {
+		_eno("could not mmap ring");
+		goto err;
+	}
+
+	ring->data = (const uint8_t *)ring->producer + page;
+	ring->mask = size - 1;
+
+	ring->ev = malloc(sizeof(*ring->ev) + EVRING_REC_MAX);
+	assert(ring->ev);
+
+	evp->poll = calloc(1, sizeof(*evp->poll));
+	assert(evp->poll);
+	evp->poll->fd     = evp->mapfd;
+	evp->poll->events = POLLIN;
+
+	_d("using a shared %zukB ring", size >> 10);
+	return 0;
+err:
+	evring_free(evp, size);
+	return -EINVAL;
+}
+#else
+static int evring_init(evpipe_t *evp, size_t qsize)
+{
+	return -ENOSYS;
+}
+#endif
+
 int evqueue_init(evpipe_t *evp, uint32_t cpu, size_t size)
 {
 	struct perf_event_attr attr = { 0 };
@@ -160,7 +400,15 @@ int evqueue_init(evpipe_t *evp, uint32_t cpu, size_t size)
 	attr.type          = PERF_TYPE_SOFTWARE;
 	attr.config        = PERF_COUNT_SW_BPF_OUTPUT;
 	attr.sample_type   = PERF_SAMPLE_RAW;
-	attr.wakeup_events = 1;
+
+	if (G.wakeup) {
+		/* wake up when the ring is half full, the readers poll
+		 * with a timeout to pick up any stragglers. */
+		attr.watermark        = 1;
+		attr.wakeup_watermark = size / 2;
+	} else {
+		attr.wakeup_events = 1;
+	}
 
 	q->fd = perf_event_open(&attr, -1, cpu, -1, 0);
 	if (q->fd < 0) {
@@ -174,6 +422,12 @@ int evqueue_init(evpipe_t *evp, uint32_t cpu, size_t size)
 		return err;
 	}
 
+	/* records that wrap around the end of the ring are copied
+	 * here. the size field is 16 bits, so that is the upper
+	 * bound, unless the ring itself is smaller than that. */
+	q->buf = malloc((size < 0x10000) ? size : 0x10000);
+	assert(q->buf);
+
 	size += sysconf(_SC_PAGESIZE);
 	q->mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, 0);
 	if (q->mem == MAP_FAILED) {
@@ -181,38 +435,192 @@ int evqueue_init(evpipe_t *evp, uint32_t cpu, size_t size)
 		return -1;
 	}
 
-	evp->poll[cpu].fd     = q->fd;
-	evp->poll[cpu].events = POLLIN;
 	return 0;
 }
 
-int evpipe_loop(evpipe_t *evp, int *sig, int strict)
+static int evreader_poll(struct evreader *r, int wait, int strict)
+{
+	struct evqueue *q = r->evp->q;
+	int i, err, ready;
+
+	ready = poll(r->poll, r->ncpus, wait);
+	if (ready < 0)
+		return (errno == EINTR) ? 0 : -errno;
+
+	/* in watermark mode, a timeout means that it is time to drain
+	 * whatever is there, even if it is below the watermark. */
+	if (!ready && !G.wakeup)
+		return 0;
+
+#ifdef LINUX_HAS_RINGBUF
+	if (r->evp->ring)
+		return evring_drain(r->evp->ring, strict, &r->stats);
+#endif
+
+	for (i = 0; i < r->ncpus; i++) {
+		if (!G.wakeup && !(r->poll[i].revents & POLLIN))
+			continue;
+
+		err = evqueue_drain(&q[r->cpu + i], strict, &r->stats);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int evpipe_remaining(struct timespec *deadline)
 {
-	int cpu, err, ready;
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms  = (deadline->tv_sec  - now.tv_sec) * 1000;
+	ms += (deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return (ms > 0) ? ms : 0;
+}
+
+static void *evreader_thread(void *_r)
+{
+	struct evreader *r = _r;
+	evpipe_t *evp = r->evp;
+	int err = 0;
+
+	while (!evp->stop && !err)
+		err = evreader_poll(r, G.wakeup ? : EVREADER_TICK_MS,
+				    evp->strict);
+
+	if (err) {
+		evp->err = err;
+		evp->stop = 1;
+	}
+	return NULL;
+}
+
+static int evpipe_start(evpipe_t *evp)
+{
+	sigset_t all, old;
+	cpu_set_t cpus;
+	uint32_t i, cpu;
+	int err = 0;
+
+	/* leave signal handling to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < evp->nreaders; i++) {
+		struct evreader *r = &evp->readers[i];
+
+		err = -pthread_create(&r->tid, NULL, evreader_thread, r);
+		if (err) {
+			_e("could not start reader: %s", strerror(-err));
+			break;
+		}
+
+		CPU_ZERO(&cpus);
+		for (cpu = r->cpu; cpu < r->cpu + r->ncpus; cpu++)
+			CPU_SET(cpu, &cpus);
+
+		if (pthread_setaffinity_np(r->tid, sizeof(cpus), &cpus))
+			_d("reader %u: could not set affinity", i);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	evp->running = i;
+	return err;
+}
+
+static int evpipe_stop(evpipe_t *evp)
+{
+	uint32_t i;
+
+	evp->stop = 1;
+	for (i = 0; i < evp->running; i++)
+		pthread_join(evp->readers[i].tid, NULL);
+
+	evp->running = 0;
+	return evp->err;
+}
+
+/* the counters of running readers might be slightly behind, which is
+ * fine for statistics. */
+void evpipe_stats(evpipe_t *evp, struct evpipe_stats *st)
+{
+	struct evpipe_stats *rst;
+	uint32_t i;
+
+	memset(st, 0, sizeof(*st));
+
+	for (i = 0; i < evp->nreaders; i++) {
+		rst = &evp->readers[i].stats;
+
+		st->events    += rst->events;
+		st->lost      += rst->lost;
+		st->drains    += rst->drains;
+		st->handle_ns += rst->handle_ns;
+		if (rst->max_batch > st->max_batch)
+			st->max_batch = rst->max_batch;
+	}
+}
+
+int evpipe_loop(evpipe_t *evp, int *sig, int strict, int timeout)
+{
+	struct timespec deadline;
+	int err, wait = -1;
+
+	if (timeout >= 0) {
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec  += timeout / 1000;
+		deadline.tv_nsec += (timeout % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+	}
+
+	evp->strict = strict;
+	if (evpipe_threaded && !evp->running) {
+		err = evpipe_start(evp);
+		if (err)
+			return evpipe_stop(evp) ? : err;
+	}
 
 	for (;!(*sig);) {
-		ready = poll(evp->poll, evp->ncpus, -1);
-		if (ready <= 0)
-			return ready ? : 0;
+		if (timeout >= 0) {
+			wait = evpipe_remaining(&deadline);
+			if (!wait)
+				return 0;
+		}
 
-		for (cpu = 0; ready && (cpu < evp->ncpus); cpu++) {
-			if (!(evp->poll[cpu].revents & POLLIN))
-				continue;
+		if (!evpipe_threaded) {
+			if (G.wakeup && (wait < 0 || wait > G.wakeup))
+				wait = G.wakeup;
 
-			err = evqueue_drain(&evp->q[cpu], strict);
+			err = evreader_poll(evp->readers, wait, strict);
 			if (err)
 				return err;
 
-			ready--;
+			continue;
 		}
+
+		/* the readers do all the work, just wait for a signal,
+		 * the deadline or one of them failing. */
+		if (evp->stop)
+			break;
+
+		if (wait < 0 || wait > EVREADER_TICK_MS)
+			wait = EVREADER_TICK_MS;
+
+		poll(NULL, 0, wait);
 	}
 
-	return 0;
+	return evpipe_threaded ? evpipe_stop(evp) : 0;
 }
 
 int evpipe_init(evpipe_t *evp, size_t qsize)
 {
-	uint32_t cpu;
+	uint32_t cpu, i;
 	int err;
 
 	if (G.dump) {
@@ -222,6 +630,17 @@ int evpipe_init(evpipe_t *evp, size_t qsize)
 
 	evp->ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
+	if (!evring_init(evp, qsize)) {
+		evp->nreaders = 1;
+		evp->readers = calloc(1, sizeof(*evp->readers));
+		assert(evp->readers);
+
+		evp->readers->evp   = evp;
+		evp->readers->ncpus = 1;
+		evp->readers->poll  = evp->poll;
+		return 0;
+	}
+
 	evp->mapfd = bpf_map_create(BPF_MAP_TYPE_PERF_EVENT_ARRAY,
 				    sizeof(uint32_t), sizeof(int), evp->ncpus);
 	if (evp->mapfd < 0) {
@@ -238,8 +657,31 @@ int evpipe_init(evpipe_t *evp, size_t qsize)
 	for (cpu = 0; cpu < evp->ncpus; cpu++) {
 		err = evqueue_init(evp, cpu, qsize);
 		if (err)
-			break;
+			return err;
+
+		evp->poll[cpu].fd     = evp->q[cpu].fd;
+		evp->poll[cpu].events = POLLIN;
 	}
 
-	return err;
+	/* split the CPUs into contiguous ranges, so that each reader
+	 * serves CPUs that are close to each other. */
+	evp->nreaders = G.readers ? : 1;
+	if (evp->nreaders > evp->ncpus)
+		evp->nreaders = evp->ncpus;
+
+	evp->readers = calloc(evp->nreaders, sizeof(*evp->readers));
+	assert(evp->readers);
+
+	for (i = 0, cpu = 0; i < evp->nreaders; i++) {
+		struct evreader *r = &evp->readers[i];
+
+		r->evp   = evp;
+		r->cpu   = cpu;
+		r->ncpus = ((i + 1) * evp->ncpus) / evp->nreaders - cpu;
+		r->poll  = &evp->poll[cpu];
+		cpu += r->ncpus;
+	}
+
+	evpipe_threaded = evp->nreaders > 1;
+	return 0;
 }
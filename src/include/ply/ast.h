@@ -135,6 +135,7 @@ typedef struct probe {
 } probe_t;
 
 typedef struct script {
+	node_t *decls;
 	node_t *probes;
 } script_t;
 
@@ -182,6 +183,7 @@ const char *loc_str(loc_t loc);
 
 typedef struct symtable symtable_t;
 typedef struct evpipe evpipe_t;
+typedef struct stack_pool stack_pool_t;
 
 struct dyn {
 	type_t type;
@@ -201,21 +203,39 @@ struct dyn {
 			const func_t *func;
 		} call;
 
+		/* offsets into the program being compiled */
 		struct {
-			struct bpf_insn *jmp;
+			ptrdiff_t jmp;
 		} iff;
 
 		struct {
-			struct bpf_insn *start;
+			ptrdiff_t start;
 		} unroll;
 
 		struct {
 			pvdr_t *pvdr;
 			void   *pvdr_priv;
+			int     bfd;
+			int     sites;
 
-			ssize_t sp;
+			ssize_t       sp;
+			stack_pool_t *stack;
 			int     dyn_regs;
 			int     stat_regs;
+
+			/* only one in `sample` hits is traced, 0 or 1
+			 * to trace all of them. */
+			int64_t sample;
+
+			/* earlier probe on the same attach point, whose
+			 * program this probe is compiled into. */
+			node_t *leader;
+
+			/* next block in the same program */
+			node_t *follower;
+
+			/* number of user maps referenced */
+			int     n_maps;
 		} probe;
 
 		struct {
@@ -237,6 +257,10 @@ struct node {
 	dumper_t dump;
 	cmper_t  cmp;
 
+	/* set by cse_probe, see cse.c */
+	node_t  *cse;
+	ssize_t  cse_addr;
+
 	union {
 		script_t script;
 		probe_t  probe;
@@ -279,8 +303,14 @@ node_t *node_get_probe (node_t *n);
 node_t *node_get_script(node_t *n);
 
 /* int     node_stmt_reg_get   (node_t *stmt); */
-int     node_probe_reg_get  (node_t *probe, int dynamic);
-ssize_t node_probe_stack_get(node_t *probe, size_t size);
+int     node_probe_reg_get    (node_t *probe, int dynamic);
+ssize_t node_probe_stack_get  (node_t *probe, node_t *n, size_t size);
+void    node_probe_stack_enter(node_t *probe);
+void    node_probe_stack_leave(node_t *probe);
+
+void   *node_alloc  (size_t size);
+char   *node_strdup (const char *s);
+char   *node_strndup(const char *s, size_t len);
 
 node_t *node_new         (type_t type);
 node_t *node_str_new     (char *val);
@@ -296,7 +326,7 @@ node_t *node_if_new      (node_t *cond, node_t *then, node_t *els);
 node_t *node_unroll_new  (int64_t count, node_t *stmts);
 node_t *node_call_new    (char *module, char *func, node_t *vargs);
 node_t *node_probe_new   (char *pspec, node_t *pred, node_t *stmts);
-node_t *node_script_new  (node_t *probes);
+node_t *node_script_new  (node_t *decls, node_t *probes);
 node_t *node_script_parse(FILE *fp);
 
 void node_free(node_t *n);
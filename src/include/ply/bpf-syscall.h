@@ -20,6 +20,7 @@
 #ifndef _PLY_BPF_SYSCALL_H
 #define _PLY_BPF_SYSCALL_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 #include <linux/bpf.h>
@@ -39,15 +40,61 @@ int bpf_map_lookup(int fd, void *key, void *val);
 int bpf_map_update(int fd, void *key, void *val, int flags);
 int bpf_map_delete(int fd, void *key);
 int bpf_map_next  (int fd, void *key, void *next_key);
+int bpf_map_batch (int fd, void *in_batch, void *out_batch,
+		   void *keys, void *vals, uint32_t *count, int delete);
+
+int bpf_obj_pin(int fd, const char *path);
+int bpf_obj_get(const char *path);
+
+int bpf_prog_stats  (int fd, uint64_t *run_cnt, uint64_t *run_time_ns);
+int bpf_enable_stats(void);
 
 long perf_event_open(struct perf_event_attr *hw_event, pid_t pid,
 		     int cpu, int group_fd, unsigned long flags);
 
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 4, 0))
+#define LINUX_HAS_OBJ_PIN
+#endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0))
 #define LINUX_HAS_STACKMAP
+#define LINUX_HAS_PERCPU_MAPS
 #endif
 #if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0))
 #define LINUX_HAS_TRACEPOINT
 #endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 9, 0))
+#define LINUX_HAS_PERF_EVENT_PROG
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0))
+#define LINUX_HAS_LRU_MAPS
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0))
+#define LINUX_HAS_PROBE_READ_STR
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0))
+#define LINUX_HAS_MAP_NEXT_NULL
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 17, 0))
+#define LINUX_HAS_PERF_KPROBE
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0))
+#define LINUX_HAS_CGROUP_ID
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 1, 0))
+#define LINUX_HAS_PROG_STATS
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0))
+#define LINUX_HAS_MAP_VALUE
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 3, 0))
+#define LINUX_HAS_BOUNDED_LOOPS
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0))
+#define LINUX_HAS_MAP_BATCH
+#endif
+#if (LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0))
+#define LINUX_HAS_ENABLE_STATS
+#define LINUX_HAS_RINGBUF
+#endif
 
 #endif	/* _PLY_BPF_SYSCALL_H */
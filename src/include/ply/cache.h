@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PLY_CACHE_H
+#define _PLY_CACHE_H
+
+#include <ply/ast.h>
+#include <ply/compile.h>
+
+/* Compiled programs are stored in <dir>/<key>.prog, where the key is
+ * a hash of the script and everything else that affects the
+ * generated code: ply's version, the kernel it was built for and the
+ * one it is running on, and the relevant options.
+ *
+ *   struct cache_hdr
+ *   n_probes x { u32 n_insns, n_insns x struct bpf_insn }
+ *
+ * Map references are stored as relocations, i.e. the immediate of
+ * each map load is an index into the event pipe's and the script's
+ * maps (see cache_fds()) rather than a file descriptor. */
+#define CACHE_MAGIC   "PLYPROG"
+#define CACHE_VERSION 1
+
+/* the kernel's limit for privileged programs */
+#define CACHE_MAX_INSNS (1 << 20)
+
+struct cache_hdr {
+	char     magic[8];
+	uint32_t version;
+	uint32_t n_probes;
+	uint64_t key;
+} __attribute__((packed));
+
+int     cache_open (node_t *script, const char *src, size_t len);
+prog_t *cache_get  (node_t *probe);
+void    cache_put  (node_t *probe, prog_t *prog);
+int     cache_close(node_t *script);
+
+#endif	/* _PLY_CACHE_H */
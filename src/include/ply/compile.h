@@ -52,17 +52,25 @@
 #define STXW(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_W) | BPF_MEM, _dst, _src, _off, 0)
 #define STXDW(_dst, _off, _src)   INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_MEM, _dst, _src, _off, 0)
 
+#define XADDDW(_dst, _off, _src) INSN(BPF_STX | BPF_SIZE(BPF_DW) | BPF_XADD, _dst, _src, _off, 0)
+
 #define LDXB(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_B)  | BPF_MEM, _dst, _src, _off, 0)
 #define LDXH(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_H)  | BPF_MEM, _dst, _src, _off, 0)
 #define LDXW(_dst, _off, _src)  INSN(BPF_LDX | BPF_SIZE(BPF_W)  | BPF_MEM, _dst, _src, _off, 0)
 #define LDXDW(_dst, _off, _src) INSN(BPF_LDX | BPF_SIZE(BPF_DW) | BPF_MEM, _dst, _src, _off, 0)
 
+/* grows as code is emitted, so positions that are patched later on
+ * are kept as offsets from insns rather than as pointers. */
 typedef struct prog {
 	struct bpf_insn *ip;
-	struct bpf_insn  insns[BPF_MAXINSNS];
+	struct bpf_insn *insns;
+	size_t           size;
 
 	ssize_t sp;
 	node_t *regs[__MAX_BPF_REG];
+
+	/* another probe's block follows the one being compiled */
+	int chained;
 } prog_t;
 
 extern const dyn_t dyn_reg[];
@@ -80,10 +88,35 @@ static inline void emit_ld_mapfd(prog_t *prog, int reg, int fd)
 	emit(prog, INSN(0, 0, 0, 0, 0));
 }
 
-int emit_log2_raw      (prog_t *prog, int dst, int src);
-int emit_map_update_raw(prog_t *prog, int fd, ssize_t key, ssize_t val);
-int emit_map_lookup_raw(prog_t *prog, int fd, ssize_t addr);
+static inline void emit_ld_imm64(prog_t *prog, int reg, uint64_t imm)
+{
+	emit(prog, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, 0, 0, (uint32_t)imm));
+	emit(prog, INSN(0, 0, 0, 0, imm >> 32));
+}
 
+/* load a pointer to offset `off` of the first value in array map `fd` */
+static inline void emit_ld_mapval(prog_t *prog, int reg, int fd, int off)
+{
+	emit(prog, INSN(BPF_LD | BPF_DW | BPF_IMM, reg, BPF_PSEUDO_MAP_VALUE, 0, fd));
+	emit(prog, INSN(0, 0, 0, 0, off));
+}
+
+void emit_ld_map(prog_t *prog, int reg, node_t *map);
+
+int emit_log2_raw      (prog_t *prog, int dst, int src);
+int emit_lin_raw       (prog_t *prog, int dst, int src,
+			int32_t min, int32_t max, int32_t step);
+int emit_loglin_raw    (prog_t *prog, int dst, int src, int bits);
+int emit_sample_raw    (prog_t *prog, int64_t rate);
+int emit_map_update_raw(prog_t *prog, node_t *map, ssize_t key, ssize_t val);
+int emit_map_insert_raw(prog_t *prog, node_t *map, ssize_t key, ssize_t val);
+int emit_map_add       (prog_t *prog, node_t *map, int32_t n);
+int emit_map_delete_raw(prog_t *prog, node_t *map, ssize_t key);
+int emit_map_lookup_raw(prog_t *prog, node_t *map, ssize_t addr);
+
+prog_t *prog_new     (void);
+void    prog_free    (prog_t *prog);
+int     prog_optimize(prog_t *prog);
 prog_t *compile_probe(node_t *probe);
 
 #endif	/* _PLY_COMPILE_H */
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef __ELFSYMS_H
+#define __ELFSYMS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+typedef struct elfsym {
+	uint64_t offset;	/* file offset, as expected by uprobes */
+	uint64_t size;
+	uint32_t name;		/* offset into the string table */
+	uint32_t reserved;
+} elfsym_t;
+
+/* Like the kallsyms cache, the index of a binary is stored ready to
+ * use: the functions from .symtab and .dynsym, sorted by name, are
+ * followed by a table of NUL-separated names. It is named after the
+ * build-id of the binary when it has one, so every copy of a library
+ * shares one index and a rebuilt binary gets a new one. */
+#define ELFSYMS_CACHE_VERSION 1
+
+struct elfsym_cache_hdr {
+	uint32_t version;
+	uint32_t n_syms;
+	uint32_t strtab_size;
+	uint32_t reserved;
+	char     key[64];
+};
+
+struct elfsym_cache {
+	struct elfsym_cache_hdr hdr;
+	elfsym_t sym[0];
+};
+
+typedef struct elfsyms {
+	int cache_fd;
+	size_t cache_size;
+	struct elfsym_cache *cache;
+	const char *strtab;
+} elfsyms_t;
+
+static inline const char *elfsym_name(elfsyms_t *es, const elfsym_t *s)
+{
+	return es->strtab + s->name;
+}
+
+const elfsym_t *elfsym_match(elfsyms_t *es, const char *pattern,
+			     const elfsym_t *prev);
+
+elfsyms_t *elfsyms_open (const char *path);
+void       elfsyms_close(elfsyms_t *es);
+
+#endif	/* __ELFSYMS_H */
@@ -24,7 +24,6 @@
 
 #include <linux/perf_event.h>
 
-#include <sys/queue.h>
 
 typedef struct event {
 	struct perf_event_header hdr;
@@ -35,27 +34,79 @@ typedef struct event {
 } __attribute__((packed)) event_t;
 
 typedef struct evhandler {
-	TAILQ_ENTRY(evhandler) node;
-
 	uint64_t type;
 	void *priv;
 
 	int (*handle)(event_t *ev, void *priv);
 } evhandler_t;
 
-struct evqueue;
+/* reader side statistics, for --stats */
+struct evpipe_stats {
+	uint64_t events, lost;
+
+	/* number of times at least one event was drained from a
+	 * queue, and the most events drained in one go. */
+	uint64_t drains, max_batch;
+
+	/* time spent in event handlers, i.e. formatting output */
+	uint64_t handle_ns;
+};
+
+/* a per-CPU perf ring, see evqueue_init() */
+struct evqueue {
+	int fd;
+	struct perf_event_mmap_page *mem;
+
+	void *buf;
+};
+
+/* a single BPF ring shared by all CPUs, see evring_init(). used
+ * instead of the per-CPU perf rings when the kernel supports it. */
+struct evring {
+	int fd;
+	unsigned long *consumer;
+	const unsigned long *producer;
+	const uint8_t *data;
+	size_t mask;
+
+	/* records are copied here to give them an event_t header */
+	event_t *ev;
+
+	/* the ring has no equivalent of PERF_RECORD_LOST, programs
+	 * count the events that did not fit in this array instead. */
+	int dropfd;
+	uint64_t drops;
+};
+
+struct evreader;
 
 typedef struct evpipe {
 	int mapfd;
+	struct evring *ring;
 
 	uint32_t ncpus;
 	struct pollfd *poll;
 	struct evqueue *q;
+
+	uint32_t nreaders, running;
+	struct evreader *readers;
+
+	int strict;
+	volatile int stop;
+	int err;
 } evpipe_t;
 
 void evhandler_register(evhandler_t *evh);
 
-int evpipe_loop(evpipe_t *evp, int *sig, int strict);
+void evpipe_stats(evpipe_t *evp, struct evpipe_stats *st);
+
+void evpipe_lock(void);
+void evpipe_unlock(void);
+
+int evqueue_drain(struct evqueue *q, int strict, struct evpipe_stats *st);
+int evring_drain (struct evring *ring, int strict, struct evpipe_stats *st);
+
+int evpipe_loop(evpipe_t *evp, int *sig, int strict, int timeout);
 int evpipe_init(evpipe_t *evp, size_t qsize);
 
 #endif	/* _PLY_EVPIPE_H */
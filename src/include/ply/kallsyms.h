@@ -25,12 +25,23 @@
 typedef struct ksym {
 	uintptr_t start;
 	uintptr_t end;
-	char sym[0x40 - (sizeof(uintptr_t) * 2)];
+	uint32_t  name;		/* offset into the string table */
 } ksym_t;
 
+/* The cache is stored ready to use: symbols come with their end
+ * addresses, laid out in Eytzinger (breadth-first) order for fast
+ * lookups, and are followed by a table of NUL-separated names. It is
+ * only valid for the boot and set of loaded modules it was built
+ * from. */
+#define KSYMS_CACHE_VERSION 2
+
 struct ksym_cache_hdr {
 	uint32_t version;
 	uint32_t n_syms;
+	uint32_t strtab_size;
+	uint32_t reserved;
+	uint64_t modules_hash;
+	char     boot_id[40];
 };
 
 struct ksym_cache {
@@ -38,12 +49,37 @@ struct ksym_cache {
 	ksym_t sym[0];
 };
 
+/* Lookups are memoized in an open-addressed table, dumping a map
+ * keyed by stack() resolves the same return addresses over and
+ * over. */
+struct ksym_memo {
+	uintptr_t addr;
+	const ksym_t *ksym;
+};
+
 typedef struct ksyms {
 	int cache_fd;
+	size_t cache_size;
 	struct ksym_cache *cache;
+	const char *strtab;
+
+	struct ksym_memo *memo;
+	size_t memo_size, memo_used;
 } ksyms_t;
 
+static inline const char *ksym_name(ksyms_t *ks, const ksym_t *k)
+{
+	/* the cache is used as it was found on disk */
+	if (k->name >= ks->cache->hdr.strtab_size)
+		return "<unknown>";
+
+	return ks->strtab + k->name;
+}
+
 const ksym_t *ksym_get(ksyms_t *ks, uintptr_t addr);
 ksyms_t *ksyms_new(void);
 
+/* identifies the running boot, and thereby the kernel's layout */
+int ksyms_boot_id(char *boot_id, size_t size);
+
 #endif	/* __KALLSYMS_H */
@@ -21,14 +21,24 @@
 #define _PLY_MAP_H
 
 #include <ply/ast.h>
+#include <ply/symtable.h>
 
 void dump_sym (FILE *fp, node_t *integer, void *data);
 void dump_rec (FILE *fp, node_t *rec, void *data, int len);
 void dump_node(FILE *fp, node_t *n, void *data);
 
+void dump_map     (FILE *fp, node_t *map);
+void dump_map_data(FILE *fp, node_t *map, char *data, int n);
+
 int  cmp_node(node_t *n, const void *a, const void *b);
 
-int map_setup   (node_t *script);
-int map_teardown(node_t *script);
+int map_read(struct sym_map_data *md, void *data, int max, int reset);
+
+int map_setup     (node_t *script);
+int map_checkpoint(node_t *script);
+int map_teardown  (node_t *script);
+
+int map_pin        (node_t *script, const char *dir);
+int map_open_pinned(node_t *script, const char *dir);
 
 #endif	/* _PLY_MAP_H */
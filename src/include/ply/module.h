@@ -33,6 +33,9 @@ struct func {
 	int (*loc_assign)(node_t *call);
 	int (*compile)   (node_t *call,  prog_t *prog);
 
+	/* same result every time it is called from a probe */
+	int pure;
+
 	void *priv;
 };
 
@@ -58,6 +61,24 @@ struct func {
 		.compile    = _mod ## _ ## _name ## _compile,		\
 	}
 
+#define MODULE_FUNC_PURE(_mod, _name)				\
+	static func_t _mod ## _ ## _name ## _func = {		\
+		.name = #_name,					\
+		.annotate   = _mod ## _ ## _name ## _annotate,	\
+		.loc_assign = default_loc_assign,		\
+		.compile    = _mod ## _ ## _name ## _compile,	\
+		.pure       = 1,				\
+	}
+
+#define MODULE_FUNC_LOC_PURE(_mod, _name)				\
+	static func_t _mod ## _ ## _name ## _func = {			\
+		.name = #_name,						\
+		.annotate   = _mod ## _ ## _name ## _annotate,		\
+		.loc_assign = _mod ## _ ## _name ## _loc_assign,	\
+		.compile    = _mod ## _ ## _name ## _compile,		\
+		.pure       = 1,					\
+	}
+
 typedef struct module module_t;
 
 struct module {
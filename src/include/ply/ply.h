@@ -50,20 +50,46 @@
 
 struct globals {
 	int ascii:1;
+	int clear:1;
+	int daemon:1;
 	int debug:1;
 	int dump:1;
+	int interval;
 	int timeout;
+	int top;
 	pid_t self;
 
+	pid_t pid;
+	const char *cgroup;
+	uint64_t cgroup_id;
+	int cgroup_fd;
+
 	size_t map_nelem;
+	int stack_depth;
+	int folded:1;
+	int scale:1;
+	int stats:1;
+
+	size_t bufsize;
+	int readers;
+	int wakeup;
+
+	const char *record;
+	const char *report;
+
+	const char *pin;
+	const char *session;
+	const char *cache;
 
 	ksyms_t *ksyms;
 };
 extern struct globals G;
 
 char *str_escape(char *str);
+int fd_trusted(int fd);
 
 int annotate_script(node_t *script);
+int cse_probe(node_t *probe);
 
 
 static inline FILE *fopenf(const char *mode, const char *fmt, ...)
@@ -31,10 +31,16 @@ typedef struct pvdr {
 
 	const char *name;
 
+	/* events that the kernel itself can limit to G.pid/G.cgroup */
+#define PVDR_SCOPE_PID    (1 << 0)
+#define PVDR_SCOPE_CGROUP (1 << 1)
+	int scope;
+
 	int    (*dflt)(node_t *probe, node_t **stmts);
 	int (*resolve)(node_t *call, const func_t **f);
 
   	int    (*setup)(node_t *probe, prog_t *prog);
+	int  (*disable)(node_t *probe);
 	int (*teardown)(node_t *probe);
 } pvdr_t;
 
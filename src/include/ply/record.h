@@ -0,0 +1,73 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PLY_RECORD_H
+#define _PLY_RECORD_H
+
+#include <ply/ast.h>
+#include <ply/evpipe.h>
+
+/* A recording starts with a header describing every printf() in the
+ * script, i.e. its format string and the layout of its arguments,
+ * followed by the raw events exactly as they were read from the
+ * kernel.
+ *
+ *   struct record_hdr
+ *   n_events x { u64 type, u32 fmt_len, fmt, layout }
+ *   ...        { u32 size, size bytes of event (starting at type) }
+ *
+ * A layout is a pre-order dump of the argument nodes, each one being
+ * a struct record_node, followed by its children in case of a
+ * record. */
+#define RECORD_MAGIC   "PLYREC"
+#define RECORD_VERSION 2
+#define RECORD_BOM     0x01020304
+
+/* Kernel addresses are only meaningful on the boot they were recorded
+ * on, which is identified by boot_id. The release is only there to
+ * tell the user where a recording came from. */
+struct record_hdr {
+	char     magic[8];
+	uint32_t version;
+	uint32_t bom;
+	uint32_t n_events;
+	uint32_t reserved;
+	char     boot_id[40];
+	char     release[65];
+} __attribute__((packed));
+
+#define RECORD_NODE_SYM (1 << 0)
+
+struct record_node {
+	uint8_t  type;
+	uint8_t  flags;
+	uint16_t n_vargs;
+	uint32_t size;
+} __attribute__((packed));
+
+int  record_register(node_t *call, evhandler_t *evh);
+int  record_open    (const char *path);
+void record_close   (void);
+
+int report(const char *path);
+
+/* provided by the printf module */
+int printf_event(event_t *ev, void *_call);
+
+#endif	/* _PLY_RECORD_H */
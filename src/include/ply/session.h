@@ -0,0 +1,60 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PLY_SESSION_H
+#define _PLY_SESSION_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <ply/ast.h>
+
+/* A pinned session is a directory in bpffs holding the script's
+ * maps, its programs and a "script" array map. bpffs can not hold
+ * regular files, so the script source is stored in that map along
+ * with the options that affect how it is annotated, which lets a
+ * reader rebuild the map layouts without compiling anything.
+ *
+ *   script[0]    struct session_hdr
+ *   script[1..]  source, in SESSION_CHUNK sized pieces
+ */
+#define SESSION_ROOT    "/sys/fs/bpf/ply"
+#define SESSION_MAGIC   "PLYSESS"
+#define SESSION_VERSION 1
+#define SESSION_CHUNK   0x100
+
+struct session_hdr {
+	char     magic[8];
+	uint32_t version;
+	uint32_t size;
+	int32_t  interval;
+	uint32_t map_nelem;
+	int32_t  pid;
+	uint32_t stack_depth;	/* 0 in sessions from before it existed */
+} __attribute__((packed));
+
+int session_slurp(FILE **sfp, char **src, size_t *len);
+
+int session_pin    (node_t *script, const char *dir,
+		    const char *src, size_t len);
+int session_set_pid(const char *dir);
+
+node_t *session_open(const char *name, char *dir, size_t size);
+
+#endif	/* _PLY_SESSION_H */
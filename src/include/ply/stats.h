@@ -0,0 +1,31 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PLY_STATS_H
+#define _PLY_STATS_H
+
+#include <ply/ast.h>
+
+/* --stats, the cost of the running script, as seen by the kernel
+ * (time spent in each probe) and by ply (events read). */
+int  stats_enable (void);
+void stats_disable(void);
+void stats_dump   (node_t *script);
+
+#endif	/* _PLY_STATS_H */
@@ -23,6 +23,7 @@
 #include <stdio.h>
 
 #include <ply/ast.h>
+#include <ply/bpf-syscall.h>
 
 typedef struct sym sym_t;
 
@@ -31,9 +32,48 @@ struct sym_map_data {
 	enum bpf_map_type type;
 	size_t ksize, vsize, nelem;
 
+	/* aggregations (count, quantize) only ever touch the current
+	 * CPU's value, so if the map is not read or written anywhere
+	 * else we can give each CPU its own copy. */
+	int aggregated:1;
+	int shared:1;
+
+	/* in interval mode, aggregations are double-buffered. the
+	 * program picks fd or fd_alt based on the control map, so
+	 * that one half can be drained while the other is live. the
+	 * drained data is accumulated in acc. */
+	int dbuf:1;
+	int fd_alt;
+
+	void  *acc;
+	size_t acc_n;
+
+	/* failed updates are counted in slot drop_slot - 1 of the
+	 * drops map, 0 if they are not counted. */
+	int drop_slot;
+
+	/* sampling rate of the probes updating the map, -1 if they
+	 * are not all the same. */
+	int64_t sample;
+
 	node_t *map;
 };
 
+static inline int map_is_percpu(struct sym_map_data *md)
+{
+	switch (md->type) {
+#ifdef LINUX_HAS_PERCPU_MAPS
+	case BPF_MAP_TYPE_PERCPU_HASH:
+#endif
+#ifdef LINUX_HAS_LRU_MAPS
+	case BPF_MAP_TYPE_LRU_PERCPU_HASH:
+#endif
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 struct sym {
 	sym_t *next, *prev;
 
@@ -68,8 +108,22 @@ int sym_map_sync(node_t *map);
 int sym_fdump(sym_t *s, FILE *fp);
 
 
+/* open-addressed hash of syms, so that references can be resolved
+ * in constant time however many probes and maps a script has. */
+struct sym_index {
+	sym_t **slots;
+	size_t  size, n;
+};
+
 typedef struct symtable {
-	sym_t *syms;
+	sym_t *syms, *last;
+
+	/* every sym by (type, name, probe) */
+	struct sym_index refs;
+
+	/* the first sym of each map name, whose map data is shared by
+	 * all probes using it. */
+	struct sym_index maps;
 } symtable_t;
 
 int symtable_fdump(symtable_t *st, FILE *fp);
@@ -77,6 +131,12 @@ int symtable_fdump(symtable_t *st, FILE *fp);
 sym_t *symtable_get_stack(symtable_t *st);
 int    symtable_ref_stack(symtable_t *st);
 
+sym_t *symtable_get_ctrl(symtable_t *st);
+int    symtable_ref_ctrl(symtable_t *st);
+
+sym_t *symtable_get_drops(symtable_t *st);
+int    symtable_ref_drops(symtable_t *st, int n_maps);
+
 int    symtable_populate(symtable_t *st, node_t *script);
 
 #endif	/* _PLY_SYMTABLE_H */
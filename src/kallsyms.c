@@ -17,13 +17,15 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <limits.h>
-#include <linux/version.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -33,48 +35,172 @@
 
 #define KSYMS_CACHE "/tmp/ply.ksyms"
 
-static int ksym_cmp(const void *_key, const void *_member)
+struct ksym_build {
+	ksym_t *syms;
+	size_t n_syms, max_syms;
+
+	char *strtab;
+	size_t strtab_size, strtab_max;
+};
+
+/* Eytzinger lookup of the symbol with the highest start address that
+ * is not above addr. The first levels of the tree share cache lines,
+ * so this touches far less memory than a bsearch() over a sorted
+ * array. */
+static const ksym_t *ksym_search(ksyms_t *ks, uintptr_t addr)
 {
-	const ksym_t *key = _key, *member = _member;
+	const ksym_t *syms = ks->cache->sym;
+	size_t i = 0, n = ks->cache->hdr.n_syms;
+	const ksym_t *best = NULL;
+
+	while (i < n) {
+		if (syms[i].start <= addr) {
+			best = &syms[i];
+			i = 2 * i + 2;
+		} else {
+			i = 2 * i + 1;
+		}
+	}
 
-	if (key->start < member->start)
-		return -1;
-	else if (key->end > member->end)
-		return 1;
+	if (best && addr <= best->end)
+		return best;
+
+	return NULL;
+}
+
+#define KSYM_MEMO_MIN 0x400
+
+/* symbols are resolved from reader threads as well as from the main
+ * thread, and growing the memo frees the old table. */
+static pthread_mutex_t ksym_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t ksym_memo_hash(uintptr_t addr, size_t size)
+{
+	return ((uint64_t)addr * 0x9e3779b97f4a7c15ULL) >> 32 & (size - 1);
+}
+
+static struct ksym_memo *ksym_memo_slot(struct ksym_memo *memo,
+					size_t size, uintptr_t addr)
+{
+	size_t i;
+
+	for (i = ksym_memo_hash(addr, size);
+	     memo[i].addr && memo[i].addr != addr; i = (i + 1) & (size - 1));
+
+	return &memo[i];
+}
 
+static int ksym_memo_grow(ksyms_t *ks)
+{
+	struct ksym_memo *memo, *m, *slot;
+	size_t size;
+
+	size = ks->memo_size ? ks->memo_size << 1 : KSYM_MEMO_MIN;
+	memo = calloc(size, sizeof(*memo));
+	if (!memo)
+		return -ENOMEM;
+
+	for (m = ks->memo; m < &ks->memo[ks->memo_size]; m++) {
+		if (!m->addr)
+			continue;
+
+		slot = ksym_memo_slot(memo, size, m->addr);
+		*slot = *m;
+	}
+
+	free(ks->memo);
+	ks->memo = memo;
+	ks->memo_size = size;
 	return 0;
 }
 
-/* Compare two members: for this qsort operation it is sufficient to compare
- * start addresses.
- */
-static int ksym_membercmp(const void *_m1, const void *_m2)
+static const ksym_t *__ksym_get(ksyms_t *ks, uintptr_t addr)
 {
-	const ksym_t *m1 = _m1, *m2 = _m2;
+	struct ksym_memo *slot;
+	const ksym_t *k;
+
+	if (ks->memo) {
+		slot = ksym_memo_slot(ks->memo, ks->memo_size, addr);
+		if (slot->addr)
+			return slot->ksym;
+	}
 
-	if (m1->start < m2->start)
+	k = ksym_search(ks, addr);
+
+	/* keep the load below 1/2 to keep the probe sequences short,
+	 * failing to grow just means that we do not memoize. */
+	if ((ks->memo_used + 1) * 2 > ks->memo_size && ksym_memo_grow(ks))
+		return k;
+
+	slot = ksym_memo_slot(ks->memo, ks->memo_size, addr);
+	slot->addr = addr;
+	slot->ksym = k;
+	ks->memo_used++;
+	return k;
+}
+
+const ksym_t *ksym_get(ksyms_t *ks, uintptr_t addr)
+{
+	const ksym_t *k;
+
+	/* zero marks free slots */
+	if (!addr)
+		return ksym_search(ks, addr);
+
+	pthread_mutex_lock(&ksym_memo_lock);
+	k = __ksym_get(ks, addr);
+	pthread_mutex_unlock(&ksym_memo_lock);
+	return k;
+}
+
+static int ksym_cmp(const void *_a, const void *_b)
+{
+	const ksym_t *a = _a, *b = _b;
+
+	if (a->start < b->start)
 		return -1;
-	if (m1->start > m2->start)
+	if (a->start > b->start)
 		return 1;
 	return 0;
 }
 
-const ksym_t *ksym_get(ksyms_t *ks, uintptr_t addr)
+static int ksym_add(struct ksym_build *b, uintptr_t start, const char *name)
 {
-	ksym_t key = { .start = addr, .end = addr };
+	size_t len = strlen(name) + 1;
+
+	if (b->n_syms == b->max_syms) {
+		b->max_syms = b->max_syms ? b->max_syms << 1 : 0x4000;
+		b->syms = realloc(b->syms, b->max_syms * sizeof(*b->syms));
+		if (!b->syms)
+			return -ENOMEM;
+	}
+
+	while (b->strtab_size + len > b->strtab_max) {
+		b->strtab_max = b->strtab_max ? b->strtab_max << 1 : 0x40000;
+		b->strtab = realloc(b->strtab, b->strtab_max);
+		if (!b->strtab)
+			return -ENOMEM;
+	}
 
-	return bsearch(&key, ks->cache->sym,
-		       ks->cache->hdr.n_syms, sizeof(key), ksym_cmp);
+	b->syms[b->n_syms].start = start;
+	b->syms[b->n_syms].name  = b->strtab_size;
+	b->n_syms++;
+
+	memcpy(b->strtab + b->strtab_size, name, len);
+	b->strtab_size += len;
+	return 0;
 }
 
-static int ksym_prepare(FILE *fp, struct ksym *ksym)
+static int ksyms_read(struct ksym_build *b, FILE *fp)
 {
-	char line[0x80];
+	char line[0x100];
+	uintptr_t start;
 	char *p;
+	int err;
 
 	while (fgets(line, sizeof(line), fp)) {
-		ksym->start = strtoul(line, &p, 16);
-		if (ksym->start == ULONG_MAX)
+		start = strtoul(line, &p, 16);
+		if (start == ULONG_MAX)
 			continue;
 
 		p++;
@@ -86,117 +212,270 @@ static int ksym_prepare(FILE *fp, struct ksym *ksym)
 		if (!p)
 			continue;
 
-		strncpy(ksym->sym, p, sizeof(ksym->sym) - 1);
-		return 0;
+		err = ksym_add(b, start, p);
+		if (err)
+			return err;
 	}
 
-	return EOF;
+	return 0;
 }
 
-static int ksyms_cache_build(const char *in, const char *out)
+/* kallsyms is not guaranteed to be in order from low address to high;
+ * modules seem to be particularly problematic. sort it and fill in
+ * the end addresses now, so that it does not have to be done every
+ * time the cache is opened. */
+static void ksyms_sort(struct ksym_build *b)
 {
-	struct ksym_cache_hdr hdr = { .version = LINUX_VERSION_CODE };
-	struct ksym ksym[2];
-	FILE *cfp, *kfp;
-	int err, i;
+	ksym_t *syms = b->syms;
+	size_t i, j;
 
-	kfp = fopen(in, "r");
-	if (!kfp) {
-		err = -errno;
-		goto out;
-	}
+	qsort(syms, b->n_syms, sizeof(*syms), ksym_cmp);
+
+	for (i = 0; i < b->n_syms; i = j) {
+		/* aliases share the same range */
+		for (j = i + 1; j < b->n_syms && syms[j].start == syms[i].start; j++);
 
-	cfp = fopen(out, "w");
-	if (!cfp) {
-		err = -errno;
-		goto close_kfp;
+		for (; i < j; i++) {
+			/* assume no function larger than 4k */
+			syms[i].end = (j < b->n_syms) ?
+				syms[j].start - 1 : syms[i].start + 0x1000;
+		}
 	}
+}
 
-	if (fseek(cfp, sizeof(hdr), SEEK_CUR)) {
-		err = -errno;
-		goto close_cfp;
+static size_t ksyms_eytzinger(ksym_t *out, const ksym_t *in,
+			      size_t i, size_t k, size_t n)
+{
+	if (k < n) {
+		i = ksyms_eytzinger(out, in, i, 2 * k + 1, n);
+		out[k] = in[i++];
+		i = ksyms_eytzinger(out, in, i, 2 * k + 2, n);
 	}
 
-	err = ksym_prepare(kfp, &ksym[0]);
-	if (err)
-		goto close_cfp;
-
-	for (i = 1;; i = !i) {
-		err = ksym_prepare(kfp, &ksym[i]);
-		if (err == EOF) {
-			err = 0;
-			break;
-		} else if (err)
-			goto close_cfp;
-
-		if (!fwrite(&ksym[!i], sizeof(ksym[!i]), 1, cfp)) {
-			err = -EIO;
-			goto close_cfp;
-		}
+	return i;
+}
 
-		hdr.n_syms++;
-	}
+int ksyms_boot_id(char *boot_id, size_t size)
+{
+	FILE *fp;
+	int err = 0;
+
+	memset(boot_id, 0, size);
 
-	if (!fwrite(&ksym[i], sizeof(ksym[i]), 1, cfp)) {
+	fp = fopen("/proc/sys/kernel/random/boot_id", "r");
+	if (!fp)
+		return -errno;
+
+	if (!fgets(boot_id, size, fp))
 		err = -EIO;
-		goto close_cfp;
+
+	fclose(fp);
+	return err;
+}
+
+/* FNV-1a of the name and load address of every module. the other
+ * columns, like the reference count, change during normal
+ * operation. */
+static uint64_t ksyms_modules_hash(void)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char line[0x200], name[0x40];
+	unsigned long long addr;
+	char *p;
+	FILE *fp;
+
+	fp = fopen("/proc/modules", "r");
+	if (!fp)
+		return 0;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%63s", name) != 1)
+			continue;
+
+		p = strrchr(line, ' ');
+		addr = p ? strtoull(p, NULL, 16) : 0;
+
+		for (p = name; *p; p++)
+			hash = (hash ^ (uint8_t)*p) * 0x100000001b3ULL;
+
+		hash = (hash ^ addr) * 0x100000001b3ULL;
 	}
 
-	rewind(cfp);
-	if (!fwrite(&hdr, sizeof(hdr), 1, cfp))
-		err = -EIO;
+	fclose(fp);
+	return hash;
+}
+
+static void ksyms_cache_key(struct ksym_cache_hdr *hdr)
+{
+	hdr->version = KSYMS_CACHE_VERSION;
+	ksyms_boot_id(hdr->boot_id, sizeof(hdr->boot_id));
+	hdr->modules_hash = ksyms_modules_hash();
+}
+
+static struct ksym_cache *ksyms_cache_build(const char *in,
+					    const struct ksym_cache_hdr *key,
+					    size_t *sizep)
+{
+	struct ksym_build b = { 0 };
+	struct ksym_cache *cache = NULL;
+	size_t size;
+	FILE *kfp;
+
+	kfp = fopen(in, "r");
+	if (!kfp)
+		return NULL;
+
+	if (ksyms_read(&b, kfp))
+		goto out;
+
+	ksyms_sort(&b);
+
+	size = sizeof(*cache) + b.n_syms * sizeof(ksym_t) + b.strtab_size;
+	cache = malloc(size);
+	if (!cache)
+		goto out;
+
+	cache->hdr = *key;
+	cache->hdr.n_syms = b.n_syms;
+	cache->hdr.strtab_size = b.strtab_size;
+
+	ksyms_eytzinger(cache->sym, b.syms, 0, 0, b.n_syms);
+	memcpy(&cache->sym[b.n_syms], b.strtab, b.strtab_size);
+
+	*sizep = size;
+out:
+	fclose(kfp);
+	free(b.strtab);
+	free(b.syms);
+	return cache;
+}
+
+static void ksyms_cache_write(const struct ksym_cache *cache, size_t size)
+{
+	char tmp[] = KSYMS_CACHE ".XXXXXX";
+	int fd, err = 0;
+
+	/* build it on the side, so that no one ever maps a half
+	 * written cache. /tmp is shared, so the name must not be
+	 * guessable. */
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto err;
+
+	if (write(fd, cache, size) != (ssize_t)size)
+		err = errno ? : EIO;
+
+	if (close(fd) && !err)
+		err = errno;
+
+	if (!err && rename(tmp, KSYMS_CACHE))
+		err = errno;
 
-close_cfp:
-	fclose(cfp);
 	if (err) {
-		_e("failed: %s", strerror(-err));
-		unlink(out);
+		unlink(tmp);
+		errno = err;
+		goto err;
 	}
-close_kfp:
-	fclose(kfp);
-out:
-	return err;
+
+	return;
+err:
+	/* the symbols are still used, they just have to be read again
+	 * next time around. */
+	_d("unable to store %s: %s", KSYMS_CACHE, strerror(errno));
 }
 
-static int ksyms_cache_open(ksyms_t *ks)
+static int ksyms_cache_valid(ksyms_t *ks, const struct ksym_cache_hdr *key)
 {
-	struct stat st;
-	int err, i;
+	const struct ksym_cache_hdr *hdr = &ks->cache->hdr;
+	const char *strtab;
+	size_t size;
+
+	if (ks->cache_size < sizeof(*hdr) ||
+	    hdr->version != key->version ||
+	    memcmp(hdr->boot_id, key->boot_id, sizeof(hdr->boot_id)) ||
+	    hdr->modules_hash != key->modules_hash)
+		return 0;
 
-	if (stat(KSYMS_CACHE, &st)) {
-		err = ksyms_cache_build("/proc/kallsyms", KSYMS_CACHE);
-		if (err)
-			return err;
+	size = ks->cache_size - sizeof(*hdr);
+	if (hdr->n_syms > size / sizeof(ksym_t) ||
+	    size - hdr->n_syms * sizeof(ksym_t) != hdr->strtab_size)
+		return 0;
 
-		if (stat(KSYMS_CACHE, &st))
-			return -errno;
+	/* every name ends before the table does, see ksym_name() */
+	strtab = (const char *)&ks->cache->sym[hdr->n_syms];
+	return !hdr->strtab_size || !strtab[hdr->strtab_size - 1];
+}
+
+static void ksyms_cache_close(ksyms_t *ks)
+{
+	if (ks->cache_fd >= 0) {
+		if (ks->cache)
+			munmap(ks->cache, ks->cache_size);
+		close(ks->cache_fd);
+	} else {
+		free(ks->cache);
 	}
 
-	ks->cache_fd = open(KSYMS_CACHE, O_RDONLY);
+	ks->cache = NULL;
+	ks->cache_fd = -1;
+}
+
+static int ksyms_cache_map(ksyms_t *ks)
+{
+	struct stat st;
+	int err;
+
+	ks->cache_fd = open(KSYMS_CACHE, O_RDONLY | O_NOFOLLOW);
 	if (ks->cache_fd < 0)
 		return -errno;
 
-	ks->cache = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
-			 ks->cache_fd, 0);
+	/* /tmp is shared, only trust a cache that we wrote */
+	err = fd_trusted(ks->cache_fd);
+	if (err)
+		return err;
 
-	/* For bsearch() to work properly, our cache must be sorted by
-	 * start address.  kallsyms is not guaranteed to be in order from
-	 * low address to high; modules seem to be particularly problematic.
-	 */
-	if (ks->cache) {
-		ksym_t *ksyms = ks->cache->sym;
-		int i;
-
-		qsort(ksyms, ks->cache->hdr.n_syms, sizeof(ksym_t),
-		      ksym_membercmp);
-		/* Now we have sorted we can fill in end values. */
-		for (i = 0; i < ks->cache->hdr.n_syms - 1; i++)
-			ksyms[i].end = ksyms[i+1].start -1;
-		/* assume no function larger than 4k */
-		ksyms[i].end = ksyms[i].start + 0x1000;
+	if (fstat(ks->cache_fd, &st))
+		return -errno;
+
+	/* a short file would fault on the first access */
+	if ((size_t)st.st_size < sizeof(struct ksym_cache_hdr))
+		return -EINVAL;
+
+	/* nothing is modified after the fact, so the pages can be
+	 * shared with the page cache. */
+	ks->cache_size = st.st_size;
+	ks->cache = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+			 ks->cache_fd, 0);
+	if (ks->cache == MAP_FAILED) {
+		ks->cache = NULL;
+		return -errno;
 	}
 
-	return ks->cache ? 0 : -ENOENT;
+	return 0;
+}
+
+static int ksyms_cache_open(ksyms_t *ks)
+{
+	struct ksym_cache_hdr key = { 0 };
+	int err;
+
+	ksyms_cache_key(&key);
+
+	err = ksyms_cache_map(ks);
+	if (!err && ksyms_cache_valid(ks, &key))
+		goto out;
+
+	_d("rebuilding %s", KSYMS_CACHE);
+	ksyms_cache_close(ks);
+
+	ks->cache = ksyms_cache_build("/proc/kallsyms", &key, &ks->cache_size);
+	if (!ks->cache)
+		return -EINVAL;
+
+	ksyms_cache_write(ks->cache, ks->cache_size);
+out:
+	ks->strtab = (const char *)&ks->cache->sym[ks->cache->hdr.n_syms];
+	return 0;
 }
 
 ksyms_t *ksyms_new(void)
@@ -206,6 +485,7 @@ ksyms_t *ksyms_new(void)
 
 	ks = calloc(1, sizeof(*ks));
 	assert(ks);
+	ks->cache_fd = -1;
 
 	err = ksyms_cache_open(ks);
 	if (err)
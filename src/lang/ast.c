@@ -290,24 +290,224 @@ int node_probe_reg_get(node_t *probe, int dynamic)
 	return -1;
 }
 
-ssize_t node_probe_stack_get(node_t *probe, size_t size)
+/* stack space for temporaries is handed back when the statement
+ * that allocated it has been compiled, so that later statements can
+ * reuse it. maps and variables share their dyn between all of their
+ * references and must keep their storage for the lifetime of the
+ * probe. */
+typedef struct stack_blk {
+	ssize_t addr;
+	size_t  size;
+} stack_blk_t;
+
+struct stack_pool {
+	stack_blk_t *free;
+	size_t       n_free;
+
+	stack_blk_t *temps;
+	size_t       n_temps;
+
+	size_t *marks;
+	size_t  n_marks;
+};
+
+static stack_pool_t *node_probe_stack_pool(node_t *probe)
+{
+	if (!probe->dyn->probe.stack) {
+		probe->dyn->probe.stack = calloc(1, sizeof(stack_pool_t));
+		assert(probe->dyn->probe.stack);
+	}
+
+	return probe->dyn->probe.stack;
+}
+
+static ssize_t stack_pool_reuse(stack_pool_t *sp, size_t size)
+{
+	stack_blk_t *blk, *best = NULL;
+	ssize_t addr;
+
+	for (blk = sp->free; blk < &sp->free[sp->n_free]; blk++) {
+		if (blk->size >= size && (!best || blk->size < best->size))
+			best = blk;
+	}
+
+	if (!best)
+		return 0;
+
+	addr = best->addr;
+	best->addr += size;
+	best->size -= size;
+
+	if (!best->size)
+		*best = sp->free[--sp->n_free];
+
+	return addr;
+}
+
+static void stack_pool_release(stack_pool_t *sp, stack_blk_t *new)
+{
+	stack_blk_t *blk;
+
+	/* merge with any neighbours */
+	for (blk = sp->free; blk < &sp->free[sp->n_free];) {
+		if (blk->addr + (ssize_t)blk->size == new->addr) {
+			new->addr  = blk->addr;
+			new->size += blk->size;
+		} else if (new->addr + (ssize_t)new->size == blk->addr) {
+			new->size += blk->size;
+		} else {
+			blk++;
+			continue;
+		}
+
+		*blk = sp->free[--sp->n_free];
+		blk = sp->free;
+	}
+
+	sp->free = realloc(sp->free, (sp->n_free + 1) * sizeof(*sp->free));
+	assert(sp->free);
+	sp->free[sp->n_free++] = *new;
+}
+
+ssize_t node_probe_stack_get(node_t *probe, node_t *n, size_t size)
+{
+	stack_pool_t *sp = node_probe_stack_pool(probe);
+	ssize_t addr = 0;
+
+	size = _ALIGNED(size);
+
+	if (n->type == TYPE_MAP || n->type == TYPE_VAR) {
+		probe->dyn->probe.sp -= size;
+		return probe->dyn->probe.sp;
+	}
+
+	if (sp->n_marks)
+		addr = stack_pool_reuse(sp, size);
+
+	if (!addr) {
+		probe->dyn->probe.sp -= size;
+		addr = probe->dyn->probe.sp;
+	}
+
+	if (!sp->n_marks)
+		return addr;
+
+	sp->temps = realloc(sp->temps, (sp->n_temps + 1) * sizeof(*sp->temps));
+	assert(sp->temps);
+	sp->temps[sp->n_temps].addr = addr;
+	sp->temps[sp->n_temps].size = size;
+	sp->n_temps++;
+	return addr;
+}
+
+void node_probe_stack_enter(node_t *probe)
+{
+	stack_pool_t *sp = node_probe_stack_pool(probe);
+
+	sp->marks = realloc(sp->marks, (sp->n_marks + 1) * sizeof(*sp->marks));
+	assert(sp->marks);
+	sp->marks[sp->n_marks++] = sp->n_temps;
+}
+
+void node_probe_stack_leave(node_t *probe)
+{
+	stack_pool_t *sp = node_probe_stack_pool(probe);
+	size_t mark;
+
+	assert(sp->n_marks);
+	mark = sp->marks[--sp->n_marks];
+
+	while (sp->n_temps > mark)
+		stack_pool_release(sp, &sp->temps[--sp->n_temps]);
+}
+
+static void node_probe_stack_free(node_t *probe)
+{
+	stack_pool_t *sp = probe->dyn->probe.stack;
+
+	if (!sp)
+		return;
+
+	free(sp->marks);
+	free(sp->temps);
+	free(sp->free);
+	free(sp);
+}
+
+
+/* nodes, their dyns and strings all live until the script is freed,
+ * so they are carved out of large blocks that are released in one
+ * go instead of being allocated one by one. */
+#define NODE_ARENA_BLK_SIZE 0x10000
+
+typedef struct node_arena_blk {
+	struct node_arena_blk *next;
+	size_t used, size;
+	char data[];
+} node_arena_blk_t;
+
+static node_arena_blk_t *node_arena;
+
+void *node_alloc(size_t size)
 {
-	probe->dyn->probe.sp -= size;
-	return probe->dyn->probe.sp;
+	node_arena_blk_t *blk = node_arena;
+	size_t bsize;
+	void *p;
+
+	size = _ALIGNED(size);
+
+	if (!blk || blk->used + size > blk->size) {
+		bsize = size > NODE_ARENA_BLK_SIZE ? size : NODE_ARENA_BLK_SIZE;
+
+		blk = malloc(sizeof(*blk) + bsize);
+		assert(blk);
+
+		blk->next = node_arena;
+		blk->used = 0;
+		blk->size = bsize;
+		node_arena = blk;
+	}
+
+	p = &blk->data[blk->used];
+	blk->used += size;
+
+	memset(p, 0, size);
+	return p;
+}
+
+char *node_strndup(const char *s, size_t len)
+{
+	char *str = node_alloc(len + 1);
+
+	memcpy(str, s, len);
+	return str;
 }
 
+char *node_strdup(const char *s)
+{
+	return node_strndup(s, strlen(s));
+}
+
+static void node_arena_free(void)
+{
+	node_arena_blk_t *blk, *next;
+
+	for (blk = node_arena; blk; blk = next) {
+		next = blk->next;
+		free(blk);
+	}
+
+	node_arena = NULL;
+}
 
 node_t *node_new(type_t type) {
-	node_t *n = calloc(1, sizeof(*n));
+	node_t *n = node_alloc(sizeof(*n));
 
-	assert(n);
 	n->type = type;
 
 	/* maps and vars have shared dyns allocated in the symtable */
-	if (n->type != TYPE_MAP && n->type != TYPE_VAR) {
-		n->dyn = calloc(1, sizeof(*n->dyn));
-		assert(n->dyn);
-	}
+	if (n->type != TYPE_MAP && n->type != TYPE_VAR)
+		n->dyn = node_alloc(sizeof(*n->dyn));
 				
 	return n;
 }
@@ -346,7 +546,7 @@ node_t *node_map_new(char *name, node_t *rec)
 	node_t *n = node_new(TYPE_MAP);
 
 	if (!rec)
-		rec = node_rec_new(node_str_new(strdup("")));
+		rec = node_rec_new(node_str_new(node_strdup("")));
 
 	n->string  = name;
 	n->map.rec = rec;
@@ -390,7 +590,7 @@ node_t *node_assign_new(node_t *lval, node_t *expr)
 {
 	node_t *n = node_new(TYPE_ASSIGN);
 
-	n->string = strdup("=");
+	n->string = node_strdup("=");
 	n->assign.lval = lval;
 	n->assign.expr = expr;
 
@@ -404,7 +604,7 @@ node_t *node_method_new(node_t *map, node_t *call)
 {
 	node_t *n = node_new(TYPE_METHOD);
 
-	call->call.module = strdup("method");
+	call->call.module = node_strdup("method");
 	n->method.map  = map;
 	n->method.call = call;
 
@@ -481,12 +681,17 @@ node_t *node_probe_new(char *pspec, node_t *pred,
 	return n;
 }
 
-node_t *node_script_new(node_t *probes)
+node_t *node_script_new(node_t *decls, node_t *probes)
 {
 	node_t *c, *n = node_new(TYPE_SCRIPT);
 
+	/* map declarations are only hints to the symtable, they are
+	 * not part of the tree that is walked. */
+	n->script.decls  = decls;
 	n->script.probes = probes;
 
+	node_foreach(c, decls)
+		c->parent = n;
 	node_foreach(c, probes)
 		c->parent = n;
 	return n;
@@ -507,34 +712,20 @@ node_t *node_script_parse(FILE *fp)
 	return script;
 }
 
-static int _node_free(node_t *n, void *_null)
+/* the nodes of a script all go at once, along with any that were
+ * dropped from the tree along the way. freeing anything else is a
+ * no-op, its memory is reclaimed with the script. */
+void node_free(node_t *n)
 {
-	switch (n->type) {
-	case TYPE_CALL:
-		if (n->call.module)
-			free(n->call.module);
-		/* fall-through */
-	case TYPE_PROBE:
-	case TYPE_ASSIGN:
-	case TYPE_MAP:
-	case TYPE_STR:
-		free(n->string);
-		break;
+	node_t *probe;
 
-	default:
-		break;
-	}
+	if (n->type != TYPE_SCRIPT)
+		return;
 
-	if (n->type != TYPE_MAP && n->type != TYPE_VAR)
-		free(n->dyn);
+	node_foreach(probe, n->script.probes)
+		node_probe_stack_free(probe);
 
-	free(n);
-	return 0;
-}
-
-void node_free(node_t *n)
-{
-	node_walk(n, NULL, _node_free, NULL);
+	node_arena_free();
 }
 
 static int _node_walk_list(node_t *head,
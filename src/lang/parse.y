@@ -63,7 +63,7 @@ typedef struct node node_t;
 %token <string> PSPEC CLOSEPRED IDENT MAP STRING
 %token <integer> INT
 
-%type <node> script probes probe oblock block stmts stmt assign
+%type <node> script decls decl probes probe oblock block stmts stmt assign
 %type <node> expr iff unroll binop var map record call mcall vargs
 %type <node> stmtb iffb unrollb
 
@@ -88,7 +88,15 @@ typedef struct node node_t;
 %start script
 %%
 
-script: probes { *script = node_script_new($1); }
+script: probes       { *script = node_script_new(NULL, $1); }
+      | decls probes { *script = node_script_new($1,   $2); }
+;
+
+decls: decl
+     | decl decls { $$ = insque_head($1, $2); }
+;
+
+decl: MAP ':' call ';' { $$ = node_method_new(node_map_new($1, NULL), $3); }
 ;
 
 probes: probe
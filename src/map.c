@@ -19,12 +19,20 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/stat.h>
+
+#include <linux/perf_event.h>
+
 #include <ply/ply.h>
 #include <ply/bpf-syscall.h>
 #include <ply/map.h>
@@ -39,7 +47,7 @@ void dump_sym(FILE *fp, node_t *integer, void *data)
 
 	k = G.ksyms ? ksym_get(G.ksyms, pc) : NULL;
 	if (k) {
-		fprintf(fp, "%-20s", k->sym);
+		fprintf(fp, "%-20s", ksym_name(G.ksyms, k));
 		return;
 	}
 
@@ -63,45 +71,150 @@ static void dump_str(FILE *fp, node_t *str, void *data)
 	fprintf(fp, "%-*.*s", size, size, (const char *)data);
 }
 
-static void dump_stack(FILE *fp, node_t *stack, void *data)
+static int cmp_stack_id(const void *a, const void *b)
 {
-	int64_t *_stack_id = data;
-	uint32_t stack_id = *_stack_id;
-	uint64_t ips[0x10];
+	uint32_t ia, ib;
+
+	memcpy(&ia, a, sizeof(ia));
+	memcpy(&ib, b, sizeof(ib));
+	return (ia > ib) - (ia < ib);
+}
+
+/* all stacks, read from the stack map in one go the first time one
+ * is dumped and sorted on the stack id. reader threads and the main
+ * thread can both be dumping stacks, stacks_lock covers the cache. */
+static struct {
+	char *data;
+	int   n;
+	int   loaded;
+} stacks;
+
+static pthread_mutex_t stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void __stacks_drop(void)
+{
+	free(stacks.data);
+	memset(&stacks, 0, sizeof(stacks));
+}
+
+static void stacks_drop(void)
+{
+	pthread_mutex_lock(&stacks_lock);
+	__stacks_drop();
+	pthread_mutex_unlock(&stacks_lock);
+}
+
+static const uint64_t *stacks_get(node_t *stack, uint32_t stack_id)
+{
+	struct sym_map_data *md;
+	size_t rsize, lo, hi, mid;
+	int retried = 0;
+	uint32_t id;
+	char *rec;
 	sym_t *s;
-	int i;
 
 	s = symtable_get_stack(node_get_script(stack)->dyn->script.st);
 	if (!s) {
 		_e("no stack map in symbol table");
-		return;
+		return NULL;
 	}
 
-	if (bpf_map_lookup(s->map->fd, &stack_id, ips)) {
-		_eno("failed to lookup stack-id:%#" PRIx32, stack_id);
-		fprintf(fp, "<ERR stack-id:%#" PRIx32 ">", stack_id);
-		return;
+	md = s->map;
+	rsize = md->ksize + md->vsize;
+
+reload:
+	if (!stacks.loaded) {
+		stacks.data = malloc(rsize * md->nelem);
+		assert(stacks.data);
+
+		stacks.n = map_read(md, stacks.data, md->nelem, 0);
+		if (stacks.n < 0)
+			stacks.n = 0;
+
+		qsort(stacks.data, stacks.n, rsize, cmp_stack_id);
+		stacks.loaded = 1;
 	}
 
-	for (i = 0; i < 0x10; i++) {
-		const ksym_t *k;
+	for (lo = 0, hi = stacks.n; lo < hi;) {
+		mid = lo + (hi - lo) / 2;
+		rec = stacks.data + mid * rsize;
+
+		memcpy(&id, rec, sizeof(id));
+		if (id == stack_id)
+			return (void *)(rec + md->ksize);
+		else if (stack_id < id)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
 
-		if (!ips[i])
-			break;
+	/* printf() output is dumped while the probes are running, the
+	 * stack might have been added after the map was read. */
+	if (!retried++) {
+		__stacks_drop();
+		goto reload;
+	}
 
-		k = G.ksyms ? ksym_get(G.ksyms, ips[i]) : NULL;
-		if (k) {
-			fprintf(fp, "\n\t%s", k->sym);
+	return NULL;
+}
 
-			ips[i] -= k->start;
-			if (!ips[i])
-				continue;
+/* number of frames in the stack, copied to `ips` */
+static int stack_frames(node_t *stack, void *data, uint64_t *ips)
+{
+	const uint64_t *frames;
+	uint32_t stack_id;
+	int64_t _stack_id;
+	int n;
+
+	memcpy(&_stack_id, data, sizeof(_stack_id));
+	stack_id = _stack_id;
+
+	pthread_mutex_lock(&stacks_lock);
+	frames = stacks_get(stack, stack_id);
+	if (!frames) {
+		pthread_mutex_unlock(&stacks_lock);
+		return -ENOENT;
+	}
 
-			fprintf(fp, "+%#"PRIxPTR, (uintptr_t)ips[i]);
-			continue;
-		}
+	/* the record is packed, frames might not be aligned */
+	memcpy(ips, frames, sizeof(*ips) * G.stack_depth);
+	pthread_mutex_unlock(&stacks_lock);
+
+	for (n = 0; n < G.stack_depth && ips[n]; n++);
+	return n;
+}
+
+static void dump_frame(FILE *fp, uint64_t ip, int offset)
+{
+	const ksym_t *k;
+
+	k = G.ksyms ? ksym_get(G.ksyms, ip) : NULL;
+	if (!k) {
+		fprintf(fp, "<%*.*" PRIxPTR ">", PTR_W, PTR_W, (uintptr_t)ip);
+		return;
+	}
 
-		fprintf(fp, "\n\t<%*.*" PRIxPTR ">", PTR_W, PTR_W, (uintptr_t)ips[i]);
+	fputs(ksym_name(G.ksyms, k), fp);
+
+	ip -= k->start;
+	if (offset && ip)
+		fprintf(fp, "+%#" PRIxPTR, (uintptr_t)ip);
+}
+
+static void dump_stack(FILE *fp, node_t *stack, void *data)
+{
+	uint64_t ips[PERF_MAX_STACK_DEPTH];
+	int i, n;
+
+	n = stack_frames(stack, data, ips);
+	if (n < 0) {
+		fprintf(fp, "<ERR stack-id:%#" PRIx64 ">", *((int64_t *)data));
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		fputs("\n\t", fp);
+		dump_frame(fp, ips[i], 1);
 	}
 }
 
@@ -210,7 +323,82 @@ int cmp_map(const void *ak, const void *bk, void *_map)
 	return cmp_node(map, av, bv);
 }
 
-static void __key_workaround(int fd, void *key, size_t key_sz, void *val)
+static int map_ncpus(void)
+{
+	static int ncpus;
+	int lo, hi;
+	FILE *fp;
+
+	if (ncpus)
+		return ncpus;
+
+	/* per-CPU maps hold one value for every _possible_ CPU,
+	 * e.g. "0-63" or "0,2-5" */
+	fp = fopen("/sys/devices/system/cpu/possible", "r");
+	if (fp) {
+		while (fscanf(fp, "%d", &lo) == 1) {
+			hi = lo;
+			if (fgetc(fp) == '-' && fscanf(fp, "%d", &hi) == 1)
+				fgetc(fp);
+
+			ncpus += hi - lo + 1;
+		}
+		fclose(fp);
+	}
+
+	if (ncpus <= 0)
+		ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	return ncpus;
+}
+
+static size_t map_vlen(struct sym_map_data *md)
+{
+	if (map_is_percpu(md))
+		return _ALIGNED(md->vsize) * map_ncpus();
+
+	return md->vsize;
+}
+
+static void map_value_merge(struct sym_map_data *md, void *val, void *raw)
+{
+	size_t stride = _ALIGNED(md->vsize);
+	int64_t sum, part;
+	size_t i;
+	int cpu;
+
+	if (!map_is_percpu(md)) {
+		memcpy(val, raw, md->vsize);
+		return;
+	}
+
+	/* only aggregations use per-CPU maps, so the value is always
+	 * made up of 64-bit counters that we can simply add up. */
+	for (i = 0; i < md->vsize; i += sizeof(sum)) {
+		sum = 0;
+		for (cpu = 0; cpu < map_ncpus(); cpu++) {
+			memcpy(&part, raw + cpu * stride + i, sizeof(part));
+			sum += part;
+		}
+
+		memcpy(val + i, &sum, sizeof(sum));
+	}
+}
+
+static int map_lookup(struct sym_map_data *md, void *key, void *val,
+		      void *raw)
+{
+	int err;
+
+	err = bpf_map_lookup(md->fd, key, raw);
+	if (!err)
+		map_value_merge(md, val, raw);
+
+	return err;
+}
+
+#ifndef LINUX_HAS_MAP_NEXT_NULL
+static void __key_workaround(struct sym_map_data *md, void *key, void *raw)
 {
 	FILE *fp;
 	int err;
@@ -221,66 +409,651 @@ static void __key_workaround(int fd, void *key, size_t key_sz, void *val)
 	fp = fopen("/dev/urandom", "r");
 
 	while (1) {
-		err = bpf_map_lookup(fd, key, val);
+		err = bpf_map_lookup(md->fd, key, raw);
 		if (err)
 			break;
 
-		if (fread(key, key_sz, 1, fp) != 1)
+		if (fread(key, md->ksize, 1, fp) != 1)
 			break;
 	}
 
 	fclose(fp);
 }
+#endif
+
+static int map_read_iter(struct sym_map_data *md, char *data, int max,
+			 int reset)
+{
+	size_t rsize = md->ksize + md->vsize;
+	char *key = data, *prev = NULL, *raw;
+	int i, n = 0;
+
+	raw = malloc(map_vlen(md));
+	assert(raw);
+
+#ifndef LINUX_HAS_MAP_NEXT_NULL
+	/* older kernels do not accept a NULL key to get the first
+	 * one, so start from a key that is known not to exist. */
+	__key_workaround(md, key, raw);
+	prev = key;
+#endif
+
+	while (n < max && !bpf_map_next(md->fd, prev, key)) {
+		prev = key;
+
+		/* entry was removed while we were iterating, move on
+		 * from it without storing it */
+		if (map_lookup(md, key, key + md->ksize, raw))
+			continue;
+
+		n++;
+		key += rsize;
+	}
+
+	if (reset) {
+		for (i = 0, key = data; i < n; i++, key += rsize)
+			bpf_map_delete(md->fd, key);
+	}
+
+	free(raw);
+	return n;
+}
+
+static int map_read_batch(struct sym_map_data *md, char *data, int max,
+			  int reset)
+{
+	size_t rsize = md->ksize + md->vsize, vlen = map_vlen(md);
+	char *keys, *vals;
+	uint64_t batch;
+	uint32_t count;
+	int err, i, n = 0, first = 1;
+
+	keys = malloc(md->ksize * max);
+	vals = malloc(vlen * max);
+	assert(keys && vals);
+
+	do {
+		count = max - n;
+		err = bpf_map_batch(md->fd, first ? NULL : &batch, &batch,
+				    keys + n * md->ksize, vals + n * vlen,
+				    &count, reset);
+		if (err && errno != ENOENT && first) {
+			/* batching not supported for this map/kernel. in
+			 * that case the kernel leaves count untouched, so
+			 * it can't be used to tell. */
+			n = -ENOSYS;
+			goto out;
+		}
+
+		n += count;
+		first = 0;
+	} while (!err && n < max);
+
+	for (i = 0; i < n; i++) {
+		memcpy(data + i * rsize, keys + i * md->ksize, md->ksize);
+		map_value_merge(md, data + i * rsize + md->ksize,
+				vals + i * vlen);
+	}
+
+out:
+	free(vals);
+	free(keys);
+	return n;
+}
+
+int map_read(struct sym_map_data *md, void *data, int max, int reset)
+{
+	int n;
+
+	/* read the whole map in a couple of syscalls if the kernel
+	 * supports it, otherwise fall back to walking it one key at a
+	 * time. */
+	n = map_read_batch(md, data, max, reset);
+	if (n >= 0)
+		return n;
+
+	return map_read_iter(md, data, max, reset);
+}
+
+/* min-heap of record pointers, ordered by cmp_map */
+static void map_top_sift(char **heap, int n, int i, node_t *map)
+{
+	int child;
+	char *tmp;
+
+	for (; (child = 2 * i + 1) < n; i = child) {
+		if (child + 1 < n &&
+		    cmp_map(heap[child + 1], heap[child], map) < 0)
+			child++;
+
+		if (cmp_map(heap[i], heap[child], map) <= 0)
+			break;
+
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+	}
+}
+
+/* move the `k` greatest records in `data` to the front, in
+ * descending order. instead of sorting all `n` records, keep the k
+ * greatest ones seen so far in a heap, O(n log k). */
+static int map_top(node_t *map, char *data, int n, int k, size_t rsize)
+{
+	char **heap, *rec, *out, *tmp;
+	int i, j, len = 0;
+
+	if (k > n)
+		k = n;
+
+	heap = malloc(k * sizeof(*heap));
+	out = malloc(k * rsize);
+	assert(heap && out);
+
+	for (i = 0, rec = data; i < n; i++, rec += rsize) {
+		if (len < k) {
+			heap[len++] = rec;
+			if (len == k)
+				for (j = k / 2 - 1; j >= 0; j--)
+					map_top_sift(heap, k, j, map);
+			continue;
+		}
+
+		if (cmp_map(rec, heap[0], map) <= 0)
+			continue;
+
+		heap[0] = rec;
+		map_top_sift(heap, k, 0, map);
+	}
+
+	/* pop the smallest one off the end, leaving the greatest one
+	 * first. */
+	for (len = k; len; len--) {
+		memcpy(out + (len - 1) * rsize, heap[0], rsize);
+
+		tmp = heap[0];
+		heap[0] = heap[len - 1];
+		heap[len - 1] = tmp;
+		map_top_sift(heap, len - 1, 0, map);
+	}
+
+	memcpy(data, out, k * rsize);
+	free(out);
+	free(heap);
+	return k;
+}
+
+/* print `n` without any padding, so that it can be used as a frame
+ * name. */
+static void dump_folded_node(FILE *fp, node_t *n, void *data)
+{
+	uint64_t ips[PERF_MAX_STACK_DEPTH];
+	char *buf, *start, *end;
+	node_t *varg;
+	size_t size;
+	FILE *bfp;
+	int i, sep;
+
+	if (!n->dump && n->dyn->type == TYPE_REC) {
+		sep = 0;
+		node_foreach(varg, n->rec.vargs) {
+			bfp = open_memstream(&buf, &size);
+			assert(bfp);
+			dump_folded_node(bfp, varg, data);
+			fclose(bfp);
+
+			/* empty stacks should not leave a blank frame */
+			if (size) {
+				if (sep++)
+					fputc(';', fp);
+				fwrite(buf, size, 1, fp);
+			}
+
+			free(buf);
+			data += varg->dyn->size;
+		}
+		return;
+	}
+
+	if (!n->dump && n->dyn->type == TYPE_STACK) {
+		/* flame graphs start from the root */
+		i = stack_frames(n, data, ips);
+		while (i-- > 0) {
+			dump_frame(fp, ips[i], 0);
+			if (i)
+				fputc(';', fp);
+		}
+		return;
+	}
+
+	bfp = open_memstream(&buf, &size);
+	assert(bfp);
+	dump_node(bfp, n, data);
+	fclose(bfp);
+
+	for (start = buf; isspace(*start); start++);
+	for (end = buf + size; end > start && isspace(end[-1]); end--);
+
+	fwrite(start, end - start, 1, fp);
+	free(buf);
+}
+
+/* frame;frame;frame value, i.e. the input format of most flame
+ * graph tools */
+static void dump_map_folded(FILE *fp, node_t *map, char *data, int n)
+{
+	node_t *rec = map->map.rec;
+	size_t rsize = rec->dyn->size + map->dyn->size;
+
+	for (; n > 0; n--, data += rsize) {
+		dump_folded_node(fp, rec, data);
+		fputc(' ', fp);
+		dump_folded_node(fp, map, data + rec->dyn->size);
+		fputc('\n', fp);
+	}
+}
+
+/* estimate the totals of aggregations in sampled probes */
+static void map_scale(struct sym_map_data *md, char *data, int n)
+{
+	size_t rsize = md->ksize + md->vsize, i;
+	uint64_t val;
+
+	if (!md->aggregated || md->sample <= 1)
+		return;
+
+	/* aggregation values are always made up of 64-bit counters */
+	for (; n > 0; n--, data += rsize) {
+		for (i = md->ksize; i < rsize; i += sizeof(val)) {
+			memcpy(&val, data + i, sizeof(val));
+			val *= md->sample;
+			memcpy(data + i, &val, sizeof(val));
+		}
+	}
+}
 
-void dump_map(node_t *map)
+void dump_map_data(FILE *fp, node_t *map, char *data, int n)
 {
 	node_t *rec = map->map.rec;
 	sym_t *s = sym_from_node(map);
-	char *data, *key, *val;
+	char *key, *val;
 	size_t rsize;
-	int err, n = 0;
 
 	rsize = s->map->ksize + s->map->vsize;
 
-	data = malloc(rsize * s->map->nelem);
-	assert(data);
+	if (G.scale)
+		map_scale(s->map, data, n);
 
-	key = data;
-	val = data + s->map->ksize;
+	/* histograms need all of their buckets */
+	if (G.top && !map->dyn->map.dump && n > G.top) {
+		if (!G.folded)
+			fprintf(fp, "\n%s: (top %d of %d)\n",
+				map->string, G.top, n);
 
-	__key_workaround(s->map->fd, key, rec->dyn->size, val);
+		n = map_top(map, data, n, G.top, rsize);
+	} else {
+		qsort_r(data, n, rsize, cmp_map, map);
+		if (!G.folded || map->dyn->map.dump)
+			fprintf(fp, "\n%s:\n", map->string);
+	}
 
-	for (err = bpf_map_next(s->map->fd, key, key); !err;
-	     err = bpf_map_next(s->map->fd, key - rsize, key)) {
-		err = bpf_map_lookup(s->map->fd, key, val);
-		if (err)
-			goto out_free;
+	if (map->dyn->map.dump) {
+		map->dyn->map.dump(fp, map, data, n);
+		return;
+	}
+
+	if (G.folded) {
+		dump_map_folded(fp, map, data, n);
+		return;
+	}
+
+	for (key = data, val = data + rec->dyn->size; n > 0; n--) {
+		dump_node(fp, rec, key);
+		fputs("\t", fp);
+		dump_node(fp, map, val);
+		fputs("\n", fp);
 
-		n++;
 		key += rsize;
 		val += rsize;
 	}
+}
+
+void dump_map(FILE *fp, node_t *map)
+{
+	sym_t *s = sym_from_node(map);
+	char *data;
+	int n;
 
-	qsort_r(data, n, rsize, cmp_map, map);
+	data = malloc((s->map->ksize + s->map->vsize) * s->map->nelem);
+	assert(data);
 
-	printf("\n%s:\n", map->string);
+	n = map_read(s->map, data, s->map->nelem, 0);
+	dump_map_data(fp, map, data, n);
+	free(data);
+}
 
-	if (map->dyn->map.dump) {
-		map->dyn->map.dump(stdout, map, data, n);
-		goto out_free;
+static int cmp_key(const void *a, const void *b, void *_md)
+{
+	struct sym_map_data *md = _md;
+
+	return memcmp(a, b, md->ksize);
+}
+
+static char *map_acc_find(struct sym_map_data *md, const void *key,
+			  size_t n)
+{
+	size_t rsize = md->ksize + md->vsize;
+	size_t lo = 0, hi = n, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+
+		cmp = memcmp(key, md->acc + mid * rsize, md->ksize);
+		if (!cmp)
+			return md->acc + mid * rsize;
+		else if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
-	for (key = data, val = data + rec->dyn->size; n > 0; n--) {
-		dump_node(stdout, rec, key);
-		fputs("\t", stdout);
-		dump_node(stdout, map, val);
-		fputs("\n", stdout);
+	return NULL;
+}
 
-		key += rsize;
-		val += rsize;
+/* only aggregations are double-buffered, so the value is always made
+ * up of 64-bit counters. */
+static void map_acc_add(struct sym_map_data *md, char *acc, const char *rec)
+{
+	size_t rsize = md->ksize + md->vsize;
+	int64_t sum, part;
+	size_t i;
+
+	for (i = md->ksize; i < rsize; i += sizeof(sum)) {
+		memcpy(&sum,  acc + i, sizeof(sum));
+		memcpy(&part, rec + i, sizeof(part));
+		sum += part;
+		memcpy(acc + i, &sum, sizeof(sum));
+	}
+}
+
+/* a batch drained from both halves can hold the same key twice, fold
+ * those into one record. returns the new number of records. */
+static int map_acc_coalesce(struct sym_map_data *md, char *data, int n)
+{
+	size_t rsize = md->ksize + md->vsize;
+	char *rec, *last;
+	int i, out;
+
+	if (n < 2)
+		return n;
+
+	qsort_r(data, n, rsize, cmp_key, md);
+
+	last = data;
+	for (i = 1, out = 1; i < n; i++) {
+		rec = data + i * rsize;
+
+		if (!memcmp(rec, last, md->ksize)) {
+			map_acc_add(md, last, rec);
+			continue;
+		}
+
+		last += rsize;
+		if (last != rec)
+			memcpy(last, rec, rsize);
+		out++;
 	}
-out_free:
+
+	return out;
+}
+
+/* add the records in `data` to the map's running total, which is kept
+ * sorted on the raw key so that existing entries can be found with a
+ * binary search. */
+static void map_acc_merge(struct sym_map_data *md, char *data, int n)
+{
+	size_t rsize = md->ksize + md->vsize;
+	size_t end = md->acc_n;
+	char *rec, *acc;
+
+	for (rec = data; n > 0; n--, rec += rsize) {
+		acc = map_acc_find(md, rec, end);
+		if (!acc) {
+			md->acc = realloc(md->acc, (md->acc_n + 1) * rsize);
+			assert(md->acc);
+
+			memcpy(md->acc + md->acc_n * rsize, rec, rsize);
+			md->acc_n++;
+			continue;
+		}
+
+		map_acc_add(md, acc, rec);
+	}
+
+	if (md->acc_n != end)
+		qsort_r(md->acc, md->acc_n, rsize, cmp_key, md);
+}
+
+/* read and clear the half of a double-buffered map that is backed by
+ * `fd`, appending the records to `data`. */
+static int map_drain(struct sym_map_data *md, int fd, char *data, int reset)
+{
+	struct sym_map_data half = *md;
+
+	half.fd = fd;
+	return map_read(&half, data, md->nelem, reset);
+}
+
+/* read everything from both halves, returns a buffer that the caller
+ * owns. */
+static char *map_drain_both(struct sym_map_data *md, int reset, int *n)
+{
+	size_t rsize = md->ksize + md->vsize;
+	char *data;
+
+	data = malloc(rsize * md->nelem * 2);
+	assert(data);
+
+	*n  = map_drain(md, md->fd, data, reset);
+	*n += map_drain(md, md->fd_alt, data + *n * rsize, reset);
+	return data;
+}
+
+static void map_dump_dbuf(FILE *fp, node_t *map, char *data, int n)
+{
+	struct sym_map_data *md = sym_from_node(map)->map;
+	size_t rsize = md->ksize + md->vsize;
+
+	n = map_acc_coalesce(md, data, n);
+
+	/* the maps of a pinned session keep the running total in the
+	 * kernel, so that it survives a restart of the reader. */
+	if (G.clear || G.session) {
+		dump_map_data(fp, map, data, n);
+		free(data);
+		return;
+	}
+
+	map_acc_merge(md, data, n);
+
+	/* the dump sorts the records, so give it a copy to keep the
+	 * accumulator in key order. */
+	data = realloc(data, md->acc_n * rsize);
+	assert(data || !md->acc_n);
+	memcpy(data, md->acc, md->acc_n * rsize);
+	dump_map_data(fp, map, data, md->acc_n);
 	free(data);
+	return;
+}
+
+/* warn about maps that have not been able to store all updates,
+ * typically because they are full. */
+static void map_dump_drops(node_t *script)
+{
+	sym_t *s, *drops = symtable_get_drops(script->dyn->script.st);
+	uint64_t *counts;
+	uint32_t key = 0;
+
+	if (!drops || drops->map->fd < 0)
+		return;
+
+	fflush(stdout);
+	counts = calloc(1, drops->map->vsize);
+	assert(counts);
+
+	if (bpf_map_lookup(drops->map->fd, &key, counts)) {
+		_eno("unable to read drop counters");
+		goto out;
+	}
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type != TYPE_MAP || s->name[0] != '@' ||
+		    !s->map->drop_slot || s->map->map->dyn != &s->dyn)
+			continue;
+
+		if (counts[s->map->drop_slot - 1])
+			_w("%s: %" PRIu64 " updates dropped, the map is "
+			   "full (%zu entries)", s->name,
+			   counts[s->map->drop_slot - 1], s->map->nelem);
+	}
+out:
+	free(counts);
+}
+
+static int map_ctrl_set(node_t *script, uint32_t idx)
+{
+	sym_t *ctrl = symtable_get_ctrl(script->dyn->script.st);
+	uint32_t key = 0;
+
+	if (!ctrl)
+		return -ENOSYS;
+
+	return bpf_map_update(ctrl->map->fd, &key, &idx, BPF_ANY);
+}
+
+/* mirrors the ctrl value, i.e. the half of the double-buffered maps
+ * that the probes are currently writing to. */
+static uint32_t active;
+
+/* lines currently on screen in live top mode */
+static char **screen;
+static int screen_n;
+
+/* update the screen to show `frame`, only rewriting lines that differ
+ * from what is already there. */
+static void map_redraw(char *frame)
+{
+	char *line, *next;
+	int i;
+
+	if (!screen)
+		fputs("\033[H\033[2J", stdout);
+
+	for (i = 0, line = frame; line && *line; i++, line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (i < screen_n && !strcmp(screen[i], line))
+			continue;
+
+		printf("\033[%d;1H%s\033[K", i + 1, line);
+
+		if (i >= screen_n) {
+			screen = realloc(screen, (i + 1) * sizeof(*screen));
+			assert(screen);
+			screen[screen_n++] = NULL;
+		}
+
+		free(screen[i]);
+		screen[i] = strdup(line);
+	}
+
+	/* the frame shrunk, clear what is left of the last one */
+	if (i < screen_n) {
+		printf("\033[%d;1H\033[J", i + 1);
+
+		for (; screen_n > i; screen_n--)
+			free(screen[screen_n - 1]);
+	}
+
+	printf("\033[%d;1H", i + 1);
+}
+
+int map_checkpoint(node_t *script)
+{
+	struct sym_map_data *md;
+	char ts[0x20], *data, *frame;
+	size_t size;
+	time_t now;
+	FILE *fp;
+	sym_t *s;
+	int err, n, live, keep;
+
+	/* redirect all probes to the other half, the one that was
+	 * active up until now can then be drained without racing
+	 * against them. a pinned session is only read, unless it is
+	 * asked to clear the maps. */
+	keep = G.session && !G.clear;
+	if (!keep) {
+		active ^= 1;
+		err = map_ctrl_set(script, active);
+		if (err && err != -ENOSYS) {
+			_eno("unable to swap map buffers");
+			return err;
+		}
+	}
+
+	/* in top mode on a terminal, render the frame off-screen so
+	 * that only the lines that changed need to be redrawn. */
+	live = G.top && isatty(STDOUT_FILENO);
+	if (live) {
+		fp = open_memstream(&frame, &size);
+		assert(fp);
+	} else {
+		fp = stdout;
+	}
+
+	now = time(NULL);
+	strftime(ts, sizeof(ts), "%H:%M:%S", localtime(&now));
+	fprintf(fp, "\n%s\n", ts);
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		md = s->map;
+		/* maps referenced from multiple probes share data, only
+		 * dump them via the sym of the last reference. */
+		if (s->type != TYPE_MAP || s->name[0] != '@' ||
+		    md->fd == -1 || md->map->dyn != &s->dyn)
+			continue;
+
+		if (!md->dbuf) {
+			dump_map(fp, md->map);
+			continue;
+		}
+
+		if (keep) {
+			data = map_drain_both(md, 0, &n);
+		} else {
+			data = malloc((md->ksize + md->vsize) * md->nelem);
+			assert(data);
+
+			n = map_drain(md, active ? md->fd : md->fd_alt, data, 1);
+		}
+
+		map_dump_dbuf(fp, md->map, data, n);
+	}
+
+	if (live) {
+		fclose(fp);
+		map_redraw(frame);
+		free(frame);
+	}
+
+	stacks_drop();
+	map_dump_drops(script);
+	fflush(stdout);
+	return 0;
 }
 
 int map_setup(node_t *script)
@@ -294,11 +1067,14 @@ int map_setup(node_t *script)
 
 		if (G.dump) {
 			s->map->fd = dumpfd++;
+			if (s->map->dbuf)
+				s->map->fd_alt = dumpfd++;
 			continue;
 		}
 
-		_d("%s: type:%d ksize:%#zx vsize:%#zx nelem:%#zx", s->name,
-		   s->map->type, s->map->ksize, s->map->vsize, s->map->nelem);
+		_d("%s: type:%d ksize:%#zx vsize:%#zx nelem:%#zx%s", s->name,
+		   s->map->type, s->map->ksize, s->map->vsize, s->map->nelem,
+		   s->map->dbuf ? " (double-buffered)" : "");
 
 		s->map->fd = bpf_map_create(s->map->type, s->map->ksize,
 					    s->map->vsize, s->map->nelem);
@@ -306,28 +1082,269 @@ int map_setup(node_t *script)
 			_eno("%s", s->name);
 			return s->map->fd;
 		}
+
+		if (!s->map->dbuf)
+			continue;
+
+		s->map->fd_alt = bpf_map_create(s->map->type, s->map->ksize,
+						s->map->vsize, s->map->nelem);
+		if (s->map->fd_alt <= 0) {
+			_eno("%s", s->name);
+			return s->map->fd_alt;
+		}
 	}
 
 	return 0;
 }
 
+/* a map's final contents, read by map_snap_read() */
+struct map_snap {
+	struct sym_map_data *md;
+	char *data;
+	int n;
+};
+
+#define MAP_SNAP_WORKERS 8
+
+struct map_snap_worker {
+	struct map_snap *snaps;
+	int n_snaps;
+	volatile int *next;
+	pthread_t tid;
+};
+
+static void map_snap_read(struct map_snap *ms)
+{
+	struct sym_map_data *md = ms->md;
+	size_t rsize = md->ksize + md->vsize;
+	int reset;
+
+	if (!md->dbuf) {
+		ms->data = malloc(rsize * md->nelem);
+		assert(ms->data);
+
+		ms->n = map_read(md, ms->data, md->nelem, G.clear);
+		return;
+	}
+
+	/* a one-off read of a pinned session leaves the data for the
+	 * next reader, unless asked to reset it. */
+	reset = !G.session || G.clear;
+
+	/* pick up everything that was recorded since the last
+	 * checkpoint, from both halves. */
+	ms->data = map_drain_both(md, reset, &ms->n);
+}
+
+static void *map_snap_worker(void *_w)
+{
+	struct map_snap_worker *w = _w;
+	int i;
+
+	while ((i = __sync_fetch_and_add(w->next, 1)) < w->n_snaps)
+		map_snap_read(&w->snaps[i]);
+
+	return NULL;
+}
+
+/* read all maps up front, in parallel, so that large maps are not
+ * read back to back. the output is then formatted from the copies,
+ * in the usual order. */
+static void map_snap_all(struct map_snap *snaps, int n_snaps)
+{
+	struct map_snap_worker w[MAP_SNAP_WORKERS];
+	int i, n, next = 0;
+
+	/* computed on first use, which must not race */
+	map_ncpus();
+
+	n = n_snaps - 1;
+	if (n > MAP_SNAP_WORKERS)
+		n = MAP_SNAP_WORKERS;
+
+	for (i = 0; i < n; i++) {
+		w[i] = (struct map_snap_worker) {
+			.snaps = snaps, .n_snaps = n_snaps, .next = &next };
+
+		if (pthread_create(&w[i].tid, NULL, map_snap_worker, &w[i])) {
+			_eno("unable to start map reader");
+			break;
+		}
+	}
+
+	/* always pitch in, this also covers the case where no worker
+	 * could be started. */
+	map_snap_worker(&(struct map_snap_worker) {
+			.snaps = snaps, .n_snaps = n_snaps, .next = &next });
+
+	for (n = i, i = 0; i < n; i++)
+		pthread_join(w[i].tid, NULL);
+}
+
+static void map_snap_dump(struct map_snap *ms)
+{
+	struct sym_map_data *md = ms->md;
+
+	if (!md->dbuf) {
+		dump_map_data(stdout, md->map, ms->data, ms->n);
+		free(ms->data);
+		return;
+	}
+
+	/* takes ownership of the data */
+	map_dump_dbuf(stdout, md->map, ms->data, ms->n);
+
+	free(md->acc);
+	md->acc = NULL;
+	md->acc_n = 0;
+}
+
 int map_teardown(node_t *script)
 {
-	sym_t *s;
+	struct map_snap *snaps = NULL;
+	int i, n_snaps = 0;
+	sym_t *s, *drops;
 
 	if (G.dump)
 		return 0;
 
+	drops = symtable_get_drops(script->dyn->script.st);
+
+	/* a pinned session keeps its data around for the readers, the
+	 * maps are only closed. */
 	sym_foreach(s, script->dyn->script.st->syms) {
-		if (s->type != TYPE_MAP || s->map->fd == -1)
+		if (G.pin || s->type != TYPE_MAP || s->map->fd == -1 ||
+		    s == drops || (!s->map->dbuf && s->name[0] != '@'))
+			continue;
+
+		/* maps referenced from multiple probes share data */
+		for (i = 0; i < n_snaps && snaps[i].md != s->map; i++);
+		if (i < n_snaps)
+			continue;
+
+		snaps = realloc(snaps, (n_snaps + 1) * sizeof(*snaps));
+		assert(snaps);
+		snaps[n_snaps++] = (struct map_snap) { .md = s->map };
+	}
+
+	if (n_snaps)
+		map_snap_all(snaps, n_snaps);
+
+	for (i = 0; i < n_snaps; i++)
+		map_snap_dump(&snaps[i]);
+
+	free(snaps);
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type != TYPE_MAP || s->map->fd == -1 || s == drops)
 			continue;
 
-		if (s->name[0] == '@')
-			dump_map(s->map->map);
+		if (s->map->fd_alt >= 0)
+			close(s->map->fd_alt);
+		s->map->fd_alt = -1;
 
 		close(s->map->fd);
 		s->map->fd = -1;
 	}
 
+	stacks_drop();
+
+	if (drops && drops->map->fd >= 0) {
+		if (!G.pin)
+			map_dump_drops(script);
+
+		close(drops->map->fd);
+		drops->map->fd = -1;
+	}
+
+	return 0;
+}
+
+/* bpffs does not allow dots in names, so the second half of
+ * double-buffered maps go in a subdirectory instead. */
+#define MAP_PIN_ALT "alt/"
+
+static int map_pin_one(sym_t *s, const char *dir, const char *sub, int fd)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s%s", dir, sub, s->name);
+	if (!bpf_obj_pin(fd, path))
+		return 0;
+
+	/* maps referenced from multiple probes share the same fd,
+	 * the first sym to get there pins it. */
+	if (errno == EEXIST)
+		return 0;
+
+	_eno("unable to pin %s", path);
+	return -errno;
+}
+
+int map_pin(node_t *script, const char *dir)
+{
+	char path[PATH_MAX];
+	sym_t *s;
+	int err;
+
+	snprintf(path, sizeof(path), "%s/" MAP_PIN_ALT, dir);
+	if (G.interval && mkdir(path, 0700)) {
+		_eno("unable to create %s", path);
+		return -errno;
+	}
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type != TYPE_MAP || s->map->fd == -1)
+			continue;
+
+		err = map_pin_one(s, dir, "", s->map->fd);
+		if (!err && s->map->dbuf)
+			err = map_pin_one(s, dir, MAP_PIN_ALT, s->map->fd_alt);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static int map_get_one(sym_t *s, const char *dir, const char *sub)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s%s", dir, sub, s->name);
+	fd = bpf_obj_get(path);
+	if (fd < 0)
+		_eno("unable to open %s", path);
+
+	return fd;
+}
+
+int map_open_pinned(node_t *script, const char *dir)
+{
+	sym_t *s, *ctrl;
+	uint32_t key = 0;
+
+	sym_foreach(s, script->dyn->script.st->syms) {
+		if (s->type != TYPE_MAP || s->map->fd >= 0)
+			continue;
+
+		s->map->fd = map_get_one(s, dir, "");
+		if (s->map->fd < 0)
+			return -errno;
+
+		if (!s->map->dbuf)
+			continue;
+
+		s->map->fd_alt = map_get_one(s, dir, MAP_PIN_ALT);
+		if (s->map->fd_alt < 0)
+			return -errno;
+	}
+
+	/* pick up where the previous reader left off */
+	ctrl = symtable_get_ctrl(script->dyn->script.st);
+	if (ctrl)
+		bpf_map_lookup(ctrl->map->fd, &key, &active);
+
 	return 0;
 }
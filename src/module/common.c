@@ -23,6 +23,7 @@
 #include <string.h>
 
 #include <ply/ast.h>
+#include <ply/bpf-syscall.h>
 #include <ply/module.h>
 #include <ply/ply.h>
 
@@ -34,6 +35,15 @@
 		.compile    = common_ ## _name ## _compile,	\
 	}
 
+#define COMMON_PURE_FUNC(_name)					\
+	static const func_t common_ ## _name ## _func = {	\
+		.name       = #_name,				\
+		.annotate   = int_noargs_annotate,		\
+		.loc_assign = default_loc_assign,		\
+		.compile    = common_ ## _name ## _compile,	\
+		.pure       = 1,				\
+	}
+
 static int int_noargs_annotate(node_t *call)
 {
 	if (call->call.vargs)
@@ -78,28 +88,28 @@ static int common_gid_compile(node_t *call, prog_t *prog)
 	return int32_void_func(BPF_FUNC_get_current_uid_gid,
 			       EXTRACT_OP_SHIFT, call, prog);
 }
-COMMON_SIMPLE_FUNC(gid);
+COMMON_PURE_FUNC(gid);
 
 static int common_uid_compile(node_t *call, prog_t *prog)
 {
 	return int32_void_func(BPF_FUNC_get_current_uid_gid,
 			       EXTRACT_OP_MASK, call, prog);
 }
-COMMON_SIMPLE_FUNC(uid);
+COMMON_PURE_FUNC(uid);
 
 static int common_pid_compile(node_t *call, prog_t *prog)
 {
 	return int32_void_func(BPF_FUNC_get_current_pid_tgid,
 			       EXTRACT_OP_SHIFT, call, prog);
 }
-COMMON_SIMPLE_FUNC(pid);
+COMMON_PURE_FUNC(pid);
 
 static int common_tid_compile(node_t *call, prog_t *prog)
 {
 	return int32_void_func(BPF_FUNC_get_current_pid_tgid,
 			       EXTRACT_OP_MASK, call, prog);
 }
-COMMON_SIMPLE_FUNC(tid);
+COMMON_PURE_FUNC(tid);
 
 static int common_nsecs_compile(node_t *call, prog_t *prog)
 {
@@ -120,7 +130,7 @@ static int common_cpu_compile(node_t *call, prog_t *prog)
 	return int32_void_func(BPF_FUNC_get_smp_processor_id,
 			       EXTRACT_OP_NONE, call, prog);
 }
-COMMON_SIMPLE_FUNC(cpu);
+COMMON_PURE_FUNC(cpu);
 
 
 static int common_comm_compile(node_t *call, prog_t *prog)
@@ -143,7 +153,7 @@ static int common_comm_annotate(node_t *call)
 	call->dyn->size = 16;
 	return 0;
 }
-MODULE_FUNC(common, comm);
+MODULE_FUNC_PURE(common, comm);
 MODULE_FUNC_ALIAS(common, execname, comm);
 
 
@@ -176,6 +186,193 @@ static int common_log2_annotate(node_t *call)
 MODULE_FUNC(common, log2);
 
 
+static int common_lbucket_compile(node_t *call, prog_t *prog)
+{
+	node_t *num = call->call.vargs;
+	node_t *min = num->next, *max = min->next, *step = max->next;
+	int src, dst;
+
+	src = (num->dyn->loc == LOC_REG) ? num->dyn->reg : BPF_REG_0;
+	emit_xfer_dyn(prog, &dyn_reg[src], num);
+
+	dst = (call->dyn->loc == LOC_REG) ? call->dyn->reg : BPF_REG_1;
+
+	emit_lin_raw(prog, dst, src, min->integer, max->integer, step->integer);
+
+	return emit_xfer_dyns(prog, call->dyn, &dyn_reg[dst]);
+}
+
+static int common_lbucket_loc_assign(node_t *call)
+{
+	node_t *varg;
+
+	/* range parameters are constants, baked into the program */
+	for (varg = call->call.vargs->next; varg; varg = varg->next)
+		varg->dyn->loc = LOC_VIRTUAL;
+
+	return default_loc_assign(call);
+}
+
+static int common_lbucket_annotate(node_t *call)
+{
+	node_t *num = call->call.vargs;
+	node_t *min, *max, *step;
+
+	if (!num || num->dyn->type != TYPE_INT ||
+	    !(min  = num->next) || min->type  != TYPE_INT ||
+	    !(max  = min->next) || max->type  != TYPE_INT ||
+	    !(step = max->next) || step->type != TYPE_INT ||
+	    step->next)
+		return -EINVAL;
+
+	if (min->integer < INT32_MIN || max->integer > INT32_MAX ||
+	    min->integer >= max->integer ||
+	    step->integer <= 0 || step->integer > max->integer - min->integer) {
+		_e("invalid linear range [%" PRId64 ", %" PRId64 "), "
+		   "step %" PRId64, min->integer, max->integer, step->integer);
+		return -EINVAL;
+	}
+
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+MODULE_FUNC_LOC(common, lbucket);
+
+
+static int common_llbucket_compile(node_t *call, prog_t *prog)
+{
+	node_t *num = call->call.vargs, *bits = num->next;
+	int src, dst;
+
+	src = (num->dyn->loc == LOC_REG) ? num->dyn->reg : BPF_REG_0;
+	emit_xfer_dyn(prog, &dyn_reg[src], num);
+
+	dst = (call->dyn->loc == LOC_REG) ? call->dyn->reg : BPF_REG_1;
+
+	emit_loglin_raw(prog, dst, src, bits->integer);
+
+	return emit_xfer_dyns(prog, call->dyn, &dyn_reg[dst]);
+}
+
+static int common_llbucket_loc_assign(node_t *call)
+{
+	call->call.vargs->next->dyn->loc = LOC_VIRTUAL;
+	return default_loc_assign(call);
+}
+
+static int common_llbucket_annotate(node_t *call)
+{
+	node_t *num = call->call.vargs, *bits;
+
+	if (!num || num->dyn->type != TYPE_INT ||
+	    !(bits = num->next) || bits->type != TYPE_INT ||
+	    bits->next)
+		return -EINVAL;
+
+	if (bits->integer < 0 || bits->integer > 6) {
+		_e("log-linear resolution must be between 0 and 6 bits");
+		return -EINVAL;
+	}
+
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+MODULE_FUNC_LOC(common, llbucket);
+
+
+/* the predicate is only ever tested against zero, so samples that are
+ * and:ed into it can be taken before anything else is evaluated. */
+static node_t *common_sample_probe(node_t *call)
+{
+	node_t *n;
+
+	for (n = call; n->parent->type == TYPE_BINOP &&
+		     n->parent->binop.op == OP_AND; n = n->parent);
+
+	if (n->parent->type == TYPE_PROBE && n->parent->probe.pred == n)
+		return n->parent;
+
+	return NULL;
+}
+
+static int common_sample_compile(node_t *call, prog_t *prog)
+{
+	node_t *rate = call->call.vargs;
+	int dst;
+
+	dst = (call->dyn->loc == LOC_REG) ? call->dyn->reg : BPF_REG_0;
+
+	if (common_sample_probe(call)) {
+		/* only reachable if the probe's sample was taken */
+		emit(prog, MOV_IMM(dst, 1));
+	} else {
+		emit_sample_raw(prog, rate->integer);
+		emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 2));
+		emit(prog, MOV_IMM(dst, 0));
+		emit(prog, JMP_IMM(BPF_JA, 0, 0, 1));
+		emit(prog, MOV_IMM(dst, 1));
+	}
+
+	return emit_xfer_dyns(prog, call->dyn, &dyn_reg[dst]);
+}
+
+static int common_sample_loc_assign(node_t *call)
+{
+	node_t *rate = call->call.vargs, *probe;
+	int64_t sample;
+
+	rate->dyn->loc = LOC_VIRTUAL;
+
+	probe = common_sample_probe(call);
+	if (probe) {
+		sample = probe->dyn->probe.sample ? : 1;
+		if (sample * rate->integer > INT32_MAX) {
+			_e("%s: combined sampling rate is too large",
+			   probe->string);
+			return -EINVAL;
+		}
+
+		probe->dyn->probe.sample = sample * rate->integer;
+	}
+
+	return default_loc_assign(call);
+}
+
+static int common_sample_annotate(node_t *call)
+{
+	node_t *rate = call->call.vargs;
+
+	if (!rate || rate->type != TYPE_INT || rate->next)
+		return -EINVAL;
+
+	if (rate->integer < 1 || rate->integer > INT32_MAX) {
+		_e("sampling rate must be between 1 and %d", INT32_MAX);
+		return -EINVAL;
+	}
+
+	call->dyn->type = TYPE_INT;
+	call->dyn->size = sizeof(int64_t);
+	return 0;
+}
+MODULE_FUNC_LOC(common, sample);
+
+
+static enum bpf_func_id common_mem_reader(node_t *call)
+{
+#ifdef LINUX_HAS_PROBE_READ_STR
+	/* stop at the terminating NUL, rather than copying the whole
+	 * buffer. a plain probe_read also fails outright if the
+	 * buffer extends into an unmapped page, which short strings
+	 * near the end of one often do. the rest of the slot is still
+	 * zeroed, so that equal strings make equal keys. */
+	if (call->dyn->type == TYPE_STR)
+		return BPF_FUNC_probe_read_str;
+#endif
+	return BPF_FUNC_probe_read;
+}
+
 static int common_mem_compile(node_t *call, prog_t *prog)
 {
 	node_t *addr = call->call.vargs;
@@ -186,7 +383,7 @@ static int common_mem_compile(node_t *call, prog_t *prog)
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_1, call->dyn->addr));
 	emit(prog, MOV_IMM(BPF_REG_2, call->dyn->size));
 	emit_xfer_dyn(prog, &dyn_reg[BPF_REG_3], addr);
-	emit(prog, CALL(BPF_FUNC_probe_read));
+	emit(prog, CALL(common_mem_reader(call)));
 
 	if (call->dyn->loc == LOC_REG) {
 		dyn_t src;
@@ -210,7 +407,7 @@ static int common_mem_loc_assign(node_t *call)
 	if (call->dyn->loc == LOC_REG) {
 		probe = node_get_probe(call);
 
-		call->dyn->addr = node_probe_stack_get(probe, call->dyn->size);
+		call->dyn->addr = node_probe_stack_get(probe, call, call->dyn->size);
 	}
 
 	return default_loc_assign(call);
@@ -372,11 +569,6 @@ static int common_sizeof_annotate(node_t *call)
 	/* rewrite sizeof(fmt)
 	 * into    <int> */
 
-	node_free(arg);
-	free(call->string);
-	if (call->call.module)
-		free(call->call.module);
-
 	call->type = TYPE_INT;
 	call->integer = size;
 
@@ -447,6 +639,9 @@ static const func_t *common_funcs[] = {
 	&common_comm_func,
 	&common_execname_func,
 	&common_log2_func,
+	&common_lbucket_func,
+	&common_llbucket_func,
+	&common_sample_func,
 	&common_mem_func,
 	&common_sizeof_func,
 	&common_strcmp_func,
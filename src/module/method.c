@@ -26,15 +26,13 @@
 #include <ply/map.h>
 #include <ply/module.h>
 #include <ply/ply.h>
+#include <ply/symtable.h>
 
 static int method_count_compile(node_t *call, prog_t *prog)
 {
 	node_t *map = call->parent->method.map;
 
-	emit(prog, LDXDW(BPF_REG_0, map->dyn->addr, BPF_REG_10));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_0, 1));
-	emit(prog, STXDW(BPF_REG_10, map->dyn->addr, BPF_REG_0));
-	return 0;
+	return emit_map_add(prog, map, 1);
 }
 
 static int method_count_cmp(node_t *map, const void *ak, const void *bk)
@@ -57,6 +55,7 @@ static int method_count_loc_assign(node_t *call)
 	node_t *map = call->parent->method.map;
 
 	map->dyn->map.cmp = method_count_cmp;
+	sym_from_node(map)->map->aggregated = 1;
 	return default_loc_assign(call);
 }
 
@@ -74,10 +73,14 @@ static int method_count_annotate(node_t *call)
 MODULE_FUNC_LOC(method, count);
 
 extern const func_t quantize_func;
+extern const func_t lquantize_func;
+extern const func_t llquantize_func;
 
 static const func_t *method_funcs[] = {
 	&method_count_func,
 	&quantize_func,
+	&lquantize_func,
+	&llquantize_func,
 	NULL
 };
 
@@ -44,7 +44,7 @@ int default_loc_assign(node_t *call)
 		case TYPE_REC:
 		case TYPE_STR:
 			varg->dyn->loc  = LOC_STACK;
-			varg->dyn->addr = node_probe_stack_get(probe, varg->dyn->size);
+			varg->dyn->addr = node_probe_stack_get(probe, varg, varg->dyn->size);
 			continue;
 
 
@@ -30,6 +30,7 @@
 #include <ply/map.h>
 #include <ply/module.h>
 #include <ply/ply.h>
+#include <ply/record.h>
 
 static void printf_num(const char *fmt, const char *term, int64_t num)
 {
@@ -101,11 +102,31 @@ static void printf_spec(const char *spec, const char *term, void *data,
 	free(fmt);
 }
 
-static int printf_event(event_t *ev, void *_call)
+/* the record lives on the BPF stack, so it is never larger than
+ * this. */
+#define PRINTF_REC_MAX 0x200
+
+int printf_event(event_t *ev, void *_call)
 {
 	node_t *arg, *call = _call;
 	char *fmt, *spec;
 	void *data = ev->data;
+	uint8_t buf[PRINTF_REC_MAX];
+	size_t len, size = 0;
+
+	node_foreach(arg, call->call.vargs->next->rec.vargs->next)
+		size += arg->dyn->size;
+
+	/* zero words at the end of the record might not have been
+	 * sent, put them back. the kernel pads the event to a word
+	 * boundary, with whatever happened to be there. */
+	len = ev->size - sizeof(ev->type);
+	if (len < size && size <= sizeof(buf)) {
+		len &= ~7;
+		memcpy(buf, ev->data, len);
+		memset(buf + len, 0, size - len);
+		data = buf;
+	}
 
 	arg  = call->call.vargs->next->rec.vargs->next;
 	for (fmt = call->call.vargs->string; *fmt; fmt++) {
@@ -126,11 +147,65 @@ static int printf_event(event_t *ev, void *_call)
 	return 0;
 }
 
+/* strings are zero padded, usually by a lot. if the record ends
+ * with one, only send it up to its last non-zero word. */
+static void printf_emit_size(prog_t *prog, node_t *rec, int reg)
+{
+	node_t *last;
+	ssize_t base, w;
+
+	for (last = rec->rec.vargs; last->next; last = last->next);
+
+	base = rec->dyn->size - last->dyn->size;
+	if (last == rec->rec.vargs || last->dyn->type != TYPE_STR ||
+	    last->dyn->size <= 8 || (base & 7) || (last->dyn->size & 7)) {
+		emit(prog, MOV_IMM(reg, rec->dyn->size));
+		return;
+	}
+
+	emit(prog, MOV_IMM(reg, base));
+	for (w = 0; w < (ssize_t)last->dyn->size; w += 8) {
+		emit(prog, LDXDW(BPF_REG_0, rec->dyn->addr + base + w, BPF_REG_10));
+		emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 1));
+		emit(prog, MOV_IMM(reg, base + w + 8));
+	}
+}
+
+#ifdef LINUX_HAS_RINGBUF
+static int printf_compile_ring(node_t *call, prog_t *prog, evpipe_t *evp)
+{
+	node_t *rec = call->call.vargs->next;
+
+	emit_ld_mapfd(prog, BPF_REG_1, evp->mapfd);
+
+	emit(prog, MOV(BPF_REG_2, BPF_REG_10));
+	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_2, rec->dyn->addr));
+
+	printf_emit_size(prog, rec, BPF_REG_3);
+
+	/* when batching, the reader polls the ring on its own */
+	emit(prog, MOV_IMM(BPF_REG_4, G.wakeup ? BPF_RB_NO_WAKEUP : 0));
+	emit(prog, CALL(BPF_FUNC_ringbuf_output));
+
+	/* ring is full, count the drop */
+	emit(prog, JMP_IMM(BPF_JEQ, BPF_REG_0, 0, 4));
+	emit_ld_mapval(prog, BPF_REG_1, evp->ring->dropfd, 0);
+	emit(prog, MOV_IMM(BPF_REG_2, 1));
+	emit(prog, XADDDW(BPF_REG_1, 0, BPF_REG_2));
+	return 0;
+}
+#endif
+
 int printf_compile(node_t *call, prog_t *prog)
 {
 	node_t *script = node_get_script(call);
 	node_t *rec = call->call.vargs->next;
 
+#ifdef LINUX_HAS_RINGBUF
+	if (script->dyn->script.evp->ring)
+		return printf_compile_ring(call, prog, script->dyn->script.evp);
+#endif
+
 	emit(prog, CALL(BPF_FUNC_get_smp_processor_id));
 	emit(prog, MOV(BPF_REG_3, BPF_REG_0));
 
@@ -140,7 +215,7 @@ int printf_compile(node_t *call, prog_t *prog)
 	emit(prog, MOV(BPF_REG_4, BPF_REG_10));
 	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_4, rec->dyn->addr));
 
-	emit(prog, MOV_IMM(BPF_REG_5, rec->dyn->size));
+	printf_emit_size(prog, rec, BPF_REG_5);
 	emit(prog, CALL(BPF_FUNC_perf_event_output));
 	return 0;
 }
@@ -157,7 +232,7 @@ int printf_loc_assign(node_t *call)
 
 	/* rec_max_size  = printf_rec_size(probe->parent); */
 	rec->dyn->loc  = LOC_STACK;
-	rec->dyn->addr = node_probe_stack_get(probe, rec->dyn->size);//_max_size);
+	rec->dyn->addr = node_probe_stack_get(probe, rec, rec->dyn->size);//_max_size);
 	return 0;
 }
 
@@ -184,6 +259,9 @@ int printf_annotate(node_t *call)
 	evh->handle = printf_event;
 	evhandler_register(evh);
 
+	if (G.record)
+		record_register(call, evh);
+
 	/* rewrite printf("a:%d b:%d", a(), b())
          *    into printf("a:%d b:%d", [event_type, a(), b()])
 	 */
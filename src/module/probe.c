@@ -32,42 +32,27 @@
 #include <ply/ply.h>
 #include <ply/symtable.h>
 
+/* the context is the register file of the probed task, which the
+ * program may read directly. */
 static int probe_reg_compile(node_t *call, prog_t *prog)
 {
 	node_t *arg = call->call.vargs;
+	int dst, width;
 
-	emit_stack_zero(prog, call);
+	dst = (call->dyn->loc == LOC_REG) ? call->dyn->reg : BPF_REG_0;
+	width = (arch_reg_width() == sizeof(uint32_t)) ? BPF_W : BPF_DW;
 
-	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_1, call->dyn->addr));
-	emit(prog, MOV_IMM(BPF_REG_2, arch_reg_width()));
-	emit(prog, MOV(BPF_REG_3, BPF_REG_9));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_3, sizeof(uintptr_t)*arg->integer));
-	emit(prog, CALL(BPF_FUNC_probe_read));
+	emit(prog, INSN(BPF_LDX | BPF_SIZE(width) | BPF_MEM, dst, BPF_REG_9,
+			sizeof(uintptr_t) * arg->integer, 0));
 
-	if (call->dyn->loc == LOC_REG) {
-		dyn_t src;
-
-		src = *call->dyn;
-		src.loc = LOC_STACK;
-		return emit_xfer_dyns(prog, call->dyn, &src);
-	}
+	if (call->dyn->loc == LOC_STACK)
+		emit(prog, STXDW(BPF_REG_10, call->dyn->addr, dst));
 
 	return 0;
 }
 
 static int probe_reg_loc_assign(node_t *call)
 {
-	node_t *probe;
-
-	/* if the result is going to a register, allocate space on the
-	 * stack as a temporary location to probe_read to. */
-	if (call->dyn->loc == LOC_REG) {
-		probe = node_get_probe(call);
-
-		call->dyn->addr = node_probe_stack_get(probe, call->dyn->size);
-	}
-
 	call->call.vargs->dyn->loc = LOC_VIRTUAL;
 	return 0;
 }
@@ -96,7 +81,7 @@ static int probe_reg_annotate(node_t *call)
 	call->dyn->size = sizeof(int64_t);
 	return 0;
 }
-MODULE_FUNC_LOC(probe, reg);
+MODULE_FUNC_LOC_PURE(probe, reg);
 
 
 static int probe_func_compile(node_t *call, prog_t *prog)
@@ -129,7 +114,7 @@ static int probe_func_annotate(node_t *call)
 	call->dump = dump_sym;
 	return 0;
 }
-MODULE_FUNC_LOC(probe, func);
+MODULE_FUNC_LOC_PURE(probe, func);
 MODULE_FUNC_ALIAS(probe, probefunc, func);
 
 #ifdef LINUX_HAS_STACKMAP
@@ -204,7 +189,7 @@ static int kprobe_arg_annotate(node_t *call)
 	call->dyn->size = sizeof(int64_t);
 	return 0;
 }
-MODULE_FUNC_LOC(kprobe, arg);
+MODULE_FUNC_LOC_PURE(kprobe, arg);
 
 
 static int kretprobe_retval_compile(node_t *call, prog_t *prog)
@@ -236,7 +221,7 @@ static int kretprobe_retval_annotate(node_t *call)
 	call->dump = dump_sym;
 	return 0;
 }
-MODULE_FUNC_LOC(kretprobe, retval);
+MODULE_FUNC_LOC_PURE(kretprobe, retval);
 
 
 static const func_t *kprobe_funcs[] = {
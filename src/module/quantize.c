@@ -25,15 +25,13 @@
 #include <ply/module.h>
 #include <ply/ply.h>
 #include <ply/pvdr.h>
+#include <ply/symtable.h>
 
 int quantize_compile(node_t *call, prog_t *prog)
 {
 	node_t *map = call->parent->method.map;
 
-	emit(prog, LDXDW(BPF_REG_0, map->dyn->addr, BPF_REG_10));
-	emit(prog, ALU_IMM(BPF_ADD, BPF_REG_0, 1));
-	emit(prog, STXDW(BPF_REG_10, map->dyn->addr, BPF_REG_0));
-	return 0;
+	return emit_map_add(prog, map, 1);
 }
 
 static int quantize_normalize(int log2, char const **suffix)
@@ -83,7 +81,9 @@ static void quantize_dump_bar_ascii(FILE *fp, int64_t count, int64_t max)
 	fputc('|', fp);
 }
 
-static void quantize_dump_one(FILE *fp, int log2, int64_t count, int64_t max)
+typedef void (*hist_label_t)(FILE *fp, node_t *bucket, int64_t idx);
+
+static void quantize_label(FILE *fp, node_t *bucket, int64_t log2)
 {
 	int lo, hi;
 	const char *ls, *hs;
@@ -110,53 +110,134 @@ static void quantize_dump_one(FILE *fp, int log2, int64_t count, int64_t max)
 				ls ? 3 : 4, lo, ls ? : "",
 				hs ? 3 : 4, hi, hs ? : "");
 	}
+}
+
+static void lquantize_label(FILE *fp, node_t *bucket, int64_t idx)
+{
+	node_t *min = bucket->call.vargs->next;
+	int64_t lo = min->integer, hi = min->next->integer;
+	int64_t step = min->next->next->integer;
+	int64_t n = (hi - lo + step - 1) / step;
+	char bound[0x20];
+
+	if (idx <= 0 || idx > n) {
+		snprintf(bound, sizeof(bound), "%s %" PRId64,
+			 idx <= 0 ? "<" : ">=", idx <= 0 ? lo : hi);
+		fprintf(fp, "\t%20s", bound);
+		return;
+	}
+
+	lo += (idx - 1) * step;
+	fprintf(fp, "\t[%8" PRId64 ", %8" PRId64 ")", lo,
+		(lo + step < hi) ? lo + step : hi);
+}
+
+static void llquantize_label(FILE *fp, node_t *bucket, int64_t idx)
+{
+	int bits = bucket->call.vargs->next->integer;
+	int64_t g, lo;
+
+	if (idx < 0) {
+		fprintf(fp, "\t%20s", "< 0");
+		return;
+	} else if (idx < (1 << bits)) {
+		fprintf(fp, "\t%20" PRId64, idx);
+		return;
+	}
+
+	/* the upper bits of the index hold the magnitude, the lower
+	 * ones the linear sub-bucket within it. */
+	g  = idx >> bits;
+	lo = (((int64_t)1 << bits) + (idx & ((1 << bits) - 1))) << (g - 1);
+	fprintf(fp, "\t[%8" PRId64 ", %8" PRId64 ")",
+		lo, lo + ((int64_t)1 << (g - 1)));
+}
+
+static const struct {
+	int permille;
+	const char *name;
+} hist_pctls[] = {
+	{ 500, "p50"  },
+	{ 990, "p99"  },
+	{ 999, "p999" },
+};
+
+static void hist_dump_one(FILE *fp, hist_label_t label, node_t *bucket,
+			  int64_t idx, int64_t count, int64_t max,
+			  int64_t *cum, int64_t total)
+{
+	int64_t thresh;
+	size_t i, n = sizeof(hist_pctls) / sizeof(hist_pctls[0]);
+
+	label(fp, bucket, idx);
 
 	fprintf(fp, "\t%8" PRId64" ", count);
 	if (G.ascii)
 		quantize_dump_bar_ascii(fp, count, max);
 	else
 		quantize_dump_bar(fp, count, max);
+
+	/* mark the bucket in which each percentile falls */
+	for (i = 0; count && i < n; i++) {
+		thresh = (total * hist_pctls[i].permille + 999) / 1000;
+		if (*cum < thresh && thresh <= *cum + count)
+			fprintf(fp, " %s", hist_pctls[i].name);
+	}
+
+	*cum += count;
 	fputc('\n', fp);
 }
 
-static void quantize_dump_seg(FILE *fp, node_t *map,
-			      void *data, int len, int64_t max)
+static void hist_dump_seg(FILE *fp, node_t *map, void *data, int len,
+			  int64_t max, hist_label_t label)
 {
-	node_t *rec = map->map.rec;
+	node_t *rec = map->map.rec, *bucket;
 	size_t entry_size = rec->dyn->size + map->dyn->size;
 	size_t rec_size = rec->dyn->size - sizeof(int64_t);
-	char *key = data;
-	int64_t *log2 = data + rec_size, *count = data + rec->dyn->size;
+	int64_t *idx = data + rec_size, *count = data + rec->dyn->size;
+	int64_t total = 0, cum = 0;
+	int i;
+
+	for (bucket = rec->rec.vargs; bucket->next; bucket = bucket->next);
+
+	for (i = 0; i < len; i++)
+		total += *(int64_t *)(data + rec->dyn->size + i * entry_size);
 
 	dump_rec(fp, rec, data, rec->rec.n_vargs - 1);
 	fputc('\n', fp);
 
 	for (; len > 1; len--) {
-		int last_log2 = *log2 + 1;
+		int64_t last_idx = *idx + 1;
 
-		quantize_dump_one(fp, *log2, *count, max);
+		hist_dump_one(fp, label, bucket, *idx, *count, max,
+			      &cum, total);
 
-		key += entry_size;
-		log2 = (void *)log2 + entry_size;
+		idx = (void *)idx + entry_size;
 		count = (void *)count + entry_size;
 
-		for (; last_log2 < *log2; last_log2++)
-			quantize_dump_one(fp, last_log2, 0, max);
+		for (; last_idx < *idx; last_idx++)
+			hist_dump_one(fp, label, bucket, last_idx, 0, max,
+				      &cum, total);
 	}
 
-	quantize_dump_one(fp, *log2, *count, max);
+	hist_dump_one(fp, label, bucket, *idx, *count, max, &cum, total);
 }
 
-static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
+static void hist_dump(FILE *fp, node_t *map, void *data, int len,
+		      hist_label_t label)
 {
 	node_t *rec = map->map.rec;
 	size_t entry_size = rec->dyn->size + map->dyn->size;
 	size_t rec_size = rec->dyn->size - sizeof(int64_t);
 	char *key = data, *seg_start = data;
 	int64_t *count = data + rec->dyn->size;
-	int64_t seg_max = *count;
+	int64_t seg_max;
 	int seg_len = 1;
 
+	if (!len)
+		return;
+
+	seg_max = *count;
 	for (; len > 1; len--) {
 		key += entry_size;
 		count = (void *)count + entry_size;
@@ -165,48 +246,75 @@ static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
 			seg_max = (*count > seg_max) ? *count : seg_max;
 			seg_len++;
 		} else {
-			quantize_dump_seg(fp, map, seg_start, seg_len, seg_max);
+			hist_dump_seg(fp, map, seg_start, seg_len, seg_max,
+				      label);
 			seg_max = *count;
 			seg_len = 1;
 			seg_start = key;
 		}
 	}
 
-	quantize_dump_seg(fp, map, seg_start, seg_len, seg_max);
+	hist_dump_seg(fp, map, seg_start, seg_len, seg_max, label);
 }
 
-int quantize_loc_assign(node_t *call)
+static void quantize_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, data, len, quantize_label);
+}
+
+static void lquantize_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, data, len, lquantize_label);
+}
+
+static void llquantize_dump(FILE *fp, node_t *map, void *data, int len)
+{
+	hist_dump(fp, map, data, len, llquantize_label);
+}
+
+static int hist_loc_assign(node_t *call,
+			   void (*dump)(FILE *, node_t *, void *, int))
 {
 	node_t *map = call->parent->method.map;
 
-	map->dyn->map.dump = quantize_dump;
+	map->dyn->map.dump = dump;
+	sym_from_node(map)->map->aggregated = 1;
 	return default_loc_assign(call);
 }
 
-int quantize_annotate(node_t *call)
+int quantize_loc_assign(node_t *call)
+{
+	return hist_loc_assign(call, quantize_dump);
+}
+
+int lquantize_loc_assign(node_t *call)
+{
+	return hist_loc_assign(call, lquantize_dump);
+}
+
+int llquantize_loc_assign(node_t *call)
+{
+	return hist_loc_assign(call, llquantize_dump);
+}
+
+/* rewrite @map[c1, c2].quantize(some_int)
+ * into    @map[c1, c2, common.log2(some_int)].quantize()
+ *
+ * This means we only have to retrieve one bucket (8 bytes) to do an
+ * update. Storing all buckets in the value would require loading
+ * 65*8=520 bytes per update. The linear and log-linear variants work
+ * the same way, using a different function to compute the bucket.
+ */
+static int hist_annotate(node_t *call, const char *bucket_func)
 {
 	pvdr_t *pvdr = node_get_probe(call)->dyn->probe.pvdr;
 	node_t *map = call->parent->method.map;
 	node_t *c;
 	int err;
 
-	if (!call->call.vargs ||
-	    (call->call.vargs->dyn->type != TYPE_NONE &&
-	     call->call.vargs->dyn->type != TYPE_INT) ||
-	    call->call.vargs->next ||
-	    call->parent->type != TYPE_METHOD)
-		return -EINVAL;
-
 	for (c = map->map.rec->rec.vargs; c->next; c = c->next);
 
-	/* rewrite @map[c1, c2].quantize(some_int)
-	 * into    @map[c1, c2, common.log2(some_int)].quantize()
-	 *
-	 * This means we only have to retrieve one bucket (8 bytes) to
-	 * do an update. Storing all buckets in the value would
-	 * require loading 65*8=520 bytes per update.
-	 */
-	c->next = node_call_new(strdup("common"), strdup("log2"),
+	c->next = node_call_new(node_strdup("common"), node_strdup(bucket_func),
 				call->call.vargs);
 	c->next->parent = map->map.rec;
 
@@ -228,6 +336,49 @@ int quantize_annotate(node_t *call)
 	return 0;
 }
 
+static int hist_annotate_check(node_t *call)
+{
+	return !call->call.vargs ||
+		(call->call.vargs->dyn->type != TYPE_NONE &&
+		 call->call.vargs->dyn->type != TYPE_INT) ||
+		call->parent->type != TYPE_METHOD;
+}
+
+int quantize_annotate(node_t *call)
+{
+	if (hist_annotate_check(call) || call->call.vargs->next)
+		return -EINVAL;
+
+	return hist_annotate(call, "log2");
+}
+
+int lquantize_annotate(node_t *call)
+{
+	if (hist_annotate_check(call))
+		return -EINVAL;
+
+	return hist_annotate(call, "lbucket");
+}
+
+int llquantize_annotate(node_t *call)
+{
+	node_t *bits;
+
+	if (hist_annotate_check(call))
+		return -EINVAL;
+
+	/* default to 8 linear sub-buckets per power of two, i.e. a
+	 * relative error of at most 12.5% */
+	if (!call->call.vargs->next) {
+		bits = node_int_new(3);
+		bits->dyn->type = TYPE_INT;
+		bits->dyn->size = sizeof(int64_t);
+		insque_tail(bits, call->call.vargs);
+	}
+
+	return hist_annotate(call, "llbucket");
+}
+
 const func_t quantize_func = {
 	.name = "quantize",
 
@@ -235,3 +386,19 @@ const func_t quantize_func = {
 	.loc_assign = quantize_loc_assign,
 	.annotate = quantize_annotate,
 };
+
+const func_t lquantize_func = {
+	.name = "lquantize",
+
+	.compile = quantize_compile,
+	.loc_assign = lquantize_loc_assign,
+	.annotate = lquantize_annotate,
+};
+
+const func_t llquantize_func = {
+	.name = "llquantize",
+
+	.compile = quantize_compile,
+	.loc_assign = llquantize_loc_assign,
+	.annotate = llquantize_annotate,
+};
@@ -39,6 +39,94 @@ struct trace_field {
 	size_t sign;
 };
 
+/* the tracepoint context is readable by the program itself, so
+ * fields that fit in a register, and short strings, are loaded
+ * directly from it. the kernel hides the common fields in the first
+ * word and only allows naturally aligned accesses, everything else
+ * goes through probe_read. */
+#define TRACE_FIELD_DIRECT_MAX 32
+
+static int trace_field_direct(struct trace_field *tf)
+{
+	size_t membsz = (tf->size / tf->nmemb);
+
+	if (tf->offset < sizeof(uint64_t))
+		return 0;
+
+	if (tf->type == TYPE_STR)
+		return tf->size <= TRACE_FIELD_DIRECT_MAX;
+
+	switch (membsz) {
+	case 1:
+	case 2:
+	case 4:
+	case 8:
+		return !(tf->offset & (membsz - 1));
+	}
+
+	return 0;
+}
+
+static int trace_field_width(size_t size)
+{
+	switch (size) {
+	case 1:
+		return BPF_B;
+	case 2:
+		return BPF_H;
+	case 4:
+		return BPF_W;
+	}
+
+	return BPF_DW;
+}
+
+static void trace_field_copy(prog_t *prog, ssize_t to,
+			     size_t from, size_t size)
+{
+	size_t off, width;
+
+	for (off = 0; off < size; off += width) {
+		/* widest access that is naturally aligned in the
+		 * context and fits in what is left. */
+		for (width = 8; width > 1; width >>= 1)
+			if (width <= size - off && !((from + off) & (width - 1)))
+				break;
+
+		emit(prog, INSN(BPF_LDX | BPF_SIZE(trace_field_width(width)) | BPF_MEM,
+				BPF_REG_0, BPF_REG_9, from + off, 0));
+		emit(prog, INSN(BPF_STX | BPF_SIZE(trace_field_width(width)) | BPF_MEM,
+				BPF_REG_10, BPF_REG_0, to + off, 0));
+	}
+}
+
+static int trace_field_load(node_t *call, prog_t *prog,
+			    struct trace_field *tf, size_t offset)
+{
+	size_t membsz = (tf->size / tf->nmemb);
+	int dst;
+
+	if (tf->type == TYPE_STR) {
+		trace_field_copy(prog, call->dyn->addr, offset, tf->size);
+		return 0;
+	}
+
+	dst = (call->dyn->loc == LOC_REG) ? call->dyn->reg : BPF_REG_0;
+
+	emit(prog, INSN(BPF_LDX | BPF_SIZE(trace_field_width(membsz)) | BPF_MEM,
+			dst, BPF_REG_9, offset, 0));
+
+	if (tf->sign && membsz < 8) {
+		emit(prog, ALU_IMM(BPF_LSH, dst, (8 - membsz) << 3));
+		emit(prog, ALU_IMM(BPF_ARSH, dst, (8 - membsz) << 3));
+	}
+
+	if (call->dyn->loc == LOC_STACK)
+		emit(prog, STXDW(BPF_REG_10, call->dyn->addr, dst));
+
+	return 0;
+}
+
 static int trace_field_compile(node_t *call, prog_t *prog)
 {
 	struct trace_field *tf = call->dyn->call.func->priv;
@@ -48,6 +136,9 @@ static int trace_field_compile(node_t *call, prog_t *prog)
 	if (call->call.vargs)
 		offset += membsz * call->call.vargs->integer;
 
+	if (trace_field_direct(tf))
+		return trace_field_load(call, prog, tf, offset);
+
 	emit_stack_zero(prog, call);
 
 	emit(prog, MOV(BPF_REG_1, BPF_REG_10));
@@ -70,12 +161,13 @@ static int trace_field_compile(node_t *call, prog_t *prog)
 
 static int trace_field_loc_assign(node_t *call)
 {
+	struct trace_field *tf = call->dyn->call.func->priv;
 	node_t *probe = node_get_probe(call);
 
 	/* upper node wants result in a register, but we still
 	 * need stack space to bounce the data in */
-	if (call->dyn->loc == LOC_REG)
-		call->dyn->addr = node_probe_stack_get(probe, call->dyn->size);
+	if (call->dyn->loc == LOC_REG && !trace_field_direct(tf))
+		call->dyn->addr = node_probe_stack_get(probe, call, call->dyn->size);
 
 	return 0;
 }
@@ -91,6 +183,9 @@ static int trace_field_annotate(node_t *call)
 	    (tf->nmemb != 1 && (!arg || arg->next || arg->type != TYPE_INT)))
 	    return -EINVAL;
 
+	if (arg && (arg->integer < 0 || (size_t)arg->integer >= tf->nmemb))
+		return -EINVAL;
+
 	call->dyn->type = tf->type;
 
 	if (tf->type == TYPE_STR)
@@ -217,6 +312,7 @@ int trace_get_func(const module_t *m, node_t *call, const func_t **out)
 	f->annotate   = trace_field_annotate;
 	f->loc_assign = trace_field_loc_assign;
 	f->compile    = trace_field_compile;
+	f->pure       = 1;
 	*out = f;
 	return 0;
 }
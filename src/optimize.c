@@ -0,0 +1,1081 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <ply/ply.h>
+#include <ply/compile.h>
+
+/* the code generator is a straight tree walk, so its output is full
+ * of values that are shuffled through the stack, booleans that are
+ * materialized only to be tested once, and literals that could have
+ * been folded. this pass cleans up after it. every sub-pass only
+ * marks instructions for removal or rewrites them in place, the
+ * program is then compacted and the jump offsets fixed up before
+ * the next one runs. */
+
+#define OPT_MAX_ROUNDS 16
+#define OPT_MAX_HOPS   8
+
+/* BPF programs get 512 bytes of stack */
+#define OPT_STACK_SIZE 512
+#define STACK_WORDS    (OPT_STACK_SIZE / 64)
+
+#define R(_reg) (1 << (_reg))
+
+/* r0-r5 are clobbered by helper calls, r1-r5 carry the arguments */
+#define REGS_CALL_DEF 0x003f
+#define REGS_CALL_USE 0x003e
+#define REGS_ALL      0x07ff
+
+typedef struct stack_set {
+	uint64_t w[STACK_WORDS];
+} stack_set_t;
+
+struct opt {
+	struct bpf_insn *insns;
+	int n;
+
+	uint8_t *dead;
+	uint8_t *cont;
+	uint8_t *leader;
+	uint16_t *n_jumpers;
+
+	uint16_t *live_in;
+	uint16_t *live_out;
+	stack_set_t *stack_in;
+	stack_set_t *stack_out;
+};
+
+static int insn_is_ldimm64(const struct bpf_insn *insn)
+{
+	return insn->code == (BPF_LD | BPF_DW | BPF_IMM);
+}
+
+static int insn_is_jmp(const struct bpf_insn *insn)
+{
+	if (BPF_CLASS(insn->code) != BPF_JMP)
+		return 0;
+
+	switch (BPF_OP(insn->code)) {
+	case BPF_CALL:
+	case BPF_EXIT:
+		return 0;
+	}
+
+	return 1;
+}
+
+static int insn_is_cond(const struct bpf_insn *insn)
+{
+	return insn_is_jmp(insn) && BPF_OP(insn->code) != BPF_JA;
+}
+
+static int insn_is_exit(const struct bpf_insn *insn)
+{
+	return insn->code == (BPF_JMP | BPF_EXIT);
+}
+
+static int insn_is_stack_mem(const struct bpf_insn *insn)
+{
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ST:
+	case BPF_STX:
+		return BPF_MODE(insn->code) == BPF_MEM &&
+			insn->dst_reg == BPF_REG_10;
+	case BPF_LDX:
+		return BPF_MODE(insn->code) == BPF_MEM &&
+			insn->src_reg == BPF_REG_10;
+	}
+
+	return 0;
+}
+
+static int insn_size(const struct bpf_insn *insn)
+{
+	switch (BPF_SIZE(insn->code)) {
+	case BPF_B:
+		return 1;
+	case BPF_H:
+		return 2;
+	case BPF_W:
+		return 4;
+	}
+
+	return 8;
+}
+
+static int opt_target(struct opt *o, int i)
+{
+	return i + 1 + o->insns[i].off;
+}
+
+static void insn_regs(const struct bpf_insn *insn, uint16_t *def, uint16_t *use)
+{
+	uint8_t dst = insn->dst_reg, src = insn->src_reg;
+	int x = BPF_SRC(insn->code) == BPF_X;
+
+	*def = *use = 0;
+
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ALU64:
+	case BPF_ALU:
+		*def = R(dst);
+
+		switch (BPF_OP(insn->code)) {
+		case BPF_MOV:
+			*use = x ? R(src) : 0;
+			break;
+		case BPF_NEG:
+		case BPF_END:
+			*use = R(dst);
+			break;
+		default:
+			*use = R(dst) | (x ? R(src) : 0);
+		}
+		break;
+
+	case BPF_LDX:
+		*def = R(dst);
+		*use = R(src);
+		break;
+
+	case BPF_LD:
+		if (insn_is_ldimm64(insn)) {
+			*def = R(dst);
+			break;
+		}
+
+		/* legacy packet access, be pessimistic */
+		*def = REGS_CALL_DEF;
+		*use = REGS_ALL;
+		break;
+
+	case BPF_ST:
+		*use = R(dst);
+		break;
+
+	case BPF_STX:
+		*use = R(dst) | R(src);
+
+		if (BPF_MODE(insn->code) != BPF_XADD)
+			break;
+#ifdef BPF_FETCH
+		if (insn->imm == BPF_CMPXCHG) {
+			*def = R(BPF_REG_0);
+			*use |= R(BPF_REG_0);
+		} else if (insn->imm & BPF_FETCH) {
+			*def = R(src);
+		}
+#endif
+		break;
+
+	case BPF_JMP:
+		switch (BPF_OP(insn->code)) {
+		case BPF_CALL:
+			*def = REGS_CALL_DEF;
+			*use = REGS_CALL_USE;
+			break;
+		case BPF_EXIT:
+			*use = R(BPF_REG_0);
+			break;
+		case BPF_JA:
+			break;
+		default:
+			*use = R(dst) | (x ? R(src) : 0);
+		}
+		break;
+
+	default:
+		*def = REGS_ALL;
+		*use = REGS_ALL;
+	}
+}
+
+/* analysis */
+
+static void opt_scan(struct opt *o)
+{
+	int i;
+
+	memset(o->cont, 0, o->n);
+	memset(o->leader, 0, o->n + 1);
+	memset(o->n_jumpers, 0, (o->n + 1) * sizeof(*o->n_jumpers));
+
+	o->leader[0] = 1;
+	for (i = 0; i < o->n; i++) {
+		if (insn_is_ldimm64(&o->insns[i])) {
+			o->cont[++i] = 1;
+			continue;
+		}
+
+		if (insn_is_jmp(&o->insns[i])) {
+			o->leader[opt_target(o, i)] = 1;
+			o->n_jumpers[opt_target(o, i)]++;
+			o->leader[i + 1] = 1;
+		} else if (insn_is_exit(&o->insns[i])) {
+			o->leader[i + 1] = 1;
+		}
+	}
+}
+
+static int opt_succs(struct opt *o, int i, int *succ)
+{
+	struct bpf_insn *insn = &o->insns[i];
+	int n = 0;
+
+	if (insn_is_exit(insn))
+		return 0;
+
+	if (insn_is_jmp(insn)) {
+		succ[n++] = opt_target(o, i);
+		if (BPF_OP(insn->code) == BPF_JA)
+			return n;
+	}
+
+	succ[n++] = i + (insn_is_ldimm64(insn) ? 2 : 1);
+	return n;
+}
+
+static void stack_range(stack_set_t *set, int off, int size, int on)
+{
+	int b;
+
+	for (b = OPT_STACK_SIZE + off; b < OPT_STACK_SIZE + off + size; b++) {
+		if (b < 0 || b >= OPT_STACK_SIZE)
+			continue;
+
+		if (on)
+			set->w[b >> 6] |=  (1ULL << (b & 63));
+		else
+			set->w[b >> 6] &= ~(1ULL << (b & 63));
+	}
+}
+
+static int stack_any(const stack_set_t *set, int off, int size)
+{
+	int b;
+
+	for (b = OPT_STACK_SIZE + off; b < OPT_STACK_SIZE + off + size; b++) {
+		if (b < 0 || b >= OPT_STACK_SIZE)
+			return 1;
+
+		if (set->w[b >> 6] & (1ULL << (b & 63)))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void stack_transfer(const struct bpf_insn *insn, stack_set_t *set)
+{
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ST:
+	case BPF_STX:
+		if (insn_is_stack_mem(insn))
+			stack_range(set, insn->off, insn_size(insn), 0);
+		else if (BPF_MODE(insn->code) != BPF_MEM)
+			/* atomics read memory that could be on the stack */
+			memset(set, 0xff, sizeof(*set));
+		break;
+
+	case BPF_LDX:
+		if (insn_is_stack_mem(insn))
+			stack_range(set, insn->off, insn_size(insn), 1);
+		else if (insn->src_reg != BPF_REG_9)
+			/* could be a pointer into the stack */
+			memset(set, 0xff, sizeof(*set));
+		break;
+
+	case BPF_LD:
+		if (!insn_is_ldimm64(insn))
+			memset(set, 0xff, sizeof(*set));
+		break;
+
+	case BPF_JMP:
+		/* helpers may read any part of the stack that we have
+		 * handed them a pointer to */
+		if (BPF_OP(insn->code) == BPF_CALL)
+			memset(set, 0xff, sizeof(*set));
+		break;
+	}
+}
+
+static void opt_liveness(struct opt *o)
+{
+	stack_set_t stack;
+	uint16_t def, use, out;
+	int changed, i, j, k, n_succ, succ[2];
+
+	memset(o->live_in,   0, o->n * sizeof(*o->live_in));
+	memset(o->live_out,  0, o->n * sizeof(*o->live_out));
+	memset(o->stack_in,  0, o->n * sizeof(*o->stack_in));
+	memset(o->stack_out, 0, o->n * sizeof(*o->stack_out));
+
+	do {
+		changed = 0;
+
+		for (i = o->n - 1; i >= 0; i--) {
+			if (o->cont[i])
+				continue;
+
+			out = 0;
+			memset(&stack, 0, sizeof(stack));
+
+			n_succ = opt_succs(o, i, succ);
+			for (j = 0; j < n_succ; j++) {
+				if (succ[j] >= o->n)
+					continue;
+
+				out |= o->live_in[succ[j]];
+				for (k = 0; k < STACK_WORDS; k++)
+					stack.w[k] |= o->stack_in[succ[j]].w[k];
+			}
+
+			o->live_out[i] = out;
+			o->stack_out[i] = stack;
+
+			insn_regs(&o->insns[i], &def, &use);
+			out = use | (out & ~def);
+			stack_transfer(&o->insns[i], &stack);
+
+			if (out != o->live_in[i] ||
+			    memcmp(&stack, &o->stack_in[i], sizeof(stack))) {
+				o->live_in[i] = out;
+				o->stack_in[i] = stack;
+				changed = 1;
+			}
+		}
+	} while (changed);
+}
+
+/* transformation */
+
+static void opt_kill(struct opt *o, int i)
+{
+	o->dead[i] = 1;
+	if (insn_is_ldimm64(&o->insns[i]))
+		o->dead[i + 1] = 1;
+}
+
+static int opt_compact(struct opt *o)
+{
+	struct bpf_insn *insn;
+	int *to, i, n, target;
+
+	to = malloc((o->n + 1) * sizeof(*to));
+	assert(to);
+
+	for (i = 0, n = 0; i < o->n; i++) {
+		to[i] = n;
+		if (!o->dead[i])
+			n++;
+	}
+	to[o->n] = n;
+
+	if (n == o->n)
+		goto out;
+
+	for (i = 0; i < o->n; i++) {
+		insn = &o->insns[i];
+		if (o->dead[i] || o->cont[i] || !insn_is_jmp(insn))
+			continue;
+
+		/* a jump into removed code lands on whatever followed it */
+		target = to[opt_target(o, i)];
+		insn->off = target - to[i] - 1;
+	}
+
+	for (i = 0; i < o->n; i++)
+		if (!o->dead[i])
+			o->insns[to[i]] = o->insns[i];
+
+out:
+	free(to);
+	i = o->n - n;
+	o->n = n;
+	memset(o->dead, 0, o->n);
+	return i;
+}
+
+enum val_kind {
+	VAL_UNKNOWN,
+	VAL_CONST,
+	VAL_COPY,
+};
+
+struct val {
+	enum val_kind kind;
+	int64_t imm;
+	uint8_t reg;
+};
+
+struct slot {
+	int16_t off;
+	struct val val;
+};
+
+struct fwd {
+	struct val regs[__MAX_BPF_REG];
+
+	struct slot slots[OPT_STACK_SIZE / 8];
+	int n_slots;
+};
+
+static void fwd_reset(struct fwd *f)
+{
+	memset(f, 0, sizeof(*f));
+}
+
+static int fwd_val_uses(const struct val *v, uint16_t regs)
+{
+	return v->kind == VAL_COPY && (regs & R(v->reg));
+}
+
+/* `regs` are about to be redefined, forget everything we know about
+ * them and everything that was known in terms of them. */
+static void fwd_clobber(struct fwd *f, uint16_t regs)
+{
+	int i;
+
+	for (i = 0; i < __MAX_BPF_REG; i++) {
+		if ((regs & R(i)) || fwd_val_uses(&f->regs[i], regs))
+			f->regs[i].kind = VAL_UNKNOWN;
+	}
+
+	for (i = 0; i < f->n_slots; i++) {
+		if (fwd_val_uses(&f->slots[i].val, regs))
+			f->slots[i--] = f->slots[--f->n_slots];
+	}
+}
+
+static void fwd_stack_clobber(struct fwd *f, int off, int size)
+{
+	int i;
+
+	for (i = 0; i < f->n_slots; i++) {
+		if (f->slots[i].off < off + size && off < f->slots[i].off + 8)
+			f->slots[i--] = f->slots[--f->n_slots];
+	}
+}
+
+static struct slot *fwd_stack_find(struct fwd *f, int off)
+{
+	int i;
+
+	for (i = 0; i < f->n_slots; i++)
+		if (f->slots[i].off == off)
+			return &f->slots[i];
+
+	return NULL;
+}
+
+static int fits_imm(int64_t v)
+{
+	return v == (int64_t)(int32_t)v;
+}
+
+static int alu_fold(uint8_t op, int64_t a, int64_t b, int64_t *res)
+{
+	uint64_t ua = a, ub = b;
+
+	switch (op) {
+	case BPF_ADD: *res = ua + ub; break;
+	case BPF_SUB: *res = ua - ub; break;
+	case BPF_MUL: *res = ua * ub; break;
+	case BPF_OR:  *res = ua | ub; break;
+	case BPF_AND: *res = ua & ub; break;
+	case BPF_XOR: *res = ua ^ ub; break;
+	case BPF_NEG: *res = -ua; break;
+	case BPF_DIV:
+		if (!ub)
+			return 0;
+		*res = ua / ub;
+		break;
+	case BPF_MOD:
+		if (!ub)
+			return 0;
+		*res = ua % ub;
+		break;
+	case BPF_LSH:
+		if (ub > 63)
+			return 0;
+		*res = ua << ub;
+		break;
+	case BPF_RSH:
+		if (ub > 63)
+			return 0;
+		*res = ua >> ub;
+		break;
+	case BPF_ARSH:
+		if (ub > 63)
+			return 0;
+		*res = a >> ub;
+		break;
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+static int jmp_fold(uint8_t op, int64_t a, int64_t b, int *taken)
+{
+	uint64_t ua = a, ub = b;
+
+	switch (op) {
+	case BPF_JEQ:  *taken = ua == ub; break;
+	case BPF_JNE:  *taken = ua != ub; break;
+	case BPF_JGT:  *taken = ua >  ub; break;
+	case BPF_JGE:  *taken = ua >= ub; break;
+	case BPF_JSGT: *taken = a  >  b;  break;
+	case BPF_JSGE: *taken = a  >= b;  break;
+	case BPF_JSET: *taken = !!(ua & ub); break;
+#ifdef BPF_JLT
+	case BPF_JLT:  *taken = ua <  ub; break;
+	case BPF_JLE:  *taken = ua <= ub; break;
+	case BPF_JSLT: *taken = a  <  b;  break;
+	case BPF_JSLE: *taken = a  <= b;  break;
+#endif
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/* replace a source register with an equivalent one, or with an
+ * immediate if the instruction has a K form. */
+static int fwd_subst_src(struct fwd *f, struct bpf_insn *insn)
+{
+	struct val *v = &f->regs[insn->src_reg];
+
+	if (v->kind == VAL_COPY) {
+		insn->src_reg = v->reg;
+		return 1;
+	}
+
+	if (v->kind != VAL_CONST || BPF_SRC(insn->code) != BPF_X ||
+	    !fits_imm(v->imm))
+		return 0;
+
+	switch (BPF_CLASS(insn->code)) {
+	case BPF_ALU64:
+	case BPF_JMP:
+		insn->code = (insn->code & ~BPF_X) | BPF_K;
+		insn->src_reg = 0;
+		insn->imm = v->imm;
+		return 1;
+	}
+
+	return 0;
+}
+
+static int fwd_subst_dst(struct fwd *f, struct bpf_insn *insn)
+{
+	struct val *v = &f->regs[insn->dst_reg];
+
+	if (v->kind != VAL_COPY)
+		return 0;
+
+	insn->dst_reg = v->reg;
+	return 1;
+}
+
+static int fwd_alu(struct fwd *f, struct bpf_insn *insn)
+{
+	struct val *d = &f->regs[insn->dst_reg];
+	uint8_t op = BPF_OP(insn->code);
+	int64_t res;
+	int changed = 0;
+
+	if (BPF_CLASS(insn->code) != BPF_ALU64 || op == BPF_END) {
+		fwd_clobber(f, R(insn->dst_reg));
+		return 0;
+	}
+
+	if (BPF_SRC(insn->code) == BPF_X)
+		changed |= fwd_subst_src(f, insn);
+
+	if (op == BPF_MOV) {
+		struct val v;
+
+		if (BPF_SRC(insn->code) == BPF_X) {
+			if (insn->src_reg == insn->dst_reg)
+				return -1;
+
+			if (f->regs[insn->src_reg].kind == VAL_CONST) {
+				v = f->regs[insn->src_reg];
+			} else {
+				v.kind = VAL_COPY;
+				v.reg = insn->src_reg;
+			}
+		} else {
+			v.kind = VAL_CONST;
+			v.imm = insn->imm;
+		}
+
+		/* already holds that value */
+		if (v.kind == d->kind &&
+		    ((v.kind == VAL_CONST && v.imm == d->imm) ||
+		     (v.kind == VAL_COPY  && v.reg == d->reg)))
+			return -1;
+
+		fwd_clobber(f, R(insn->dst_reg));
+		f->regs[insn->dst_reg] = v;
+		return changed;
+	}
+
+	/* wide literals are built up in several steps, so keep track
+	 * of all constants but only rewrite the ones that fit. */
+	if (d->kind == VAL_CONST && BPF_SRC(insn->code) == BPF_K &&
+	    alu_fold(op, d->imm, insn->imm, &res)) {
+		if (fits_imm(res)) {
+			*insn = MOV_IMM(insn->dst_reg, res);
+			changed = 1;
+		}
+
+		fwd_clobber(f, R(insn->dst_reg));
+		f->regs[insn->dst_reg].kind = VAL_CONST;
+		f->regs[insn->dst_reg].imm = res;
+		return changed;
+	}
+
+	fwd_clobber(f, R(insn->dst_reg));
+	return changed;
+}
+
+static int fwd_jmp(struct opt *o, struct fwd *f, int i)
+{
+	struct bpf_insn *insn = &o->insns[i];
+	struct val *d;
+	int changed, taken;
+
+	if (BPF_SRC(insn->code) == BPF_X)
+		changed = fwd_subst_src(f, insn);
+	else
+		changed = 0;
+
+	changed |= fwd_subst_dst(f, insn);
+
+	d = &f->regs[insn->dst_reg];
+	if (d->kind != VAL_CONST || BPF_SRC(insn->code) != BPF_K ||
+	    !jmp_fold(BPF_OP(insn->code), d->imm, insn->imm, &taken))
+		return changed;
+
+	if (taken)
+		*insn = JMP_IMM(BPF_JA, 0, 0, insn->off);
+	else
+		opt_kill(o, i);
+
+	return 1;
+}
+
+static int fwd_store(struct fwd *f, struct bpf_insn *insn)
+{
+	struct slot *s;
+	int changed = 0;
+
+	if (BPF_MODE(insn->code) != BPF_MEM) {
+		fwd_clobber(f, R(insn->src_reg));
+		f->n_slots = 0;
+		return 0;
+	}
+
+	if (BPF_CLASS(insn->code) == BPF_STX)
+		changed |= fwd_subst_src(f, insn);
+	changed |= fwd_subst_dst(f, insn);
+
+	if (!insn_is_stack_mem(insn)) {
+		/* we have no idea where this lands */
+		f->n_slots = 0;
+		return changed;
+	}
+
+	fwd_stack_clobber(f, insn->off, insn_size(insn));
+
+	if (BPF_CLASS(insn->code) != BPF_STX ||
+	    BPF_SIZE(insn->code) != BPF_DW ||
+	    insn->src_reg == BPF_REG_10 ||
+	    f->n_slots == sizeof(f->slots) / sizeof(f->slots[0]))
+		return changed;
+
+	s = &f->slots[f->n_slots++];
+	s->off = insn->off;
+	if (f->regs[insn->src_reg].kind == VAL_CONST &&
+	    fits_imm(f->regs[insn->src_reg].imm)) {
+		s->val = f->regs[insn->src_reg];
+	} else {
+		s->val.kind = VAL_COPY;
+		s->val.reg = insn->src_reg;
+	}
+
+	return changed;
+}
+
+static int fwd_load(struct fwd *f, struct bpf_insn *insn)
+{
+	struct slot *s;
+	int changed;
+
+	changed = fwd_subst_src(f, insn);
+
+	if (!insn_is_stack_mem(insn) || BPF_SIZE(insn->code) != BPF_DW ||
+	    !(s = fwd_stack_find(f, insn->off))) {
+		fwd_clobber(f, R(insn->dst_reg));
+		return changed;
+	}
+
+	if (s->val.kind == VAL_CONST)
+		*insn = MOV_IMM(insn->dst_reg, s->val.imm);
+	else
+		*insn = MOV(insn->dst_reg, s->val.reg);
+
+	return fwd_alu(f, insn) < 0 ? -1 : 1;
+}
+
+/* forward copies, constants and stack slots within basic blocks. */
+static int opt_forward(struct opt *o)
+{
+	struct bpf_insn *insn;
+	struct fwd f;
+	uint16_t def, use;
+	int changed = 0, ret, i;
+
+	fwd_reset(&f);
+
+	for (i = 0; i < o->n; i++) {
+		insn = &o->insns[i];
+
+		if (o->leader[i])
+			fwd_reset(&f);
+
+		if (o->cont[i])
+			continue;
+
+		switch (BPF_CLASS(insn->code)) {
+		case BPF_ALU64:
+		case BPF_ALU:
+			ret = fwd_alu(&f, insn);
+			break;
+		case BPF_ST:
+		case BPF_STX:
+			ret = fwd_store(&f, insn);
+			break;
+		case BPF_LDX:
+			ret = fwd_load(&f, insn);
+			break;
+		case BPF_JMP:
+			/* ja has no operands, its register fields are
+			 * reserved and must stay zero. */
+			if (insn_is_cond(insn)) {
+				ret = fwd_jmp(o, &f, i);
+				break;
+			}
+
+			if (BPF_OP(insn->code) == BPF_CALL)
+				f.n_slots = 0;
+			/* fall-through */
+		default:
+			insn_regs(insn, &def, &use);
+			fwd_clobber(&f, def);
+			ret = 0;
+		}
+
+		if (ret < 0) {
+			opt_kill(o, i);
+			ret = 1;
+		}
+
+		changed |= ret;
+	}
+
+	return changed;
+}
+
+/* remove jumps to the next instruction and code that can not be
+ * reached, and thread jumps that land on unconditional ones. */
+static int opt_jumps(struct opt *o)
+{
+	struct bpf_insn *insn;
+	uint8_t *seen;
+	int *stack, sp = 0, changed = 0, hops, i, j, t, n_succ, succ[2];
+
+	for (i = 0; i < o->n; i++) {
+		insn = &o->insns[i];
+		if (o->cont[i] || !insn_is_jmp(insn))
+			continue;
+
+		for (hops = 0; hops < OPT_MAX_HOPS; hops++) {
+			t = opt_target(o, i);
+			if (t >= o->n || o->insns[t].code != (BPF_JMP | BPF_JA) ||
+			    t == i)
+				break;
+
+			insn->off += o->insns[t].off + 1;
+			changed = 1;
+		}
+
+		if (!insn->off) {
+			opt_kill(o, i);
+			changed = 1;
+		}
+	}
+
+	seen = calloc(o->n + 1, 1);
+	stack = malloc((o->n + 1) * sizeof(*stack));
+	assert(seen && stack);
+
+	stack[sp++] = 0;
+	seen[0] = 1;
+	while (sp) {
+		i = stack[--sp];
+		if (i >= o->n)
+			continue;
+
+		n_succ = opt_succs(o, i, succ);
+		for (j = 0; j < n_succ; j++) {
+			if (seen[succ[j]])
+				continue;
+
+			seen[succ[j]] = 1;
+			stack[sp++] = succ[j];
+		}
+	}
+
+	for (i = 0; i < o->n; i++) {
+		if (o->cont[i] || seen[i])
+			continue;
+
+		opt_kill(o, i);
+		changed = 1;
+	}
+
+	free(stack);
+	free(seen);
+	return changed;
+}
+
+static int jmp_invert(uint8_t op, uint8_t *inv)
+{
+	switch (op) {
+	case BPF_JEQ:  *inv = BPF_JNE;  break;
+	case BPF_JNE:  *inv = BPF_JEQ;  break;
+#ifdef BPF_JLT
+	case BPF_JGT:  *inv = BPF_JLE;  break;
+	case BPF_JGE:  *inv = BPF_JLT;  break;
+	case BPF_JLT:  *inv = BPF_JGE;  break;
+	case BPF_JLE:  *inv = BPF_JGT;  break;
+	case BPF_JSGT: *inv = BPF_JSLE; break;
+	case BPF_JSGE: *inv = BPF_JSLT; break;
+	case BPF_JSLT: *inv = BPF_JSGE; break;
+	case BPF_JSLE: *inv = BPF_JSGT; break;
+#endif
+	default:
+		return 0;
+	}
+
+	return 1;
+}
+
+/* comparisons are compiled into a 0/1 value, which in a predicate or
+ * an if-statement is then immediately tested against zero:
+ *
+ *   i+0: jcc   a, b, +2
+ *   i+1: mov   d, #k1
+ *   i+2: ja    +1
+ *   i+3: mov   d, #k2
+ *   i+4: j{ne,eq} d, #0, +off
+ *
+ * when d dies at i+4, jump to the final destination straight away. */
+static int opt_fuse_bool(struct opt *o)
+{
+	struct bpf_insn *jcc, *f, *ja, *t, *test;
+	int64_t k1, k2;
+	uint8_t op;
+	int changed = 0, i, dst, to_t, to_f;
+
+	for (i = 0; i + 4 < o->n; i++) {
+		jcc  = &o->insns[i];
+		f    = &o->insns[i + 1];
+		ja   = &o->insns[i + 2];
+		t    = &o->insns[i + 3];
+		test = &o->insns[i + 4];
+
+		if (o->dead[i] || !insn_is_cond(jcc) || jcc->off != 2 ||
+		    f->code != (BPF_ALU64 | BPF_MOV | BPF_K) ||
+		    ja->code != (BPF_JMP | BPF_JA) || ja->off != 1 ||
+		    t->code != (BPF_ALU64 | BPF_MOV | BPF_K) ||
+		    t->dst_reg != f->dst_reg ||
+		    (test->code != (BPF_JMP | BPF_JNE | BPF_K) &&
+		     test->code != (BPF_JMP | BPF_JEQ | BPF_K)) ||
+		    test->dst_reg != f->dst_reg || test->imm)
+			continue;
+
+		/* nothing but the idiom itself may enter it */
+		if (o->n_jumpers[i + 1] || o->n_jumpers[i + 2] ||
+		    o->n_jumpers[i + 3] != 1 || o->n_jumpers[i + 4] != 1 ||
+		    (o->live_out[i + 4] & R(f->dst_reg)))
+			continue;
+
+		dst = i + 4 + 1 + test->off;
+		k1 = f->imm;
+		k2 = t->imm;
+
+		if (BPF_OP(test->code) == BPF_JNE) {
+			to_t = k2 != 0;
+			to_f = k1 != 0;
+		} else {
+			to_t = k2 == 0;
+			to_f = k1 == 0;
+		}
+
+		op = BPF_OP(jcc->code);
+		if (to_t == to_f) {
+			if (to_t)
+				*jcc = JMP_IMM(BPF_JA, 0, 0, 0);
+			else
+				opt_kill(o, i);
+		} else if (!to_t) {
+			if (!jmp_invert(op, &op))
+				continue;
+
+			jcc->code = (jcc->code & ~BPF_OP(0xff)) | op;
+		}
+
+		if (!o->dead[i])
+			jcc->off = dst - i - 1;
+
+		opt_kill(o, i + 1);
+		opt_kill(o, i + 2);
+		opt_kill(o, i + 3);
+		opt_kill(o, i + 4);
+		changed = 1;
+		i += 4;
+	}
+
+	return changed;
+}
+
+/* drop computations whose result is never used, and stores to stack
+ * slots that are overwritten before they are read. */
+static int opt_dce(struct opt *o)
+{
+	struct bpf_insn *insn;
+	uint16_t def, use;
+	int changed = 0, i;
+
+	for (i = 0; i < o->n; i++) {
+		insn = &o->insns[i];
+		if (o->cont[i])
+			continue;
+
+		switch (BPF_CLASS(insn->code)) {
+		case BPF_ALU64:
+		case BPF_ALU:
+		case BPF_LDX:
+			break;
+		case BPF_LD:
+			if (insn_is_ldimm64(insn))
+				break;
+			continue;
+		case BPF_ST:
+		case BPF_STX:
+			if (insn_is_stack_mem(insn) &&
+			    !stack_any(&o->stack_out[i], insn->off, insn_size(insn))) {
+				opt_kill(o, i);
+				changed = 1;
+			}
+			continue;
+		default:
+			continue;
+		}
+
+		insn_regs(insn, &def, &use);
+		if (def & o->live_out[i])
+			continue;
+
+		opt_kill(o, i);
+		changed = 1;
+	}
+
+	return changed;
+}
+
+int prog_optimize(prog_t *prog)
+{
+	struct opt o = { .insns = prog->insns, .n = prog->ip - prog->insns };
+	int changed, round;
+
+	o.dead      = calloc(o.n + 1, 1);
+	o.cont      = calloc(o.n + 1, 1);
+	o.leader    = calloc(o.n + 1, 1);
+	o.n_jumpers = calloc(o.n + 1, sizeof(*o.n_jumpers));
+	o.live_in   = calloc(o.n + 1, sizeof(*o.live_in));
+	o.live_out  = calloc(o.n + 1, sizeof(*o.live_out));
+	o.stack_in  = calloc(o.n + 1, sizeof(*o.stack_in));
+	o.stack_out = calloc(o.n + 1, sizeof(*o.stack_out));
+	if (!o.dead || !o.cont || !o.leader || !o.n_jumpers ||
+	    !o.live_in || !o.live_out || !o.stack_in || !o.stack_out) {
+		changed = -ENOMEM;
+		goto out;
+	}
+
+	for (round = 0; round < OPT_MAX_ROUNDS; round++) {
+		changed = 0;
+
+		opt_scan(&o);
+		changed |= opt_forward(&o);
+		opt_compact(&o);
+
+		opt_scan(&o);
+		changed |= opt_jumps(&o);
+		opt_compact(&o);
+
+		opt_scan(&o);
+		opt_liveness(&o);
+		changed |= opt_fuse_bool(&o);
+		opt_compact(&o);
+
+		opt_scan(&o);
+		opt_liveness(&o);
+		changed |= opt_dce(&o);
+		opt_compact(&o);
+
+		if (!changed)
+			break;
+	}
+
+	_d("%td -> %d insns in %d rounds", prog->ip - prog->insns, o.n, round + 1);
+	prog->ip = &prog->insns[o.n];
+	changed = 0;
+out:
+	free(o.stack_out);
+	free(o.stack_in);
+	free(o.live_out);
+	free(o.live_in);
+	free(o.n_jumpers);
+	free(o.leader);
+	free(o.cont);
+	free(o.dead);
+	return changed;
+}
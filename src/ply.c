@@ -17,19 +17,29 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <linux/perf_event.h>
 #include <linux/version.h>
 #include <signal.h>
 #include <stdio.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <ply/ast.h>
+#include <ply/cache.h>
 #include <ply/evpipe.h>
 #include <ply/map.h>
 #include <ply/ply.h>
 #include <ply/pvdr.h>
+#include <ply/record.h>
+#include <ply/session.h>
+#include <ply/stats.h>
 
 #include "config.h"
 
@@ -37,15 +47,34 @@ FILE *scriptfp;
 
 struct globals G;
 
-static const char *sopts = "AcdDht:v";
+static const char *sopts = "a:ABb:CcdDfG:hi:k:K:M:Op:P:r:R:sS:t:T:vw:";
 static struct option lopts[] = {
-	{ "ascii",   no_argument,       0, 'A' },
-	{ "command", no_argument,       0, 'c' },
-	{ "debug",   no_argument,       0, 'd' },
-	{ "dump",    no_argument,       0, 'D' },
-	{ "help",    no_argument,       0, 'h' },
-	{ "timeout", required_argument, 0, 't' },
-	{ "version", no_argument,       0, 'v' },
+	{ "attach-session", required_argument, 0, 'a' },
+	{ "ascii",    no_argument,       0, 'A' },
+	{ "daemon",   no_argument,       0, 'B' },
+	{ "buffer",   required_argument, 0, 'b' },
+	{ "clear",    no_argument,       0, 'C' },
+	{ "command",  no_argument,       0, 'c' },
+	{ "debug",    no_argument,       0, 'd' },
+	{ "dump",     no_argument,       0, 'D' },
+	{ "folded",   no_argument,       0, 'f' },
+	{ "cgroup",   required_argument, 0, 'G' },
+	{ "help",     no_argument,       0, 'h' },
+	{ "interval", required_argument, 0, 'i' },
+	{ "top",      required_argument, 0, 'k' },
+	{ "cache",    required_argument, 0, 'K' },
+	{ "map-size", required_argument, 0, 'M' },
+	{ "stats",    no_argument,       0, 'O' },
+	{ "pid",      required_argument, 0, 'p' },
+	{ "pin",      required_argument, 0, 'P' },
+	{ "record",   required_argument, 0, 'r' },
+	{ "report",   required_argument, 0, 'R' },
+	{ "scale",    no_argument,       0, 's' },
+	{ "stack-depth", required_argument, 0, 'S' },
+	{ "timeout",  required_argument, 0, 't' },
+	{ "readers",  required_argument, 0, 'T' },
+	{ "version",  no_argument,       0, 'v' },
+	{ "wakeup",   required_argument, 0, 'w' },
 
 	{ NULL }
 };
@@ -57,15 +86,36 @@ static void usage()
 	     "Usage:\n"
 	     "  ply [options] <script_file>\n"
 	     "  ply [options] -c <script_string>\n"
+	     "  ply -R <recording>\n"
+	     "  ply [-i <interval>] [-C] -a <session>\n"
 	     "\n"
 	     "Options:\n"
+	     "  -a <session>        Dump the maps of a pinned session and exit.\n"
 	     "  -A                  ASCII output only, no Unicode.\n"
+	     "  -B                  Run in the background, requires -P.\n"
+	     "  -b <size>           Per-CPU event buffer size (default 4k).\n"
+	     "  -C                  Clear aggregations after each interval.\n"
 	     "  -c <script_string>  Execute script literate.\n"
 	     "  -d                  Enable debug output.\n"
 	     "  -D                  Dump generated BPF and exit.\n"
+	     "  -f                  Print maps in folded format, for flame graphs.\n"
+	     "  -G <path>           Only trace tasks in the cgroup at <path>.\n"
 	     "  -h                  Print usage message and exit.\n"
+	     "  -i <interval>       Print aggregations every <interval> seconds.\n"
+	     "  -k <num>            Only show the <num> greatest entries of each map.\n"
+	     "  -K <dir>            Cache compiled programs in <dir>.\n"
+	     "  -M <nelem>          Default number of entries per map (default 1024).\n"
+	     "  -O                  Print the overhead of each probe and of reading events.\n"
+	     "  -p <pid>            Only trace the process <pid>.\n"
+	     "  -P <dir>            Pin maps and programs to <dir> in bpffs.\n"
+	     "  -r <file>           Record raw printf events to <file>.\n"
+	     "  -R <file>           Format the events recorded in <file> and exit.\n"
+	     "  -s                  Scale sampled aggregations by the sampling rate.\n"
+	     "  -S <depth>          Number of frames to save per stack (default 16).\n"
 	     "  -t <timeout>        Terminate trace after <timeout> seconds.\n"
+	     "  -T <readers>        Read events using <readers> threads.\n"
 	     "  -v                  Print version information.\n"
+	     "  -w <ms>             Batch event wakeups, waiting at most <ms>.\n"
 		);
 }
 
@@ -82,18 +132,62 @@ static void version()
 	       (LINUX_VERSION_CODE >>  0) & 0xff);
 }
 
+static size_t parse_size(const char *str)
+{
+	size_t size, page = sysconf(_SC_PAGESIZE), pages;
+	char *end;
+
+	size = strtoul(str, &end, 0);
+	switch (*end) {
+	case 'k':
+	case 'K':
+		size <<= 10;
+		break;
+	case 'm':
+	case 'M':
+		size <<= 20;
+		break;
+	case '\0':
+		break;
+	default:
+		return 0;
+	}
+
+	/* perf rings must be a power of two number of pages */
+	for (pages = 1; pages * page < size; pages <<= 1);
+	return pages * page;
+}
+
 static int parse_opts(int argc, char **argv, FILE **sfp)
 {
 	int cmd = 0;
 	int opt;
 
 	G.map_nelem = 0x400;
+	G.stack_depth = 0x10;
+	G.bufsize = 4 << 10;
 
 	while ((opt = getopt_long(argc, argv, sopts, lopts, NULL)) > 0) {
 		switch (opt) {
+		case 'a':
+			G.session = optarg;
+			break;
 		case 'A':
 			G.ascii = 1;
 			break;
+		case 'B':
+			G.daemon = 1;
+			break;
+		case 'b':
+			G.bufsize = parse_size(optarg);
+			if (!G.bufsize) {
+				_e("invalid buffer size '%s'", optarg);
+				usage(); exit(1);
+			}
+			break;
+		case 'C':
+			G.clear = 1;
+			break;
 		case 'c':
 			cmd = 1;
 			break;
@@ -103,9 +197,63 @@ static int parse_opts(int argc, char **argv, FILE **sfp)
 		case 'D':
 			G.dump = 1;
 			break;
+		case 'f':
+			G.folded = 1;
+			break;
+		case 'G':
+			G.cgroup = optarg;
+			break;
 		case 'h':
 			usage(); exit(0);
 			break;
+		case 'i':
+			G.interval = strtol(optarg, NULL, 0);
+			if (G.interval <= 0) {
+				_e("interval must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
+		case 'k':
+			G.top = strtol(optarg, NULL, 0);
+			if (G.top <= 0) {
+				_e("number of entries must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
+		case 'K':
+			G.cache = optarg;
+			break;
+		case 'M':
+			G.map_nelem = strtol(optarg, NULL, 0);
+			if ((ssize_t)G.map_nelem <= 0) {
+				_e("map size must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
+		case 'O':
+			G.stats = 1;
+			break;
+		case 'p':
+			G.pid = strtol(optarg, NULL, 0);
+			if (G.pid <= 0) {
+				_e("pid must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
+		case 'P':
+			G.pin = optarg;
+			break;
+		case 's':
+			G.scale = 1;
+			break;
+		case 'S':
+			G.stack_depth = strtol(optarg, NULL, 0);
+			if (G.stack_depth <= 0 || G.stack_depth > PERF_MAX_STACK_DEPTH) {
+				_e("stack depth must be between 1 and %d",
+				   PERF_MAX_STACK_DEPTH);
+				usage(); exit(1);
+			}
+			break;
 		case 't':
 			G.timeout = strtol(optarg, NULL, 0);
 			if (G.timeout <= 0) {
@@ -113,9 +261,29 @@ static int parse_opts(int argc, char **argv, FILE **sfp)
 				usage(); exit(1);
 			}
 			break;
+		case 'r':
+			G.record = optarg;
+			break;
+		case 'R':
+			G.report = optarg;
+			break;
+		case 'T':
+			G.readers = strtol(optarg, NULL, 0);
+			if (G.readers <= 0) {
+				_e("number of readers must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
 		case 'v':
 			version(); exit(0);
 			break;
+		case 'w':
+			G.wakeup = strtol(optarg, NULL, 0);
+			if (G.wakeup <= 0) {
+				_e("wakeup latency must be a positive integer");
+				usage(); exit(1);
+			}
+			break;
 
 		default:
 			_e("unknown option '%c'", opt);
@@ -124,6 +292,19 @@ static int parse_opts(int argc, char **argv, FILE **sfp)
 		}
 	}
 
+	if (G.clear && !G.interval && !G.session) {
+		_e("clear mode requires an interval");
+		usage(); exit(1);
+	}
+
+	if (G.daemon && !G.pin) {
+		_e("daemon mode requires a pinned session");
+		usage(); exit(1);
+	}
+
+	if (G.report || G.session)
+		return 0;
+
 	if (cmd)
 		*sfp = fmemopen(argv[optind], strlen(argv[optind]), "r");
 	else if (optind < argc)
@@ -182,6 +363,64 @@ static void memlock_uncap(void)
 	_d("unlimited memlock");
 }
 
+/* bpf_get_current_cgroup_id() returns the id that is also stored in
+ * the cgroup's file handle. on recent kernels, that is simply the
+ * inode number of its directory. */
+static int cgroup_id(const char *path, uint64_t *id)
+{
+	struct {
+		struct file_handle fh;
+		uint64_t id;
+	} h;
+	struct stat st;
+	int mount_id;
+
+	h.fh.handle_bytes = sizeof(h.id);
+	if (!name_to_handle_at(AT_FDCWD, path, &h.fh, &mount_id, 0) &&
+	    h.fh.handle_bytes == sizeof(h.id)) {
+		*id = h.id;
+		return 0;
+	}
+
+	if (stat(path, &st))
+		return -errno;
+
+	*id = st.st_ino;
+	return 0;
+}
+
+/* resolve the process and cgroup that the trace is limited to, if
+ * any. providers that can will scope their events to them, all
+ * other programs check them first thing, see compile_probe(). */
+static int scope_init(void)
+{
+	int err;
+
+	if (G.pid && kill(G.pid, 0) && errno == ESRCH) {
+		_e("%d: no such process", G.pid);
+		return -ESRCH;
+	}
+
+	if (!G.cgroup)
+		return 0;
+
+	G.cgroup_fd = open(G.cgroup, O_RDONLY | O_DIRECTORY);
+	if (G.cgroup_fd < 0) {
+		_eno("%s: unable to open cgroup", G.cgroup);
+		return -errno;
+	}
+
+	err = cgroup_id(G.cgroup, &G.cgroup_id);
+	if (err) {
+		_eno("%s: unable to get cgroup id", G.cgroup);
+		return err;
+	}
+
+	_d("scoped to cgroup %s (id:%llu)", G.cgroup,
+	   (unsigned long long)G.cgroup_id);
+	return 0;
+}
+
 static int term_sig = 0;
 static void term(int sig)
 {
@@ -189,12 +428,41 @@ static void term(int sig)
 	return;
 }
 
+static int attach_session(void)
+{
+	char dir[PATH_MAX];
+	node_t *script;
+
+	script = session_open(G.session, dir, sizeof(dir));
+	if (!script)
+		return -EINVAL;
+
+	siginterrupt(SIGINT, 1);
+	signal(SIGINT, term);
+
+	/* the probes stay with the daemon, all we do is read (and
+	 * possibly reset) the maps. */
+	while (G.interval && !term_sig) {
+		sleep(G.interval);
+		if (term_sig)
+			break;
+
+		map_checkpoint(script);
+	}
+
+	map_teardown(script);
+	node_free(script);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	evpipe_t *evp;
-	node_t *probe, *script;
+	node_t *probe, *script = NULL;
 	prog_t *prog = NULL;
 	pvdr_t *pvdr;
+	char *src = NULL;
+	size_t len = 0;
 	FILE *sfp;
 	int err = 0, num, total;
 
@@ -204,9 +472,25 @@ int main(int argc, char **argv)
 	if (err)
 		goto err;
 
+	if (G.report)
+		return report(G.report) ? 1 : 0;
+
 	G.ksyms = ksyms_new();
 	memlock_uncap();
 
+	if (G.session)
+		return attach_session() ? 1 : 0;
+
+	err = scope_init();
+	if (err)
+		goto err;
+
+	if (G.pin || G.cache) {
+		err = session_slurp(&sfp, &src, &len);
+		if (err)
+			goto err;
+	}
+
 	script = node_script_parse(sfp);
 	if (!script) {
 		err = -EINVAL;
@@ -225,7 +509,7 @@ int main(int argc, char **argv)
 	assert(evp);
 	script->dyn->script.evp = evp;
 
-	err = evpipe_init(evp, 4 << 10);
+	err = evpipe_init(evp, G.bufsize);
 	if (err)
 		goto err;
 
@@ -235,13 +519,31 @@ int main(int argc, char **argv)
 		
 	if (G.dump)
 		node_ast_dump(script);
+	else if (G.stats)
+		stats_enable();
+
+	if (G.cache && !G.dump) {
+		err = cache_open(script, src, len);
+		if (err)
+			goto err;
+	}
 
 	total = 0;
 	node_foreach(probe, script->script.probes) {
+		/* runs as a part of its leader's program */
+		if (probe->dyn->probe.leader)
+			continue;
+
 		err = -EINVAL;
-		prog = compile_probe(probe);
-		if (!prog)
-			break;
+		prog = G.cache ? cache_get(probe) : NULL;
+		if (!prog) {
+			prog = compile_probe(probe);
+			if (!prog)
+				break;
+
+			if (G.cache && !G.dump)
+				cache_put(probe, prog);
+		}
 
 		if (G.dump)
 			continue;
@@ -251,6 +553,7 @@ int main(int argc, char **argv)
 		if (num < 0)
 			break;
 
+		probe->dyn->probe.sites = num;
 		total += num;
 	}
 
@@ -262,6 +565,21 @@ int main(int argc, char **argv)
 		goto err;
 	}
 
+	if (G.cache)
+		cache_close(script);
+
+	if (G.record) {
+		err = record_open(G.record);
+		if (err)
+			goto err;
+	}
+
+	if (G.pin) {
+		err = session_pin(script, G.pin, src, len);
+		if (err)
+			goto err;
+	}
+
 	if (G.timeout) {
 		siginterrupt(SIGALRM, 1);
 		signal(SIGALRM, term);
@@ -272,23 +590,70 @@ int main(int argc, char **argv)
 	signal(SIGINT, term);
 	
 	fprintf(stderr, "%d probe%s active\n", total, (total == 1) ? "" : "s");
-	err = evpipe_loop(evp, &term_sig, 0);
+
+	if (G.daemon) {
+		signal(SIGTERM, term);
+
+		if (daemon(0, 0)) {
+			_eno("unable to daemonize");
+			err = -errno;
+			goto err;
+		}
+
+		session_set_pid(G.pin);
+	}
+
+	for (;;) {
+		/* in a pinned session, checkpoints are driven by the
+		 * readers. */
+		err = evpipe_loop(evp, &term_sig, 0,
+				  (G.interval && !G.pin) ? G.interval * 1000 : -1);
+		if (err || term_sig)
+			break;
+
+		/* the readers keep running across the checkpoint, hold
+		 * them off while the maps are dumped. */
+		evpipe_lock();
+		map_checkpoint(script);
+		if (G.stats)
+			stats_dump(script);
+		evpipe_unlock();
+	}
+
+	record_close();
 
 	fprintf(stderr, "de-activating probes\n");
 
-	map_teardown(script);
+	/* get out of the way of the workload before the maps are
+	 * dumped, which may take a while. this also keeps the maps
+	 * from changing while they are read. */
+	node_foreach(probe, script->script.probes) {
+		pvdr = node_get_pvdr(probe);
+		if (!probe->dyn->probe.leader && pvdr->disable)
+			pvdr->disable(probe);
+	}
 
 	node_foreach(probe, script->script.probes) {
+		if (probe->dyn->probe.leader)
+			continue;
+
 		pvdr = node_get_pvdr(probe);
-		err = pvdr->teardown(probe);
-		if (err)
-			break;
+		num = pvdr->teardown(probe);
+		if (num && !err)
+			err = num;
 	}
 
+	map_teardown(script);
+	if (G.stats)
+		stats_dump(script);
+
 done:
 err:
+	stats_disable();
 	if (prog)
-		free(prog);
+		prog_free(prog);
+	if (src)
+		free(src);
 	if (script)
 		node_free(script);
 
@@ -19,8 +19,12 @@
 
 #define _GNU_SOURCE
 
+#include <ctype.h>
 #include <errno.h>
 #include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,6 +39,7 @@
 #include <sys/types.h>
 
 #include <ply/bpf-syscall.h>
+#include <ply/elfsyms.h>
 #include <ply/module.h>
 #include <ply/ply.h>
 #include <ply/pvdr.h>
@@ -55,13 +60,24 @@ typedef struct kprobe {
 		int cap, len;
 		int *fds;
 	} efds;
+
+	/* dynamic PMU type, or zero when using kprobe_events */
+	int pmu;
+	uint64_t pmu_config;
+
+	/* probes created from a wildcard */
+	struct {
+		int cap, len;
+		struct kprobe_sym *syms;
+	} batch;
 } kprobe_t;
 
-typedef struct profile {
-	int *efds;
-	int num;
-	kprobe_t *kp;
-} profile_t;
+struct kprobe_sym {
+	const char *func;
+	int created;
+	int efd;
+	int err;
+};
 
 #define	KPROBE_MAXLEN	0x100
 
@@ -81,36 +97,60 @@ static int probe_event_id(kprobe_t *kp, const char *path)
 	return strtol(ev_id, NULL, 0);
 }
 
-static int probe_attach(kprobe_t *kp, int id)
+static int kprobe_is_uprobe(kprobe_t *kp)
 {
-	struct perf_event_attr attr = {};
-	int efd, gfd;
-
-	attr.type = PERF_TYPE_TRACEPOINT;
-	attr.sample_type = PERF_SAMPLE_RAW;
-	attr.sample_period = 1;
-	attr.wakeup_events = 1;
-	attr.config = id;
+	return !strcmp(kp->pvdr, "uprobe") || !strcmp(kp->pvdr, "uretprobe");
+}
 
-	gfd = kp->efds.len ? kp->efds.fds[0] : -1;
-	efd = perf_event_open(&attr, -1, 0, gfd, 0);
+static int probe_open(kprobe_t *kp, struct perf_event_attr *attr, int gfd)
+{
+	int efd, err;
+
+	attr->size = sizeof(*attr);
+	attr->sample_type = PERF_SAMPLE_RAW;
+	attr->sample_period = 1;
+	attr->wakeup_events = 1;
+
+	/* the kernel only inserts uprobes into the address space of
+	 * the process that their event is bound to, so nobody else
+	 * even takes a trap. */
+	if (G.pid && kprobe_is_uprobe(kp))
+		efd = perf_event_open(attr, G.pid, -1, gfd, 0);
+	else
+		efd = perf_event_open(attr, -1, 0, gfd, 0);
 	if (efd < 0) {
 		_d("could not open perf_event: %s", strerror(errno));
 		return -errno;
 	}
 
 	if (ioctl(efd, PERF_EVENT_IOC_ENABLE, 0)) {
-		close(efd);
 		_d("could not enable probe: %s", strerror(errno));
-		return -errno;
+		goto err;
 	}
 
 	if (ioctl(efd, PERF_EVENT_IOC_SET_BPF, kp->bfd)) {
-		close(efd);
 		_d("could not set BPF program: %s", strerror(errno));
-		return -errno;
+		goto err;
 	}
 
+	return efd;
+err:
+	err = -errno;
+	close(efd);
+	return err;
+}
+
+static int probe_tp_open(kprobe_t *kp, int id, int gfd)
+{
+	struct perf_event_attr attr = {};
+
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.config = id;
+	return probe_open(kp, &attr, gfd);
+}
+
+static void probe_add_event(kprobe_t *kp, int efd)
+{
 	if (kp->efds.len == kp->efds.cap) {
 		size_t sz = kp->efds.cap * sizeof(*kp->efds.fds);
 
@@ -120,7 +160,17 @@ static int probe_attach(kprobe_t *kp, int id)
 	}
 
 	kp->efds.fds[kp->efds.len++] = efd;
+}
+
+static int probe_attach(kprobe_t *kp, int id)
+{
+	int efd;
+
+	efd = probe_tp_open(kp, id, kp->efds.len ? kp->efds.fds[0] : -1);
+	if (efd < 0)
+		return efd;
 
+	probe_add_event(kp, efd);
 	return 1;
 }
 
@@ -152,6 +202,7 @@ static kprobe_t *probe_load(enum bpf_prog_type type,
 		return NULL;
 	}
 
+	probe->dyn->probe.bfd = kp->bfd;
 	return kp;
 }
 
@@ -238,6 +289,103 @@ pvdr_t trace_pvdr = {
 
 /* KPROBE provider */
 
+#ifdef LINUX_HAS_PERF_KPROBE
+/*
+ * Since 4.17 there are dynamic "kprobe" and "uprobe" PMUs which take
+ * the probe site directly in the perf_event_attr. The probe then lives
+ * exactly as long as its perf event, so there is nothing to clean up
+ * in kprobe_events, even if we are killed, and no debugfs is needed.
+ */
+static int kprobe_pmu_init(kprobe_t *kp, const char *pmu)
+{
+	char line[0x20];
+	int type, bit, err;
+	FILE *fp;
+
+	fp = fopenf("r", "/sys/bus/event_source/devices/%s/type", pmu);
+	if (!fp)
+		return -errno;
+
+	err = (fgets(line, sizeof(line), fp) &&
+	       sscanf(line, "%d", &type) == 1) ? 0 : -EIO;
+	fclose(fp);
+	if (err)
+		return err;
+
+	if (kp->type[0] == 'r') {
+		fp = fopenf("r", "/sys/bus/event_source/devices/%s/format/retprobe",
+			    pmu);
+		if (!fp)
+			return -errno;
+
+		err = (fgets(line, sizeof(line), fp) &&
+		       sscanf(line, "config:%d", &bit) == 1) ? 0 : -EIO;
+		fclose(fp);
+		if (err)
+			return err;
+
+		kp->pmu_config = 1ULL << bit;
+	}
+
+	kp->pmu = type;
+	_d("using %s PMU (type:%d)", pmu, kp->pmu);
+	return 0;
+}
+
+static int kprobe_pmu_open(kprobe_t *kp, const char *func_and_offset, int gfd)
+{
+	struct perf_event_attr attr = {};
+	char func[KPROBE_MAXLEN];
+	const char *offstr;
+	char *end;
+	long offs = 0;
+	int funclen;
+
+	if (kprobe_is_uprobe(kp)) {
+		/* /path/to/execname:offset */
+		offstr = strrchr(func_and_offset, ':');
+		if (!offstr || !offstr[1])
+			goto inval;
+
+		offs = strtol(offstr + 1, &end, 0);
+		if (*end)
+			goto inval;
+	} else {
+		offstr = strchrnul(func_and_offset, '+');
+		if (*offstr)
+			offs = strtol(offstr, NULL, 0);
+	}
+
+	if (offs < 0)
+		goto inval;
+
+	funclen = (int)(offstr - func_and_offset);
+	snprintf(func, sizeof(func), "%.*s", funclen, func_and_offset);
+
+	attr.type = kp->pmu;
+	attr.config = kp->pmu_config;
+	attr.kprobe_func = (uintptr_t)func;
+	attr.probe_offset = offs;
+
+	_d("attaching to %s+%lx", func, offs);
+	return probe_open(kp, &attr, gfd);
+
+inval:
+	_e("unknown offset in probe '%s'", func_and_offset);
+	return -EINVAL;
+}
+#else
+static int kprobe_pmu_init(kprobe_t *kp, const char *pmu)
+{
+	return -ENOSYS;
+}
+
+static int kprobe_pmu_open(kprobe_t *kp, const char *func_and_offset, int gfd)
+{
+	return -ENOSYS;
+}
+#endif
+
 /*
  * Set attach state for function/offset to attached if attach is 1, otherwise
  * detach.
@@ -268,6 +416,19 @@ static int kprobe_setattach(kprobe_t *kp, const char *func_and_offset,
 	int funclen;
 	int i, id, err;
 
+	if (kp->pmu) {
+		if (!attach)
+			return 0;
+
+		id = kprobe_pmu_open(kp, func_and_offset,
+				     kp->efds.len ? kp->efds.fds[0] : -1);
+		if (id < 0)
+			return id;
+
+		probe_add_event(kp, id);
+		return 1;
+	}
+
 	offstr = strchrnul(func_and_offset, '+');
 	if (*offstr) {
 		offs = strtol(offstr, NULL, 0);
@@ -286,8 +447,7 @@ static int kprobe_setattach(kprobe_t *kp, const char *func_and_offset,
 	 * u[ret]probes are of form /path/to/execname:func+offset - replace ':'
 	 * and '/' elements. +offset is not currently supported.
 	 */
-	if (strcmp(kp->pvdr, "uprobe") == 0 ||
-	    strcmp(kp->pvdr, "uretprobe") == 0) {
+	if (kprobe_is_uprobe(kp)) {
 		if (offs != 0) {
 			_w("uprobes do not support addresses of form %s",
 			   func_and_offset);
@@ -347,11 +507,356 @@ static int kprobe_setattach(kprobe_t *kp, const char *func_and_offset,
 	return probe_attach(kp, id);
 }
 
+/* BATCHED KPROBE attach/detach
+ *
+ * Wildcards can easily match thousands of functions. Rather than
+ * doing the full kprobe_setattach() dance for each one, all
+ * kprobe_events lines are written in page sized chunks, and the
+ * event id lookups and perf events are then setup from a pool of
+ * threads. Failures are collected per symbol and reported once
+ * everything is done.
+ */
+#define KPROBE_BATCH_CHUNK   0x1000
+#define KPROBE_BATCH_WORKERS 16
+
+static void kprobe_batch_name(kprobe_t *kp, const char *func,
+			      char *name, size_t size)
+{
+	const char *offs = strrchr(func, ':');
+	uint32_t hash = 0x811c9dc5;
+	char *p;
+
+	if (kprobe_is_uprobe(kp)) {
+		/* /path/to/binary:0x<offset>, a long path would not fit
+		 * in an event name, so use a hash of it instead. */
+		for (; func < offs; func++)
+			hash = (hash ^ (uint8_t)*func) * 0x01000193;
+
+		snprintf(name, size, "%s_%08x_%s_%d",
+			 kp->type, hash, offs + 1, G.self);
+		return;
+	}
+
+	snprintf(name, size, "%s_%s_0_%d", kp->type, func, G.self);
+
+	/* local symbols are often suffixed, e.g. foo.isra.0, which is
+	 * not allowed in an event name. */
+	for (p = name; *p; p++)
+		if (*p == '.')
+			*p = '_';
+}
+
+static int kprobe_batch_line(kprobe_t *kp, struct kprobe_sym *ks, int attach,
+			     char *line, size_t size)
+{
+	char name[KPROBE_MAXLEN];
+
+	kprobe_batch_name(kp, ks->func, name, sizeof(name));
+
+	if (attach)
+		return snprintf(line, size, "%s:%s %s\n", kp->type, name, ks->func);
+
+	return snprintf(line, size, "-:%s\n", name);
+}
+
+static int kprobe_batch_write(kprobe_t *kp, const char *buf, size_t len)
+{
+	if (write(fileno(kp->ctrl), buf, len) != (ssize_t)len)
+		return -errno;
+
+	return 0;
+}
+
+static int kprobe_batch_skip(struct kprobe_sym *ks, int attach)
+{
+	return attach ? ks->err : !ks->created;
+}
+
+/* the kernel parses a write line by line and bails out at the first
+ * error, leaving any earlier lines applied. so when a chunk fails,
+ * redo it one line at a time to find out which symbols failed. */
+static void kprobe_batch_retry(kprobe_t *kp, struct kprobe_sym *ks,
+			       struct kprobe_sym *end, int attach)
+{
+	char line[KPROBE_MAXLEN * 2];
+	int len, err;
+
+	for (; ks < end; ks++) {
+		if (kprobe_batch_skip(ks, attach))
+			continue;
+
+		len = kprobe_batch_line(kp, ks, attach, line, sizeof(line));
+
+		err = kprobe_batch_write(kp, line, len);
+		if (err == (attach ? -EEXIST : -ENOENT))
+			err = 0;
+
+		ks->err = err;
+		if (attach)
+			ks->created = !err;
+	}
+}
+
+static void kprobe_batch_flush(kprobe_t *kp, struct kprobe_sym *first,
+			       struct kprobe_sym *end, int attach,
+			       const char *buf, size_t len)
+{
+	struct kprobe_sym *ks;
+
+	if (!len)
+		return;
+
+	if (kprobe_batch_write(kp, buf, len)) {
+		kprobe_batch_retry(kp, first, end, attach);
+		return;
+	}
+
+	if (!attach)
+		return;
+
+	for (ks = first; ks < end; ks++)
+		ks->created = !ks->err;
+}
+
+static void kprobe_batch_events(kprobe_t *kp, int attach)
+{
+	struct kprobe_sym *ks, *first, *end = &kp->batch.syms[kp->batch.len];
+	char buf[KPROBE_BATCH_CHUNK];
+	size_t len = 0;
+	int n;
+
+	for (first = ks = kp->batch.syms; ks < end; ks++) {
+		if (kprobe_batch_skip(ks, attach))
+			continue;
+
+		n = kprobe_batch_line(kp, ks, attach, &buf[len],
+				      sizeof(buf) - len);
+		if (len + n >= sizeof(buf)) {
+			kprobe_batch_flush(kp, first, ks, attach, buf, len);
+
+			first = ks;
+			len = 0;
+			n = kprobe_batch_line(kp, ks, attach, buf, sizeof(buf));
+		}
+
+		len += n;
+	}
+
+	kprobe_batch_flush(kp, first, end, attach, buf, len);
+}
+
+struct kprobe_worker {
+	kprobe_t *kp;
+	pthread_t tid;
+	int gfd;
+	volatile int *next;
+};
+
+static void kprobe_sym_open(kprobe_t *kp, struct kprobe_sym *ks, int gfd)
+{
+	char path[KPROBE_MAXLEN + 8];
+	int id;
+
+	if (kp->pmu) {
+		ks->efd = kprobe_pmu_open(kp, ks->func, gfd);
+		if (ks->efd < 0) {
+			ks->err = ks->efd;
+			ks->efd = -1;
+		}
+		return;
+	}
+
+	strcpy(path, kprobe_is_uprobe(kp) ? "uprobes/" : "kprobes/");
+	kprobe_batch_name(kp, ks->func, path + 8, sizeof(path) - 8);
+
+	id = probe_event_id(kp, path);
+	if (id < 0) {
+		ks->err = id;
+		return;
+	}
+
+	ks->efd = probe_tp_open(kp, id, gfd);
+	if (ks->efd < 0) {
+		ks->err = ks->efd;
+		ks->efd = -1;
+	}
+}
+
+static void *kprobe_worker(void *_kw)
+{
+	struct kprobe_worker *kw = _kw;
+	kprobe_t *kp = kw->kp;
+	struct kprobe_sym *ks;
+	int i;
+
+	while ((i = __sync_fetch_and_add(kw->next, 1)) < kp->batch.len) {
+		ks = &kp->batch.syms[i];
+		if (!ks->err)
+			kprobe_sym_open(kp, ks, kw->gfd);
+	}
+
+	return NULL;
+}
+
+static void kprobe_batch_open(kprobe_t *kp)
+{
+	struct kprobe_worker *kw;
+	struct kprobe_sym *ks;
+	int i, n, next = 0;
+
+	/* the first event is the group leader, so it has to be setup
+	 * before any of the others. */
+	for (ks = kp->batch.syms; ks < &kp->batch.syms[kp->batch.len]; ks++) {
+		next++;
+		if (ks->err)
+			continue;
+
+		kprobe_sym_open(kp, ks, -1);
+		if (!ks->err) {
+			probe_add_event(kp, ks->efd);
+			break;
+		}
+	}
+
+	if (!kp->efds.len)
+		return;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	n = n < 1 ? 1 : (n > KPROBE_BATCH_WORKERS ? KPROBE_BATCH_WORKERS : n);
+	if (n > kp->batch.len - next)
+		n = kp->batch.len - next;
+
+	kw = calloc(n, sizeof(*kw));
+	assert(kw);
+
+	for (i = 0; i < n; i++) {
+		kw[i].kp = kp;
+		kw[i].gfd = kp->efds.fds[0];
+		kw[i].next = &next;
+
+		if (pthread_create(&kw[i].tid, NULL, kprobe_worker, &kw[i])) {
+			_eno("unable to start attach worker");
+			kw[i].kp = NULL;
+			break;
+		}
+	}
+
+	/* always pitch in, this also covers the case where no worker
+	 * could be started. */
+	kprobe_worker(&(struct kprobe_worker) {
+			.kp = kp, .gfd = kp->efds.fds[0], .next = &next });
+
+	for (i = 0; i < n && kw[i].kp; i++)
+		pthread_join(kw[i].tid, NULL);
+
+	free(kw);
+
+	for (ks = kp->batch.syms; ks < &kp->batch.syms[kp->batch.len]; ks++) {
+		if (ks->efd >= 0 && ks->efd != kp->efds.fds[0])
+			probe_add_event(kp, ks->efd);
+	}
+}
+
+static void kprobe_batch_report(kprobe_t *kp)
+{
+	struct kprobe_sym *ks;
+	int n = 0;
+
+	for (ks = kp->batch.syms; ks < &kp->batch.syms[kp->batch.len]; ks++) {
+		if (!ks->err)
+			continue;
+
+		n++;
+		_w("'%s' will not be probed: %s", ks->func,
+		   ks->err == -EEXIST ? "probe already exists" :
+		   (ks->err == -ENOENT ? "probe not found" :
+		    strerror(-ks->err)));
+	}
+
+	if (n)
+		_w("%d of %d matching functions will not be probed",
+		   n, kp->batch.len);
+}
+
+static void kprobe_batch_add(kprobe_t *kp, const char *func)
+{
+	struct kprobe_sym *ks;
+
+	if (kp->batch.len == kp->batch.cap) {
+		kp->batch.cap = kp->batch.cap ? kp->batch.cap << 1 : 0x40;
+		kp->batch.syms = realloc(kp->batch.syms,
+					 kp->batch.cap * sizeof(*kp->batch.syms));
+		assert(kp->batch.syms);
+	}
+
+	ks = &kp->batch.syms[kp->batch.len++];
+	ks->func = func;
+	ks->created = ks->err = 0;
+	ks->efd = -1;
+}
+
+static int kprobe_batch_attach(kprobe_t *kp)
+{
+	if (!kp->pmu)
+		kprobe_batch_events(kp, 1);
+
+	kprobe_batch_open(kp);
+	kprobe_batch_report(kp);
+
+	return kp->efds.len;
+}
+
+static int kprobe_attach_pattern(kprobe_t *kp, const char *pattern)
+{
+	size_t i, n_syms = G.ksyms->cache->hdr.n_syms;
+	const ksym_t *k;
+
+	for (i = 0; i < n_syms; i++) {
+		k = &G.ksyms->cache->sym[i];
+
+		if (!fnmatch(pattern, ksym_name(G.ksyms, k), 0))
+			kprobe_batch_add(kp, ksym_name(G.ksyms, k));
+	}
+
+	_d("attaching to %d functions matching %s", kp->batch.len, pattern);
+	return kprobe_batch_attach(kp);
+}
+
+static int kprobe_detach_pattern(kprobe_t *kp)
+{
+	struct kprobe_sym *ks;
+	int err = 0;
+
+	/* only the events that we actually created are removed */
+	for (ks = kp->batch.syms; ks < &kp->batch.syms[kp->batch.len]; ks++)
+		ks->err = 0;
+
+	if (!kp->pmu)
+		kprobe_batch_events(kp, 0);
+
+	for (ks = kp->batch.syms; ks < &kp->batch.syms[kp->batch.len]; ks++) {
+		if (!ks->err)
+			continue;
+
+		_d("error %d detaching from %s", ks->err, ks->func);
+		if (!err)
+			err = ks->err;
+	}
+
+	/* uprobe sites are formatted by uprobe_attach() */
+	if (kprobe_is_uprobe(kp))
+		for (ks = kp->batch.syms; ks < &kp->batch.syms[kp->batch.len]; ks++)
+			free((void *)ks->func);
+
+	free(kp->batch.syms);
+	kp->batch.syms = NULL;
+	kp->batch.cap = kp->batch.len = 0;
+	return err;
+}
+
 static int kprobe_setattach_pattern(kprobe_t *kp, const char *pattern,
 				    int attach)
 {
-	int i, err;
-
 	if (!strchr(pattern, '?') && !strchr(pattern, '*'))
 		return kprobe_setattach(kp, pattern, attach);
 
@@ -360,22 +865,10 @@ static int kprobe_setattach_pattern(kprobe_t *kp, const char *pattern,
 		return -ENOSYS;
 	}
 
-	for (i = 0; i < G.ksyms->cache->hdr.n_syms; i++) {
-		const ksym_t *k = &G.ksyms->cache->sym[i];
-
-		if (fnmatch(pattern, k->sym, 0))
-			continue;
+	if (attach)
+		return kprobe_attach_pattern(kp, pattern);
 
-		err = kprobe_setattach(kp, k->sym, attach);
-		if (err == -EEXIST || err == -ENOENT) {
-			_w("'%s' will not be probed: %s", k->sym,
-			   err == -EEXIST ? "probe already exists" :
-			   "probe not found");
-			err = 0;
-		}
-	}
-
-	return (err < 0) ? err : kp->efds.len;
+	return kprobe_detach_pattern(kp);
 }
 
 static int kprobe_load(node_t *probe, prog_t *prog, const char *probestring,
@@ -390,10 +883,13 @@ static int kprobe_load(node_t *probe, prog_t *prog, const char *probestring,
 
 	kp->type = type;
 
-	kp->ctrl = fopen("/sys/kernel/debug/tracing/kprobe_events", "a+");
-	if (!kp->ctrl) {
-		_eno("unable to open kprobe_events");
-		return -errno;
+	/* fall back to kprobe_events on kernels without the PMU */
+	if (kprobe_pmu_init(kp, "kprobe")) {
+		kp->ctrl = fopen("/sys/kernel/debug/tracing/kprobe_events", "a+");
+		if (!kp->ctrl) {
+			_eno("unable to open kprobe_events");
+			return -errno;
+		}
 	}
 
 	*kpp = kp;
@@ -405,6 +901,10 @@ static int kprobe_detach(kprobe_t *kp, const char *probestring)
 {
 	char *func;
 
+	/* uprobes on symbols are always batched, see uprobe_attach() */
+	if (kp->batch.syms)
+		return kprobe_detach_pattern(kp);
+
 	func = strchr(probestring, ':') + 1;
 
 	return kprobe_setattach_pattern(kp, func, 0);
@@ -427,18 +927,19 @@ int kprobe_default(node_t *probe, node_t **stmts)
 	if (asprintf(&fmt, "%s:  pid:%%-5d  comm:%%v  func:%%v\n", probe->string) == -1) {
 		return -1;
 	}
-	vargs = node_str_new(fmt);
+	vargs = node_str_new(node_strdup(fmt));
+	free(fmt);
 
-	c = node_call_new(strdup("common"), strdup("pid"), NULL);
+	c = node_call_new(node_strdup("common"), node_strdup("pid"), NULL);
 	insque_tail(c, vargs);
 
-	c = node_call_new(strdup("common"), strdup("comm"), NULL);
+	c = node_call_new(node_strdup("common"), node_strdup("comm"), NULL);
 	insque_tail(c, vargs);
 
-	c = node_call_new(strdup("kprobe"), strdup("func"), NULL);
+	c = node_call_new(node_strdup("kprobe"), node_strdup("func"), NULL);
 	insque_tail(c, vargs);
 
-	*stmts = node_call_new(strdup("common"), strdup("printf"), vargs);
+	*stmts = node_call_new(node_strdup("common"), node_strdup("printf"), vargs);
 
 	node_foreach(c, *stmts)
 		c->parent = probe;
@@ -471,7 +972,8 @@ static int kprobe_destroy(kprobe_t *kp, const char *pattern)
 	 */
 	err2 = kprobe_detach(kp, pattern);
 
-	fclose(kp->ctrl);
+	if (kp->ctrl)
+		fclose(kp->ctrl);
 
 	free(kp);
 
@@ -513,18 +1015,19 @@ int kretprobe_default(node_t *probe, node_t **stmts)
 	if (asprintf(&fmt, "%s:  pid:%%-5d  comm:%%v  retval:%%d\n", probe->string) == -1) {
 		return -1;
 	}
-	vargs = node_str_new(fmt);
+	vargs = node_str_new(node_strdup(fmt));
+	free(fmt);
 
-	c = node_call_new(strdup("common"), strdup("pid"), NULL);
+	c = node_call_new(node_strdup("common"), node_strdup("pid"), NULL);
 	insque_tail(c, vargs);
 
-	c = node_call_new(strdup("common"), strdup("comm"), NULL);
+	c = node_call_new(node_strdup("common"), node_strdup("comm"), NULL);
 	insque_tail(c, vargs);
 
-	c = node_call_new(strdup("kretprobe"), strdup("retval"), NULL);
+	c = node_call_new(node_strdup("kretprobe"), node_strdup("retval"), NULL);
 	insque_tail(c, vargs);
 
-	*stmts = node_call_new(strdup("common"), strdup("printf"), vargs);
+	*stmts = node_call_new(node_strdup("common"), node_strdup("printf"), vargs);
 
 	node_foreach(c, *stmts)
 		c->parent = probe;
@@ -555,132 +1058,303 @@ pvdr_t kretprobe_pvdr = {
 
 /* PROFILE provider */
 
-static int profile_resolve(node_t *call, const func_t **f)
+#ifdef LINUX_HAS_PERF_EVENT_PROG
+struct profile_event {
+	const char *name;
+	uint32_t type;
+	uint64_t config;
+};
+
+static const struct profile_event profile_events[] = {
+	{ "cpu-clock",        PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_CLOCK },
+	{ "task-clock",       PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+	{ "page-faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+	{ "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+	{ "cpu-migrations",   PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+
+	{ "cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ "instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ "cache-references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES },
+	{ "cache-misses",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ "branches",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+	{ "branch-misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+	{ "bus-cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_BUS_CYCLES },
+	{ "ref-cycles",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_REF_CPU_CYCLES },
+
+	{ NULL }
+};
+
+static const struct profile_event *profile_event_find(const char *name)
 {
-        return modules_get_func(kprobe_modules, call, f);
+	const struct profile_event *pe;
+
+	for (pe = profile_events; pe->name; pe++)
+		if (!strcmp(pe->name, name))
+			return pe;
+
+	return NULL;
 }
 
-static void profile_destroy(profile_t *profile)
+/* profile:[<cpu>:][<event>:]<rate>, where rate is either <n>hz or
+ * a sampling period, i.e. one sample every <n> events. */
+static int profile_parse(const char *spec, struct perf_event_attr *attr,
+			 int *cpu)
 {
-	int i;
+	const struct profile_event *pe = profile_events;
+	char *str, *tok, *rate, *end;
+	unsigned long long n;
+	int err = -EINVAL;
 
-	if (!profile)
-		return;
+	str = strdup(strchr(spec, ':') + 1);
+	assert(str);
 
-	if (profile->kp)
-		kprobe_destroy(profile->kp, "kprobe:perf_swevent_hrtimer");
-	for (i = 0; i < profile->num; i++) {
-		if (profile->efds[i] > 0)
-			close(profile->efds[i]);
+	rate = strrchr(str, ':');
+	if (rate)
+		*(rate++) = '\0';
+	else
+		rate = str;
+
+	tok = (rate == str) ? NULL : strtok(str, ":");
+	for (; tok; tok = strtok(NULL, ":")) {
+		if (isdigit(*tok) && *cpu < 0 && pe == profile_events) {
+			*cpu = strtol(tok, &end, 0);
+			if (*end)
+				goto out;
+			continue;
+		}
+
+		pe = profile_event_find(tok);
+		if (!pe) {
+			_e("%s: unknown event '%s'", spec, tok);
+			err = -ENOENT;
+			goto out;
+		}
+	}
+
+	n = strtoull(rate, &end, 0);
+	if (!n)
+		goto out;
+
+	attr->type   = pe->type;
+	attr->config = pe->config;
+
+	if (!strcmp(end, "hz")) {
+		attr->freq = 1;
+		attr->sample_freq = n;
+	} else if (!*end) {
+		attr->sample_period = n;
+	} else {
+		goto out;
 	}
-	free(profile->efds);
-	free(profile);
+
+	err = 0;
+out:
+	free(str);
+	return err;
+}
+
+static int profile_resolve(node_t *call, const func_t **f)
+{
+        return modules_get_func(kprobe_modules, call, f);
 }
 
 static int profile_teardown(node_t *probe)
 {
-	profile_t *profile = probe->dyn->probe.pvdr_priv;
+	kprobe_t *kp = probe->dyn->probe.pvdr_priv;
 
-	profile_destroy(profile);
+	if (!kp)
+		return 0;
 
+	probe_teardown_events(kp);
+	free(kp);
 	return 0;
 }
 
-static int profile_perf_event_open(profile_t *profile, int cpu, int freq)
+/* stop sampling on all CPUs at once, rather than when it is this
+ * probe's turn to be torn down. */
+static int profile_disable(node_t *probe)
 {
-	struct perf_event_attr attr = {};
-	int err = 0, i = profile->num;
+	kprobe_t *kp = probe->dyn->probe.pvdr_priv;
+	int i;
+
+	if (!kp)
+		return 0;
+
+	for (i = 0; i < kp->efds.len; i++)
+		ioctl(kp->efds.fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	return 0;
+}
 
-	attr.type = PERF_TYPE_SOFTWARE;
-	attr.config = PERF_COUNT_SW_CPU_CLOCK;
-	attr.freq = 1;
-	attr.sample_freq = freq;
+static int profile_open(kprobe_t *kp, struct perf_event_attr *attr, int cpu)
+{
+	int efd;
 
-	profile->efds[i] = perf_event_open(&attr, -1, cpu, -1, 0);
-	if (profile->efds[i] < 0)
+	/* cgroup events only count while one of its tasks runs */
+	if (G.cgroup)
+		efd = perf_event_open(attr, G.cgroup_fd, cpu, -1,
+				      PERF_FLAG_PID_CGROUP);
+	else
+		efd = perf_event_open(attr, -1, cpu, -1, 0);
+	if (efd < 0) {
+		_eno("cpu%d: could not open perf_event", cpu);
 		return -errno;
-	if (ioctl(profile->efds[i], PERF_EVENT_IOC_ENABLE, 0)) {
-		close(profile->efds[i]);
+	}
+
+	probe_add_event(kp, efd);
+
+	if (ioctl(efd, PERF_EVENT_IOC_SET_BPF, kp->bfd)) {
+		_eno("cpu%d: could not set BPF program", cpu);
+		return -errno;
+	}
+
+	if (ioctl(efd, PERF_EVENT_IOC_ENABLE, 0)) {
+		_eno("cpu%d: could not enable event", cpu);
 		return -errno;
 	}
-	profile->num++;
+
 	return 0;
 }
 
-/*
- * profile provider is implemented by creating a perf event
- * PERF_TYPE_SOFTWARE/PERF_COUNT_SW_CPU_CLOCK for each CPU (or
- * a specified CPU) and using a kprobe on "kprobe:perf_swevent_hrtimer"
- * to catch it occuring in kernel context.
- */
+/* the program is attached to one sampling event per CPU, and runs
+ * in the context of the sample, i.e. with the registers of whatever
+ * was running when it was taken. */
 static int profile_setup(node_t *probe, prog_t *prog)
 {
 	struct perf_event_attr attr = {};
-	int cpu = -1, ncpus;
-	profile_t *profile;
-	char *freqstr;
-	int freq = -1;
-	int err = 0;
-
-	/*
-	 * Expected format is either profile:[n]hz where n is a number between
-	 * 1 and 1000, or profile:[c]:[n]hz where c is the CPU to profile.
-	 */
-	if (sscanf(probe->string, "profile:%dhz", &freq) != 1 &&
-	    sscanf(probe->string, "profile:%d:%dhz", &cpu, &freq) != 2)
-		return -EINVAL;
+	int cpu = -1, ncpus, err;
+	kprobe_t *kp;
 
-	if (freq < 0 || freq > 1000)
-		return -EINVAL;
+	attr.size = sizeof(attr);
+	err = profile_parse(probe->string, &attr, &cpu);
+	if (err) {
+		if (err == -EINVAL)
+			_e("%s: expected profile:[<cpu>:][<event>:]<n>[hz]",
+			   probe->string);
+		return err;
+	}
 
 	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu >= ncpus) {
+		_e("%s: no such cpu", probe->string);
+		return -EINVAL;
+	}
 
-	if (cpu < -1 || cpu > ncpus)
+	kp = probe_load(BPF_PROG_TYPE_PERF_EVENT, probe, prog);
+	if (!kp)
 		return -EINVAL;
 
-	if (cpu >= 0)
-		ncpus = 1;
-
-	profile = calloc(1, sizeof(*profile));
-	if (!profile)
-		return -ENOMEM;
-
-	profile->efds = calloc(ncpus, sizeof (int));
-	if (!profile->efds) {
-		free(profile);
-		return -ENOMEM;
-	}
-	if (cpu != -1)
-		err = profile_perf_event_open(profile, cpu, freq);
-	else {
-		for (cpu = 0; cpu < ncpus; cpu++) {
-			err = profile_perf_event_open(profile, cpu, freq);
-			if (err)
-				goto out;
-		}
-		profile->num++;
-	}
+	probe->dyn->probe.pvdr_priv = kp;
 
-	if (!err)
-		err = kprobe_load(probe, prog, "kprobe:perf_swevent_hrtimer",
-				  "p", &profile->kp);
-out:
-	if (err <= 0)
-		profile_destroy(profile);
+	if (cpu >= 0)
+		err = profile_open(kp, &attr, cpu);
 	else
-		probe->dyn->probe.pvdr_priv = profile;
+		for (cpu = 0, err = 0; !err && cpu < ncpus; cpu++)
+			err = profile_open(kp, &attr, cpu);
 
-	return err;
+	return err ? : kp->efds.len;
 }
 
 pvdr_t profile_pvdr = {
         .name = "profile",
+        .scope = PVDR_SCOPE_CGROUP,
 
         .resolve = profile_resolve,
 
         .setup = profile_setup,
+        .disable = profile_disable,
         .teardown = profile_teardown,
 };
+#endif	/* LINUX_HAS_PERF_EVENT_PROG */
+
+static int uprobe_offset_cmp(const void *_a, const void *_b)
+{
+	const uint64_t *a = _a, *b = _b;
+
+	return (*a > *b) - (*a < *b);
+}
+
+/* /path/to/binary:<offset> is passed on to the kernel as is, but the
+ * kernel does not know about symbols. /path/to/binary:<symbol>[+<offset>]
+ * is resolved using the binary's symbol index, <symbol> may be a
+ * wildcard matching any number of functions. */
+static int uprobe_attach(kprobe_t *kp, const char *spec)
+{
+	const char *sym = strrchr(spec, ':');
+	char path[PATH_MAX], pattern[KPROBE_MAXLEN], *func, *end;
+	uint64_t *offsets = NULL;
+	size_t i, n = 0, cap = 0;
+	const elfsym_t *s;
+	elfsyms_t *es;
+	long offs = 0;
+
+	if (!sym || !sym[1] || sym == spec) {
+		_e("%s: expected <path>:<symbol> or <path>:<offset>", spec);
+		return -EINVAL;
+	}
+
+	if (isdigit(sym[1]))
+		return kprobe_setattach_pattern(kp, spec, 1);
+
+	snprintf(path, sizeof(path), "%.*s", (int)(sym - spec), spec);
+	snprintf(pattern, sizeof(pattern), "%s", sym + 1);
+
+	end = strchr(pattern, '+');
+	if (end) {
+		*end++ = '\0';
+		offs = strtol(end, &end, 0);
+		if (*end || offs < 0) {
+			_e("%s: unknown offset", spec);
+			return -EINVAL;
+		}
+	}
+
+	es = elfsyms_open(path);
+	if (!es) {
+		_eno("%s: unable to read symbols", path);
+		return -errno;
+	}
+
+	for (s = NULL; (s = elfsym_match(es, pattern, s));) {
+		if (offs && s->size && offs >= s->size)
+			continue;
+
+		if (n == cap) {
+			cap = cap ? cap << 1 : 0x40;
+			offsets = realloc(offsets, cap * sizeof(*offsets));
+			assert(offsets);
+		}
+
+		offsets[n++] = s->offset + offs;
+	}
+
+	elfsyms_close(es);
+
+	/* aliases, e.g. index and strchr, share one site which should
+	 * only be probed once. */
+	qsort(offsets, n, sizeof(*offsets), uprobe_offset_cmp);
+	for (i = 0; i < n; i++) {
+		if (i && offsets[i] == offsets[i - 1])
+			continue;
+
+		if (asprintf(&func, "%s:%#" PRIx64, path, offsets[i]) < 0) {
+			free(offsets);
+			return -ENOMEM;
+		}
+
+		kprobe_batch_add(kp, func);
+	}
+
+	free(offsets);
+
+	if (!kp->batch.len) {
+		_e("%s: no matching functions", spec);
+		return -ENOENT;
+	}
+
+	_d("attaching to %d functions matching %s", kp->batch.len, spec);
+	return kprobe_batch_attach(kp);
+}
 
 static int uprobe_load(node_t *probe, prog_t *prog, const char *type,
 		       kprobe_t **kpp)
@@ -694,15 +1368,18 @@ static int uprobe_load(node_t *probe, prog_t *prog, const char *type,
 
 	kp->type = type;
 
-	kp->ctrl = fopen("/sys/kernel/debug/tracing/uprobe_events", "a+");
-	if (!kp->ctrl) {
-		_eno("unable to open uprobe_events");
-		return -errno;
+	/* fall back to uprobe_events on kernels without the PMU */
+	if (kprobe_pmu_init(kp, "uprobe")) {
+		kp->ctrl = fopen("/sys/kernel/debug/tracing/uprobe_events", "a+");
+		if (!kp->ctrl) {
+			_eno("unable to open uprobe_events");
+			return -errno;
+		}
 	}
 
 	*kpp = kp;
 	func = strchr(probe->string, ':') + 1;
-	return kprobe_setattach_pattern(kp, func, 1);
+	return uprobe_attach(kp, func);
 }
 
 static int uprobe_setup(node_t *probe, prog_t *prog)
@@ -713,6 +1390,7 @@ static int uprobe_setup(node_t *probe, prog_t *prog)
 
 pvdr_t uprobe_pvdr = {
 	.name = "uprobe",
+	.scope = PVDR_SCOPE_PID,
 
 	.resolve = kprobe_resolve,
 
@@ -728,6 +1406,7 @@ static int uretprobe_setup(node_t *probe, prog_t *prog)
 
 pvdr_t uretprobe_pvdr = {
 	.name = "uretprobe",
+	.scope = PVDR_SCOPE_PID,
 
 	.resolve = kretprobe_resolve,
 
@@ -745,7 +1424,9 @@ static void kprobe_pvdr_register(void)
 #endif
 	pvdr_register(   &kprobe_pvdr);
 	pvdr_register(&kretprobe_pvdr);
+#ifdef LINUX_HAS_PERF_EVENT_PROG
 	pvdr_register(  &profile_pvdr);
+#endif
 	pvdr_register(   &uprobe_pvdr);
 	pvdr_register(&uretprobe_pvdr);
 }
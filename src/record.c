@@ -0,0 +1,363 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/utsname.h>
+
+#include <ply/ast.h>
+#include <ply/evpipe.h>
+#include <ply/map.h>
+#include <ply/ply.h>
+#include <ply/record.h>
+
+/* events are small, so buffer generously to keep the writes large
+ * and sequential. */
+#define RECORD_BUFSIZE (1 << 20)
+
+/* event types are handed out sequentially to a handful of handlers
+ * and formats are written by hand, anything larger than these is
+ * from a corrupt recording. */
+#define RECORD_MAX_TYPE    0xffff
+#define RECORD_MAX_FMT_LEN 0x10000
+
+struct record_fmt {
+	uint64_t type;
+	node_t *call;
+};
+
+static struct record_fmt *rec_fmts;
+static uint32_t rec_n_fmts;
+static FILE *rec_fp;
+
+/* the recording has arguments that are kernel addresses */
+static int rep_syms;
+
+static int record_event(event_t *ev, void *_call)
+{
+	/* store the raw sample as is, i.e. its size followed by the
+	 * data, starting with the event type. */
+	if (fwrite(&ev->size, sizeof(ev->size) + ev->size, 1, rec_fp) != 1) {
+		_eno("unable to write event");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int record_register(node_t *call, evhandler_t *evh)
+{
+	rec_fmts = realloc(rec_fmts, (rec_n_fmts + 1) * sizeof(*rec_fmts));
+	assert(rec_fmts);
+
+	rec_fmts[rec_n_fmts].type = evh->type;
+	rec_fmts[rec_n_fmts].call = call;
+	rec_n_fmts++;
+
+	evh->handle = record_event;
+	return 0;
+}
+
+static void record_write_node(node_t *n)
+{
+	struct record_node rn = {
+		.type = n->dyn->type,
+		.size = n->dyn->size,
+	};
+	node_t *varg;
+
+	if (n->dump == dump_sym)
+		rn.flags |= RECORD_NODE_SYM;
+
+	/* only literal records carry their layout, anything else is
+	 * opaque and is reported as raw data. */
+	if (n->type == TYPE_REC) {
+		rn.type = TYPE_REC;
+		rn.n_vargs = n->rec.n_vargs;
+	} else if (rn.type == TYPE_REC) {
+		rn.type = TYPE_NONE;
+	}
+
+	fwrite(&rn, sizeof(rn), 1, rec_fp);
+
+	if (rn.type != TYPE_REC)
+		return;
+
+	node_foreach(varg, n->rec.vargs)
+		record_write_node(varg);
+}
+
+int record_open(const char *path)
+{
+	struct record_hdr hdr = {
+		.magic    = RECORD_MAGIC,
+		.version  = RECORD_VERSION,
+		.bom      = RECORD_BOM,
+		.n_events = rec_n_fmts,
+	};
+	struct record_fmt *f;
+	struct utsname un;
+	uint32_t len;
+
+	ksyms_boot_id(hdr.boot_id, sizeof(hdr.boot_id));
+	if (!uname(&un))
+		snprintf(hdr.release, sizeof(hdr.release), "%s", un.release);
+
+	rec_fp = fopen(path, "w");
+	if (!rec_fp) {
+		_eno("unable to open %s", path);
+		return -errno;
+	}
+
+	setvbuf(rec_fp, NULL, _IOFBF, RECORD_BUFSIZE);
+
+	fwrite(&hdr, sizeof(hdr), 1, rec_fp);
+
+	for (f = rec_fmts; f < &rec_fmts[rec_n_fmts]; f++) {
+		node_t *fmt = f->call->call.vargs;
+
+		len = strlen(fmt->string);
+		fwrite(&f->type, sizeof(f->type), 1, rec_fp);
+		fwrite(&len, sizeof(len), 1, rec_fp);
+		fwrite(fmt->string, len, 1, rec_fp);
+
+		record_write_node(fmt->next);
+	}
+
+	if (ferror(rec_fp)) {
+		_eno("unable to write header to %s", path);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+void record_close(void)
+{
+	if (!rec_fp)
+		return;
+
+	if (fclose(rec_fp))
+		_eno("unable to write recording");
+
+	rec_fp = NULL;
+}
+
+
+static void report_dump_stack(FILE *fp, node_t *n, void *data)
+{
+	int64_t id;
+
+	memcpy(&id, data, sizeof(id));
+	fprintf(fp, "<stack-id:%#" PRIx64 ">", id);
+}
+
+static void report_dump_raw(FILE *fp, node_t *n, void *data)
+{
+	fprintf(fp, "<%zu bytes>", n->dyn->size);
+}
+
+static node_t *report_read_node(FILE *fp)
+{
+	struct record_node rn;
+	node_t *n, *vargs = NULL, *varg;
+	int i;
+
+	if (fread(&rn, sizeof(rn), 1, fp) != 1)
+		return NULL;
+
+	switch (rn.type) {
+	case TYPE_REC:
+		for (i = 0; i < rn.n_vargs; i++) {
+			varg = report_read_node(fp);
+			if (!varg)
+				return NULL;
+
+			if (vargs)
+				insque_tail(varg, vargs);
+			else
+				vargs = varg;
+		}
+
+		n = node_rec_new(vargs);
+		break;
+	case TYPE_STR:
+		n = node_str_new(node_strdup(""));
+		break;
+	case TYPE_INT:
+		n = node_int_new(0);
+		if (rn.flags & RECORD_NODE_SYM) {
+			n->dump = dump_sym;
+			rep_syms = 1;
+		}
+		break;
+	case TYPE_STACK:
+		/* the stack map stays on the traced system */
+		n = node_int_new(0);
+		n->dump = report_dump_stack;
+		break;
+	default:
+		n = node_int_new(0);
+		n->dump = report_dump_raw;
+		break;
+	}
+
+	n->dyn->type = rn.type;
+	n->dyn->size = rn.size;
+	return n;
+}
+
+/* symbols can only be resolved on the boot that the recording was
+ * made on, anywhere else the addresses are printed as they are. */
+static void report_ksyms(struct record_hdr *hdr)
+{
+	char boot_id[sizeof(hdr->boot_id)];
+
+	hdr->release[sizeof(hdr->release) - 1] = '\0';
+
+	ksyms_boot_id(boot_id, sizeof(boot_id));
+	if (hdr->boot_id[0] &&
+	    !memcmp(hdr->boot_id, boot_id, sizeof(boot_id))) {
+		G.ksyms = ksyms_new();
+		return;
+	}
+
+	_w("recorded on another boot (kernel %s), kernel addresses "
+	   "are printed in hex", hdr->release[0] ? hdr->release : "unknown");
+}
+
+static int report_read_hdr(FILE *fp, node_t ***calls, uint64_t *n_calls)
+{
+	struct record_hdr hdr;
+	node_t *fmt, *rec;
+	uint64_t type;
+	uint32_t i, len;
+	char *str;
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    memcmp(hdr.magic, RECORD_MAGIC, sizeof(RECORD_MAGIC))) {
+		_e("not a ply recording");
+		return -EINVAL;
+	}
+
+	if (hdr.version != RECORD_VERSION || hdr.bom != RECORD_BOM) {
+		_e("unsupported recording (version:%u bom:%#x)",
+		   hdr.version, hdr.bom);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < hdr.n_events; i++) {
+		if (fread(&type, sizeof(type), 1, fp) != 1 ||
+		    fread(&len, sizeof(len), 1, fp) != 1)
+			goto err;
+
+		if (type > RECORD_MAX_TYPE || len > RECORD_MAX_FMT_LEN) {
+			_e("invalid header");
+			return -EINVAL;
+		}
+
+		str = node_alloc(len + 1);
+		if (len && fread(str, len, 1, fp) != 1)
+			goto err;
+
+		rec = report_read_node(fp);
+		if (!rec || rec->type != TYPE_REC)
+			goto err;
+
+		/* rebuild enough of the printf call for printf_event
+		 * to format the data */
+		fmt = node_str_new(str);
+		fmt->next = rec;
+		rec->prev = fmt;
+
+		if (type >= *n_calls) {
+			*calls = realloc(*calls, (type + 1) * sizeof(**calls));
+			assert(*calls);
+			memset(&(*calls)[*n_calls], 0,
+			       (type + 1 - *n_calls) * sizeof(**calls));
+			*n_calls = type + 1;
+		}
+
+		(*calls)[type] = node_call_new(NULL, node_strdup("printf"), fmt);
+	}
+
+	if (rep_syms)
+		report_ksyms(&hdr);
+
+	return 0;
+err:
+	_e("truncated header");
+	return -EINVAL;
+}
+
+int report(const char *path)
+{
+	node_t **calls = NULL;
+	uint64_t n_calls = 0;
+	size_t max = 0;
+	event_t *ev = NULL;
+	uint32_t size;
+	FILE *fp;
+	int err;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		_eno("unable to open %s", path);
+		return -errno;
+	}
+
+	setvbuf(fp, NULL, _IOFBF, RECORD_BUFSIZE);
+
+	err = report_read_hdr(fp, &calls, &n_calls);
+	if (err)
+		goto out;
+
+	while (fread(&size, sizeof(size), 1, fp) == 1) {
+		if (size > max) {
+			max = size;
+			ev = realloc(ev, sizeof(*ev) + max);
+			assert(ev);
+		}
+
+		ev->size = size;
+		if (fread(&ev->type, size, 1, fp) != 1) {
+			_w("recording ends with a truncated event");
+			break;
+		}
+
+		if (ev->type >= n_calls || !calls[ev->type]) {
+			_e("unknown event type:%#" PRIx64, ev->type);
+			err = -EINVAL;
+			break;
+		}
+
+		err = printf_event(ev, calls[ev->type]);
+		if (err)
+			break;
+	}
+
+out:
+	free(ev);
+	fclose(fp);
+	return err;
+}
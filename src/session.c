@@ -0,0 +1,307 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <ply/ast.h>
+#include <ply/bpf-syscall.h>
+#include <ply/map.h>
+#include <ply/ply.h>
+#include <ply/pvdr.h>
+#include <ply/session.h>
+
+/* the source has to survive parsing to be stored in the session, so
+ * read all of it up front and parse from memory instead. */
+int session_slurp(FILE **sfp, char **src, size_t *len)
+{
+	size_t cap = 0, n;
+
+	*src = NULL;
+	*len = 0;
+
+	do {
+		if (*len == cap) {
+			cap = cap ? cap << 1 : 0x1000;
+			*src = realloc(*src, cap);
+			assert(*src);
+		}
+
+		n = fread(*src + *len, 1, cap - *len, *sfp);
+		*len += n;
+	} while (n);
+
+	if (ferror(*sfp)) {
+		_eno("unable to read script");
+		return -EIO;
+	}
+
+	fclose(*sfp);
+	*sfp = fmemopen(*src, *len, "r");
+	return *sfp ? 0 : -errno;
+}
+
+static void session_path(const char *name, char *dir, size_t size)
+{
+	if (strchr(name, '/'))
+		snprintf(dir, size, "%s", name);
+	else
+		snprintf(dir, size, SESSION_ROOT "/%s", name);
+}
+
+static int session_pin_script(const char *dir, const char *src, size_t len)
+{
+	struct session_hdr hdr = {
+		.magic     = SESSION_MAGIC,
+		.version   = SESSION_VERSION,
+		.size      = len,
+		.interval  = G.interval,
+		.map_nelem = G.map_nelem,
+		.stack_depth = G.stack_depth,
+		.pid       = getpid(),
+	};
+	char chunk[SESSION_CHUNK], path[PATH_MAX];
+	uint32_t key, n;
+	int fd, err = 0;
+
+	n = 1 + (len + SESSION_CHUNK - 1) / SESSION_CHUNK;
+	fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, sizeof(key), SESSION_CHUNK, n);
+	if (fd < 0) {
+		_eno("unable to create script map");
+		return -errno;
+	}
+
+	memset(chunk, 0, sizeof(chunk));
+	memcpy(chunk, &hdr, sizeof(hdr));
+
+	key = 0;
+	if (bpf_map_update(fd, &key, chunk, BPF_ANY))
+		goto err;
+
+	for (key = 1; key < n; key++) {
+		size_t offs = (key - 1) * SESSION_CHUNK;
+		size_t size = len - offs;
+
+		if (size > SESSION_CHUNK)
+			size = SESSION_CHUNK;
+
+		memset(chunk, 0, sizeof(chunk));
+		memcpy(chunk, src + offs, size);
+		if (bpf_map_update(fd, &key, chunk, BPF_ANY))
+			goto err;
+	}
+
+	snprintf(path, sizeof(path), "%s/script", dir);
+	if (!bpf_obj_pin(fd, path))
+		goto out;
+
+err:
+	err = -errno;
+	_eno("unable to store script in %s", dir);
+out:
+	close(fd);
+	return err;
+}
+
+static int session_pin_probes(node_t *script, const char *dir)
+{
+	char path[PATH_MAX];
+	node_t *probe;
+	int i = 0;
+
+	node_foreach(probe, script->script.probes) {
+		if (probe->dyn->probe.bfd <= 0)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/probe%d", dir, i++);
+		if (bpf_obj_pin(probe->dyn->probe.bfd, path)) {
+			_eno("unable to pin %s", probe->string);
+			return -errno;
+		}
+	}
+
+	return 0;
+}
+
+int session_pin(node_t *script, const char *dir, const char *src, size_t len)
+{
+	int err;
+
+	if (!strncmp(dir, SESSION_ROOT "/", sizeof(SESSION_ROOT)) &&
+	    mkdir(SESSION_ROOT, 0700) && errno != EEXIST) {
+		_eno("unable to create " SESSION_ROOT ", is bpffs mounted?");
+		return -errno;
+	}
+
+	if (mkdir(dir, 0700)) {
+		if (errno == EEXIST)
+			_e("session %s already exists", dir);
+		else
+			_eno("unable to create %s", dir);
+		return -errno;
+	}
+
+	err = session_pin_script(dir, src, len);
+	if (err)
+		return err;
+
+	err = map_pin(script, dir);
+	if (err)
+		return err;
+
+	return session_pin_probes(script, dir);
+}
+
+static int session_hdr_get(int fd, struct session_hdr *hdr)
+{
+	char chunk[SESSION_CHUNK];
+	uint32_t key = 0;
+
+	if (bpf_map_lookup(fd, &key, chunk))
+		return -errno;
+
+	memcpy(hdr, chunk, sizeof(*hdr));
+	return 0;
+}
+
+/* called by the daemon once it has detached from the terminal */
+int session_set_pid(const char *dir)
+{
+	char chunk[SESSION_CHUNK], path[PATH_MAX];
+	struct session_hdr hdr;
+	uint32_t key = 0;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/script", dir);
+	fd = bpf_obj_get(path);
+	if (fd < 0)
+		return -errno;
+
+	err = session_hdr_get(fd, &hdr);
+	if (!err) {
+		hdr.pid = getpid();
+
+		memset(chunk, 0, sizeof(chunk));
+		memcpy(chunk, &hdr, sizeof(hdr));
+		if (bpf_map_update(fd, &key, chunk, BPF_ANY))
+			err = -errno;
+	}
+
+	close(fd);
+	return err;
+}
+
+static char *session_script(const char *dir, struct session_hdr *hdr)
+{
+	char path[PATH_MAX], *src;
+	uint32_t key, n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/script", dir);
+	fd = bpf_obj_get(path);
+	if (fd < 0) {
+		_eno("no session in %s", dir);
+		return NULL;
+	}
+
+	if (session_hdr_get(fd, hdr) ||
+	    memcmp(hdr->magic, SESSION_MAGIC, sizeof(SESSION_MAGIC)) ||
+	    hdr->version != SESSION_VERSION) {
+		_e("%s is not a ply session, or from an incompatible version", dir);
+		close(fd);
+		return NULL;
+	}
+
+	n = (hdr->size + SESSION_CHUNK - 1) / SESSION_CHUNK;
+	src = calloc(n + 1, SESSION_CHUNK);
+	assert(src);
+
+	for (key = 1; key <= n; key++) {
+		if (bpf_map_lookup(fd, &key, src + (key - 1) * SESSION_CHUNK)) {
+			_eno("unable to read script from %s", dir);
+			free(src);
+			src = NULL;
+			break;
+		}
+	}
+
+	close(fd);
+	return src;
+}
+
+node_t *session_open(const char *name, char *dir, size_t size)
+{
+	struct session_hdr hdr;
+	node_t *script = NULL;
+	int interval, err;
+	char *src;
+	FILE *sfp;
+
+	session_path(name, dir, size);
+
+	src = session_script(dir, &hdr);
+	if (!src)
+		return NULL;
+
+	if (hdr.pid && kill(hdr.pid, 0) && errno == ESRCH)
+		_w("session daemon (pid:%d) is not running, "
+		   "no new data is being recorded", hdr.pid);
+
+	sfp = fmemopen(src, hdr.size, "r");
+	if (!sfp)
+		goto err;
+
+	script = node_script_parse(sfp);
+	if (!script)
+		goto err;
+
+	/* annotate exactly like the daemon did, so that all maps get
+	 * the same layout. how often to dump is up to the reader. */
+	interval = G.interval;
+	G.interval = hdr.interval;
+	G.map_nelem = hdr.map_nelem;
+	if (hdr.stack_depth)
+		G.stack_depth = hdr.stack_depth;
+
+	err = pvdr_resolve(script);
+	if (!err)
+		err = annotate_script(script);
+
+	G.interval = interval;
+	if (!err)
+		err = map_open_pinned(script, dir);
+	if (err)
+		goto err;
+
+	free(src);
+	return script;
+err:
+	if (script)
+		node_free(script);
+	free(src);
+	return NULL;
+}
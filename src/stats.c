@@ -0,0 +1,131 @@
+/*
+ * Copyright 2015-2017 Tobias Waldekranz <tobias@waldekranz.com>
+ *
+ * This file is part of ply.
+ *
+ * ply is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, under the terms of version 2 of the
+ * License.
+ *
+ * ply is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with ply.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <ply/ply.h>
+#include <ply/bpf-syscall.h>
+#include <ply/evpipe.h>
+#include <ply/stats.h>
+
+#define STATS_SYSCTL "/proc/sys/kernel/bpf_stats_enabled"
+
+static int stats_fd = -1;
+static int stats_sysctl = -1;
+
+/* older kernels only have the global sysctl, in which case the
+ * original setting is restored on exit. */
+static int stats_sysctl_set(int on)
+{
+	FILE *fp;
+	int old;
+
+	fp = fopen(STATS_SYSCTL, "r+");
+	if (!fp)
+		return -errno;
+
+	if (fscanf(fp, "%d", &old) != 1)
+		old = 0;
+
+	rewind(fp);
+	fprintf(fp, "%d\n", on);
+	if (fclose(fp))
+		return -errno;
+
+	return old;
+}
+
+int stats_enable(void)
+{
+	stats_fd = bpf_enable_stats();
+	if (stats_fd >= 0)
+		return 0;
+
+	stats_sysctl = stats_sysctl_set(1);
+	if (stats_sysctl >= 0)
+		return 0;
+
+	_w("run-time statistics are not supported by this kernel");
+	return stats_sysctl;
+}
+
+void stats_disable(void)
+{
+	if (stats_fd >= 0) {
+		close(stats_fd);
+		stats_fd = -1;
+	}
+
+	if (stats_sysctl == 0)
+		stats_sysctl_set(0);
+
+	stats_sysctl = -1;
+}
+
+static void stats_dump_probe(node_t *probe)
+{
+	uint64_t cnt, ns;
+
+	if (probe->dyn->probe.leader) {
+		fprintf(stderr, "  %-32s %6s   (merged)\n",
+			probe->string, "-");
+		return;
+	}
+
+	fprintf(stderr, "  %-32s %6d", probe->string, probe->dyn->probe.sites);
+
+	if (bpf_prog_stats(probe->dyn->probe.bfd, &cnt, &ns)) {
+		fputs("          -          -          -\n", stderr);
+		return;
+	}
+
+	fprintf(stderr, " %10" PRIu64 " %10" PRIu64 " %10.3f\n",
+		cnt, cnt ? ns / cnt : 0, ns / 1e6);
+}
+
+static void stats_dump_evpipe(evpipe_t *evp)
+{
+	struct evpipe_stats st;
+
+	evpipe_stats(evp, &st);
+
+	fprintf(stderr, "  events: %" PRIu64 " read in %" PRIu64 " batches "
+		"(largest %" PRIu64 "), %" PRIu64 " lost, %.3f ms in handlers\n",
+		st.events, st.drains, st.max_batch, st.lost,
+		st.handle_ns / 1e6);
+}
+
+void stats_dump(node_t *script)
+{
+	node_t *probe;
+
+	fprintf(stderr, "\nstats:\n  %-32s %6s %10s %10s %10s\n",
+		"probe", "sites", "runs", "ns/run", "total ms");
+
+	node_foreach(probe, script->script.probes)
+		stats_dump_probe(probe);
+
+	if (script->dyn->script.evp)
+		stats_dump_evpipe(script->dyn->script.evp);
+}
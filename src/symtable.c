@@ -30,7 +30,7 @@ int sym_fdump(sym_t *s, FILE *fp)
 	if (s->type != TYPE_MAP && s->type != TYPE_VAR) {
 		_d("corrupt sym (%s)", type_str(s->type));
 		return -EINVAL;
-	} else if (s->type == TYPE_MAP && !strcmp(s->name, "stack")) {
+	} else if (s->type == TYPE_MAP && !s->probe) {
 		fprintf(fp, "%s\n", s->name);
 		return 0;
 	}
@@ -120,47 +120,139 @@ int symtable_fdump(symtable_t *st, FILE *fp)
 	return 0;
 }
 
-#ifdef LINUX_HAS_STACKMAP
-sym_t *symtable_get_stack(symtable_t *st)
+#define SYM_INDEX_MIN 64
+
+/* the map index leaves the probe out of the key */
+static node_t *sym_index_probe(sym_t *s, int by_probe)
 {
-	sym_t *s;
+	return by_probe ? s->probe : NULL;
+}
 
-	sym_foreach(s, st->syms) {
-		if (s->type == TYPE_MAP && !strcmp(s->name, "stack"))
-			return s;
+static size_t sym_hash(type_t type, const char *name, node_t *probe)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	/* fnv-1a */
+	for (; *name; name++)
+		h = (h ^ (uint8_t)*name) * 0x100000001b3ULL;
+
+	h = (h ^ (uintptr_t)probe) * 0x100000001b3ULL;
+	h = (h ^ type) * 0x100000001b3ULL;
+	return h ^ (h >> 32);
+}
+
+static sym_t **sym_index_slot(struct sym_index *idx, int by_probe,
+			      type_t type, const char *name, node_t *probe)
+{
+	sym_t **slot;
+	size_t i;
+
+	i = sym_hash(type, name, probe) & (idx->size - 1);
+	for (;; i = (i + 1) & (idx->size - 1)) {
+		slot = &idx->slots[i];
+
+		if (!*slot ||
+		    ((*slot)->type == type &&
+		     sym_index_probe(*slot, by_probe) == probe &&
+		     !strcmp((*slot)->name, name)))
+			return slot;
+	}
+}
+
+static sym_t *sym_index_get(struct sym_index *idx, int by_probe,
+			    type_t type, const char *name, node_t *probe)
+{
+	if (!idx->size)
+		return NULL;
+
+	return *sym_index_slot(idx, by_probe, type, name, probe);
+}
+
+static void sym_index_add(struct sym_index *idx, int by_probe, sym_t *s)
+{
+	struct sym_index old = *idx;
+	sym_t **slot;
+
+	/* keep the load below one half */
+	if ((idx->n + 1) * 2 > idx->size) {
+		idx->size  = old.size ? old.size * 2 : SYM_INDEX_MIN;
+		idx->n     = 0;
+		idx->slots = calloc(idx->size, sizeof(*idx->slots));
+		assert(idx->slots);
+
+		for (slot = old.slots; slot < &old.slots[old.size]; slot++)
+			if (*slot)
+				sym_index_add(idx, by_probe, *slot);
+
+		free(old.slots);
 	}
 
-	return NULL;
+	slot = sym_index_slot(idx, by_probe, s->type, s->name,
+			      sym_index_probe(s, by_probe));
+	if (*slot)
+		return;
+
+	*slot = s;
+	idx->n++;
 }
 
-int symtable_ref_stack(symtable_t *st)
+static void symtable_add(symtable_t *st, sym_t *s)
+{
+	if (st->syms)
+		insque(s, st->last);
+	else
+		st->syms = s;
+
+	st->last = s;
+	sym_index_add(&st->refs, 1, s);
+}
+
+static sym_t *symtable_get_internal(symtable_t *st, const char *name)
+{
+	return sym_index_get(&st->refs, 1, TYPE_MAP, name, NULL);
+}
+
+static sym_t *symtable_ref_internal(symtable_t *st, const char *name,
+				    enum bpf_map_type type,
+				    size_t ksize, size_t vsize, size_t nelem)
 {
 	sym_t *s;
 
-	s = symtable_get_stack(st);
+	s = symtable_get_internal(st, name);
 	if (s)
-		return 0;
+		return s;
 
 	s = calloc(1, sizeof(*s));
 	assert(s);
 
 	s->type = TYPE_MAP;
-	s->name = strdup("stack"); /* user maps start with @ => no conflict */
+	s->name = strdup(name); /* user maps start with @ => no conflict */
 
 	s->map = calloc(1, sizeof(*s->map));
 	assert(s->map);
 
-	s->map->type  = BPF_MAP_TYPE_STACK_TRACE;
-	s->map->ksize = sizeof(uint32_t);
-	s->map->vsize = sizeof(uint64_t) * 0x10; /* save 16 frames */
-	s->map->nelem = G.map_nelem;
+	s->map->type  = type;
+	s->map->ksize = ksize;
+	s->map->vsize = vsize;
+	s->map->nelem = nelem;
 	s->map->fd    = -1;
+	s->map->fd_alt = -1;
 
-	if (st->syms)
-		insque_tail(s, st->syms);
-	else
-		st->syms = s;
+	symtable_add(st, s);
+	return s;
+}
+
+#ifdef LINUX_HAS_STACKMAP
+sym_t *symtable_get_stack(symtable_t *st)
+{
+	return symtable_get_internal(st, "stack");
+}
 
+int symtable_ref_stack(symtable_t *st)
+{
+	symtable_ref_internal(st, "stack", BPF_MAP_TYPE_STACK_TRACE,
+			      sizeof(uint32_t), sizeof(uint64_t) * G.stack_depth,
+			      G.map_nelem);
 	return 0;
 }
 #else
@@ -168,18 +260,45 @@ sym_t *symtable_get_stack(symtable_t *st) { return NULL; }
 int    symtable_ref_stack(symtable_t *st) { _d(""); return -ENOSYS; }
 #endif	/* LINUX_HAS_STACKMAP */
 
-static sym_t *symtable_get(symtable_t *st, node_t *n)
+#ifdef LINUX_HAS_MAP_VALUE
+sym_t *symtable_get_ctrl(symtable_t *st)
 {
-	sym_t *s;
+	return symtable_get_internal(st, "ctrl");
+}
 
-	sym_foreach(s, st->syms) {
-		if (s->type == n->type &&
-		    !strcmp(s->name, n->string) &&
-		    node_get_probe(n) == s->probe)
-			return s;
-	}
+int symtable_ref_ctrl(symtable_t *st)
+{
+	/* a single u32 holding the active half of all
+	 * double-buffered maps */
+	symtable_ref_internal(st, "ctrl", BPF_MAP_TYPE_ARRAY,
+			      sizeof(uint32_t), sizeof(uint32_t), 1);
+	return 0;
+}
+
+sym_t *symtable_get_drops(symtable_t *st)
+{
+	return symtable_get_internal(st, "drops");
+}
+
+int symtable_ref_drops(symtable_t *st, int n_maps)
+{
+	/* one u64 per user map, counting its failed updates */
+	symtable_ref_internal(st, "drops", BPF_MAP_TYPE_ARRAY,
+			      sizeof(uint32_t), sizeof(uint64_t) * n_maps, 1);
+	return 0;
+}
+#else
+sym_t *symtable_get_ctrl(symtable_t *st) { return NULL; }
+int    symtable_ref_ctrl(symtable_t *st) { _d(""); return -ENOSYS; }
+
+sym_t *symtable_get_drops(symtable_t *st) { return NULL; }
+int    symtable_ref_drops(symtable_t *st, int n_maps) { _d(""); return -ENOSYS; }
+#endif	/* LINUX_HAS_MAP_VALUE */
 
-	return NULL;
+static sym_t *symtable_get(symtable_t *st, node_t *n)
+{
+	return sym_index_get(&st->refs, 1, n->type, n->string,
+			     node_get_probe(n));
 }
 
 static sym_t *symtable_new(symtable_t *st, node_t *n)
@@ -193,11 +312,7 @@ static sym_t *symtable_new(symtable_t *st, node_t *n)
 	s->name  = strdup(n->string);
 	s->probe = node_get_probe(n);
 
-	if (st->syms)
-		insque_tail(s, st->syms);
-	else
-		st->syms = s;
-
+	symtable_add(st, s);
 	return s;
 }
 
@@ -206,17 +321,17 @@ static struct sym_map_data *symtable_map_data(symtable_t *st, sym_t *ms)
 	struct sym_map_data *md;
 	sym_t *s;
 
-	sym_foreach(s, st->syms) {
-		if (s->type == ms->type &&
-		    !strcmp(s->name, ms->name) &&
-		    s->map)
-			return s->map;
-	}
+	s = sym_index_get(&st->maps, 0, ms->type, ms->name, NULL);
+	if (s)
+		return s->map;
+
+	sym_index_add(&st->maps, 0, ms);
 
 	md = calloc(1, sizeof(*md));
 	assert(md);
 
 	md->fd    = -1;
+	md->fd_alt = -1;
 	md->type  = BPF_MAP_TYPE_HASH;
 	md->nelem = G.map_nelem;
 	return md;
@@ -233,6 +348,7 @@ static int symtable_map_ref(symtable_t *st, node_t *map)
 	s = symtable_new(st, map);
 	s->map = symtable_map_data(st, s);
 	s->map->map = map;
+	s->probe->dyn->probe.n_maps++;
 
 found:
 	map->dyn = &s->dyn;
@@ -280,7 +396,76 @@ static int _symtable_populate(node_t *n, void *_st)
 	return 0;
 }
 
+static const struct {
+	const char *name;
+	enum bpf_map_type type;
+} map_decl_types[] = {
+	{ "hash",            BPF_MAP_TYPE_HASH },
+#ifdef LINUX_HAS_PERCPU_MAPS
+	{ "percpu_hash",     BPF_MAP_TYPE_PERCPU_HASH },
+#endif
+#ifdef LINUX_HAS_LRU_MAPS
+	{ "lru_hash",        BPF_MAP_TYPE_LRU_HASH },
+	{ "lru_percpu_hash", BPF_MAP_TYPE_LRU_PERCPU_HASH },
+#endif
+	{ NULL }
+};
+
+/* @map: type([nelem]); */
+static int symtable_decl(symtable_t *st, node_t *decl)
+{
+	node_t *map = decl->method.map, *call = decl->method.call;
+	node_t *nelem = call->call.vargs;
+	struct sym_map_data *md = NULL;
+	sym_t *s;
+	int i;
+
+	for (i = 0; map_decl_types[i].name; i++)
+		if (!strcmp(map_decl_types[i].name, call->string))
+			break;
+
+	if (!map_decl_types[i].name) {
+		_e("%s: unknown map type '%s'", map->string, call->string);
+		return -EINVAL;
+	}
+
+	if (nelem && (nelem->next || nelem->type != TYPE_INT ||
+		      nelem->integer <= 0)) {
+		_e("%s: number of entries must be a positive constant",
+		   map->string);
+		return -EINVAL;
+	}
+
+	s = sym_index_get(&st->maps, 0, TYPE_MAP, map->string, NULL);
+	if (s)
+		md = s->map;
+
+	if (!md) {
+		_w("%s is declared but never used", map->string);
+		return 0;
+	}
+
+	md->type = map_decl_types[i].type;
+	if (nelem)
+		md->nelem = nelem->integer;
+
+	return 0;
+}
+
 int symtable_populate(symtable_t *st, node_t *script)
 {
-	return node_walk(script, NULL, _symtable_populate, st);
+	node_t *decl;
+	int err;
+
+	err = node_walk(script, NULL, _symtable_populate, st);
+	if (err)
+		return err;
+
+	node_foreach(decl, script->script.decls) {
+		err = symtable_decl(st, decl);
+		if (err)
+			return err;
+	}
+
+	return 0;
 }
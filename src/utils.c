@@ -17,8 +17,28 @@
  * along with ply.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
 #include <ply/ply.h>
 
+/* files in shared places, whose contents end up in the kernel or are
+ * mapped without copying, must be ours and only writable by us. */
+int fd_trusted(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st))
+		return -errno;
+
+	if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)))
+		return -EPERM;
+
+	return 0;
+}
+
 char *str_escape(char *str)
 {
 	char *in, *out;